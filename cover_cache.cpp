@@ -0,0 +1,644 @@
+#include "cover_cache.h"
+
+#include <stdexcept>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+
+//==============================================================================
+//  CoverImage
+//==============================================================================
+const int CoverImage::LEVEL_SIZES[] = { 320, 160, 64, 32 };
+const int CoverImage::NUM_LEVELS = sizeof(LEVEL_SIZES) / sizeof(LEVEL_SIZES[0]);
+const int CoverImage::NUM_COLORS = 5;
+const int CoverImage::ANALYSIS_SIZE = 64;
+const int CoverImage::BACKDROP_SIZE = 160;
+const int CoverImage::BACKDROP_RADIUS = 12;
+
+//------------------------------------------------------------------------------
+//  長辺が size 以上のレベルのうち最も小さいものを返す
+//  （size がどのレベルよりも大きければ最大のレベル、画像が無ければ NULL）
+//------------------------------------------------------------------------------
+template <class T> static T *selectLevel(std::vector<T>& levels, int size)
+{
+    for( auto i = levels.rbegin() ; i != levels.rend() ; i++ )
+    {
+        if( std::max(i->getWidth(), i->getHeight()) >= size )
+        {
+            return &*i;
+        }
+    }
+    return levels.empty() ? NULL : &levels.front();
+}
+
+//------------------------------------------------------------------------------
+//  source から各レベルの縮小画像を作る
+//  （縦横比は保ち、長辺が LEVEL_SIZES になるように縮小する。拡大はしない）
+//------------------------------------------------------------------------------
+CoverImage::CoverImage(PNGImage& source, bool packed, int maxSize) : m_accentColor(0x0000)
+{
+    PNGImage *prev = &source;
+    m_levels.reserve(NUM_LEVELS);
+    for( int n = 0 ; n < NUM_LEVELS ; n++ )
+    {
+        int longSide = std::max(prev->getWidth(), prev->getHeight());
+        if( longSide == 0 )
+        {
+            break;
+        }
+        if( longSide <= LEVEL_SIZES[n] )
+        {
+            if( prev == &source )
+            {
+                m_levels.push_back(source);
+                prev = &m_levels.back();
+            }
+            continue;
+        }
+        int width  = std::max(prev->getWidth() * LEVEL_SIZES[n] / longSide, 1);
+        int height = std::max(prev->getHeight() * LEVEL_SIZES[n] / longSide, 1);
+        m_levels.push_back(PNGImage());
+        // 直前のレベルから縮小する（元画像から毎回縮小するより速い）
+        prev->shrink(width, height, m_levels.back());
+        prev = &m_levels.back();
+    }
+
+    analyze();
+
+    if( maxSize > 0 && !m_levels.empty() )
+    {
+        // 背景画像などを作り終えたので、maxSize の表示に使うレベルより大きいものは捨てる
+        size_t top = selectLevel(m_levels, maxSize) - &m_levels[0];
+        m_levels.erase(m_levels.begin(), m_levels.begin() + top);
+    }
+
+    if( packed && !m_levels.empty() )
+    {
+        m_packedLevels.resize(m_levels.size());
+        for( size_t n = 0 ; n < m_levels.size() ; n++ )
+        {
+            m_packedLevels[n].pack(m_levels[n]);
+        }
+        std::vector<PNGImage>().swap(m_levels);
+        m_packedBackdrop.pack(m_backdrop);
+        m_backdrop = PNGImage();
+    }
+}
+
+//------------------------------------------------------------------------------
+//  代表色とぼかした背景画像を求める
+//  （曲が変わるたびに UI スレッドで計算しなくて済むよう、デコード時に作っておく）
+//------------------------------------------------------------------------------
+void CoverImage::analyze()
+{
+    PNGImage *image = selectLevel(m_levels, ANALYSIS_SIZE);
+    if( image == NULL )
+    {
+        return;
+    }
+    image->getDominantColors(NUM_COLORS, m_palette);
+
+    // アクセント色は最も鮮やかな（RGB の最大値と最小値の差が大きい）代表色にする
+    int best = -1;
+    for( auto i = m_palette.begin() ; i != m_palette.end() ; i++ )
+    {
+        int r = (*i >> 11) << 3, g = ((*i >> 5) & 0x3F) << 2, b = (*i & 0x1F) << 3;
+        int chroma = std::max(r, std::max(g, b)) - std::min(r, std::min(g, b));
+        if( chroma > best )
+        {
+            best = chroma;
+            m_accentColor = *i;
+        }
+    }
+
+    selectLevel(m_levels, BACKDROP_SIZE)->blur(BACKDROP_RADIUS, 3, m_backdrop);
+}
+
+//------------------------------------------------------------------------------
+PNGImage *CoverImage::getLevel(int size)
+{
+    return selectLevel(m_levels, size);
+}
+
+//------------------------------------------------------------------------------
+PackedImage *CoverImage::getPackedLevel(int size)
+{
+    return selectLevel(m_packedLevels, size);
+}
+
+//------------------------------------------------------------------------------
+size_t CoverImage::getDataSize()
+{
+    size_t size = 0;
+    for( auto i = m_levels.begin() ; i != m_levels.end() ; i++ )
+    {
+        size += i->getData().size() * sizeof(uint16_t);
+    }
+    for( auto i = m_packedLevels.begin() ; i != m_packedLevels.end() ; i++ )
+    {
+        size += i->getDataSize();
+    }
+    size += m_backdrop.getData().size() * sizeof(uint16_t) + m_packedBackdrop.getDataSize();
+    return size;
+}
+
+
+
+//==============================================================================
+//  CoverCache
+//==============================================================================
+const size_t CoverCache::DEFAULT_CAPACITY     = 16 * 1024 * 1024;
+const int    CoverCache::PREFETCH_INTERVAL_MS = 20;
+const int    CoverCache::WORKER_NICE          = 10;
+const int    CoverCache::RETRY_MIN_MS         = 5000;
+const int    CoverCache::RETRY_MAX_MS         = 5 * 60 * 1000;
+
+//------------------------------------------------------------------------------
+CoverCache::CoverCache(MPDClient *client, size_t capacity, bool packed, int maxSize)
+    : m_client(client), m_capacity(capacity), m_usage(0), m_packed(packed), m_maxSize(maxSize), m_terminated(false),
+      m_guard(std::make_shared<Guard>())
+{
+    m_thread = new std::thread([this](){ execute(); });
+}
+
+//------------------------------------------------------------------------------
+CoverCache::~CoverCache()
+{
+    m_mutex.lock();
+    for( auto i = m_entries.begin() ; i != m_entries.end() ; i++ )
+    {
+        if( i->second.state == STATE_FETCHING )
+        {
+            m_client->cancelCoverArt(i->first->getCoverArtURI());
+        }
+    }
+    m_terminated = true;
+    m_condition.notify_all();
+    m_mutex.unlock();
+
+    // 転送中の要求の handler が後から呼ばれても何もしないようにする
+    m_guard->mutex.lock();
+    m_guard->alive = false;
+    m_guard->mutex.unlock();
+
+    m_thread->join();
+    delete m_thread;
+}
+
+//------------------------------------------------------------------------------
+//  展開済みの画像を返す（まだ展開されていなければ NULL）
+//------------------------------------------------------------------------------
+std::shared_ptr<CoverImage> CoverCache::getImage(Album *album)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(album);
+    if( i == m_entries.end() || i->second.state != STATE_READY )
+    {
+        return std::shared_ptr<CoverImage>();
+    }
+    m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+    return i->second.image;
+}
+
+//------------------------------------------------------------------------------
+//  カバーアートの展開を要求する
+//  既に要求済みの場合は、より高い優先度が指定されたときだけ優先度を引き上げる
+//  読み込めなかったものは、fail() で決めた時刻を過ぎていれば要求し直す
+//------------------------------------------------------------------------------
+void CoverCache::request(Album *album, int priority)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(album);
+    if( i == m_entries.end() )
+    {
+        Entry& entry = m_entries[album];
+        entry.state = STATE_QUEUED;
+        entry.priority = priority;
+        m_queue[priority].push_back(album);
+        m_condition.notify_one();
+        return;
+    }
+
+    Entry& entry = i->second;
+    if( entry.state == STATE_FAILED )
+    {
+        if( std::chrono::steady_clock::now() >= entry.retry )
+        {
+            entry.state = STATE_QUEUED;
+            entry.priority = priority;
+            m_queue[priority].push_back(album);
+            m_condition.notify_one();
+        }
+        return;
+    }
+    if( priority >= entry.priority )
+    {
+        return;
+    }
+    switch( entry.state )
+    {
+        case STATE_QUEUED:
+            removeFromQueue(album, entry.priority);
+            m_queue[priority].push_back(album);
+            break;
+        case STATE_FETCHING:
+            // 転送待ちのままであれば、表示中の要求として出し直す
+            if( m_client->cancelCoverArt(album->getCoverArtURI()) )
+            {
+                fetch(album, priority);
+            }
+            break;
+    }
+    entry.priority = priority;
+}
+
+//------------------------------------------------------------------------------
+//  展開待ち・転送中の要求を取り消す（展開済みの画像はそのまま残す）
+//------------------------------------------------------------------------------
+void CoverCache::cancel(Album *album)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(album);
+    if( i != m_entries.end() )
+    {
+        cancelEntry(i);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  albums に含まれないアルバムの展開待ち・転送中の要求をすべて取り消す
+//------------------------------------------------------------------------------
+void CoverCache::retain(const std::set<Album *>& albums)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.begin();
+    while( i != m_entries.end() )
+    {
+        auto current = i++;
+        if( albums.find(current->first) == albums.end() )
+        {
+            cancelEntry(current);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void CoverCache::cancelEntry(std::map<Album *, Entry>::iterator i)
+{
+    switch( i->second.state )
+    {
+        case STATE_QUEUED:
+            removeFromQueue(i->first, i->second.priority);
+            m_entries.erase(i);
+            break;
+        case STATE_FETCHING:
+            // 既に転送が始まっている場合、完了時の onFetched() で結果が捨てられる
+            m_client->cancelCoverArt(i->first->getCoverArtURI());
+            m_entries.erase(i);
+            break;
+        case STATE_DECODING:
+            // 転送済みでデコード待ちのものは捨てる。ワーカーが既にデコード中の場合は、
+            // decode() がエントリの状態を確かめて結果を捨てる
+            removeFromFetched(i->first);
+            m_entries.erase(i);
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+void CoverCache::removeFromQueue(Album *album, int priority)
+{
+    std::deque<Album *>& queue = m_queue[priority];
+    queue.erase(std::remove(queue.begin(), queue.end(), album), queue.end());
+}
+
+//------------------------------------------------------------------------------
+void CoverCache::removeFromFetched(Album *album)
+{
+    m_fetched.erase(std::remove_if(m_fetched.begin(), m_fetched.end(), [album](const Job& job){
+        return job.album == album;
+    }), m_fetched.end());
+}
+
+//------------------------------------------------------------------------------
+//  MPD サーバーへカバーアートの転送を要求する（m_mutex をロックした状態で呼ぶこと）
+//------------------------------------------------------------------------------
+void CoverCache::fetch(Album *album, int priority)
+{
+    std::shared_ptr<Guard> guard = m_guard;
+    m_client->fetchCoverArt(album->getCoverArtURI(), [this, guard, album](std::vector<uint8_t>& data){
+        std::lock_guard<std::mutex> lock(guard->mutex);
+        if( guard->alive )
+        {
+            onFetched(album, data);
+        }
+    }, priority == PRIORITY_PREFETCH);
+}
+
+//------------------------------------------------------------------------------
+//  転送の完了（MPDClient の転送用レーンのスレッドで呼ばれる）
+//------------------------------------------------------------------------------
+void CoverCache::onFetched(Album *album, std::vector<uint8_t>& data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(album);
+    if( i == m_entries.end() || i->second.state != STATE_FETCHING )
+    {
+        // 取り消された
+        return;
+    }
+    if( data.empty() )
+    {
+        fail(i->second);
+        return;
+    }
+
+    i->second.state = STATE_DECODING;
+    Job job;
+    job.album = album;
+    job.data.swap(data);
+    if( i->second.priority == PRIORITY_VISIBLE )
+    {
+        m_fetched.push_front(std::move(job));
+    }
+    else
+    {
+        m_fetched.push_back(std::move(job));
+    }
+    m_condition.notify_one();
+}
+
+//------------------------------------------------------------------------------
+//  デコード処理（バックグラウンドスレッドで実行）
+//------------------------------------------------------------------------------
+void CoverCache::execute()
+{
+    // デコードは MPD やタッチ処理の邪魔をしないよう低い優先度で実行する
+    ::setpriority(PRIO_PROCESS, (id_t)::syscall(SYS_gettid), WORKER_NICE);
+
+    while( true )
+    {
+        Job job;
+        int priority;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this](){
+                return m_terminated || !m_fetched.empty()
+                    || !m_queue[PRIORITY_VISIBLE].empty() || !m_queue[PRIORITY_PREFETCH].empty();
+            });
+            if( m_terminated )
+            {
+                break;
+            }
+
+            if( !m_fetched.empty() )
+            {
+                job = std::move(m_fetched.front());
+                m_fetched.pop_front();
+                auto i = m_entries.find(job.album);
+                if( i == m_entries.end() || i->second.state != STATE_DECODING )
+                {
+                    // 取り消された
+                    continue;
+                }
+                priority = i->second.priority;
+            }
+            else
+            {
+                priority = m_queue[PRIORITY_VISIBLE].empty() ? PRIORITY_PREFETCH : PRIORITY_VISIBLE;
+                job.album = m_queue[priority].front();
+                m_queue[priority].pop_front();
+                if( m_client != NULL )
+                {
+                    // 転送は MPDClient の転送用レーンに任せ、完了後にデコードする
+                    m_entries[job.album].state = STATE_FETCHING;
+                    fetch(job.album, priority);
+                    continue;
+                }
+                m_entries[job.album].state = STATE_DECODING;
+            }
+        }
+
+        decode(job);
+
+        if( priority == PRIORITY_PREFETCH )
+        {
+            // 先読みは CPU を使い切らないよう間隔を空ける
+            std::this_thread::sleep_for(std::chrono::milliseconds(PREFETCH_INTERVAL_MS));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void CoverCache::decode(Job& job)
+{
+    if( job.data.empty() )
+    {
+        PNGImage::load(job.album->getCoverImagePath().c_str(), job.data);
+    }
+
+    // 同じ内容の画像が展開済みであれば、デコードせずにそれを共有する
+    uint64_t key = job.data.empty() ? 0 : PNGImage::hash(&job.data[0], job.data.size());
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( !job.data.empty() && attach(job.album, key) )
+        {
+            return;
+        }
+    }
+
+    PNGImage source;
+    try
+    {
+        if( job.data.empty() )
+        {
+            throw std::runtime_error("No image data");
+        }
+        source.read(&job.data[0], job.data.size());
+    }
+    catch( std::exception& e )
+    {
+        std::cerr << "Cover art of " << job.album->getTitle() << ": " << e.what() << std::endl;
+    }
+    std::shared_ptr<CoverImage> image = std::make_shared<CoverImage>(source, m_packed, m_maxSize);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto i = m_entries.find(job.album);
+    if( i == m_entries.end() || i->second.state != STATE_DECODING )
+    {
+        // デコード中に取り消された（要求し直されたものは、改めて転送した結果でデコードする）
+        return;
+    }
+    if( image->getNumLevels() == 0 )
+    {
+        fail(i->second);
+        return;
+    }
+    if( m_images.find(key) == m_images.end() )
+    {
+        SharedImage& shared = m_images[key];
+        shared.image = image;
+        shared.users = 0;
+        m_usage += image->getDataSize();
+    }
+    attach(job.album, key);
+    evict();
+}
+
+//------------------------------------------------------------------------------
+//  読み込めなかったエントリを STATE_FAILED にする
+//  転送のタイムアウトなど一時的な失敗もあるので、続けて失敗するたびに間隔を倍々に
+//  広げながら（RETRY_MAX_MS まで）、request() で要求し直せるようにする
+//  （m_mutex をロックした状態で呼ぶこと）
+//------------------------------------------------------------------------------
+void CoverCache::fail(Entry& entry)
+{
+    int interval = RETRY_MIN_MS << std::min(entry.failures, 10);
+    entry.state = STATE_FAILED;
+    entry.failures++;
+    entry.retry = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::min(interval, RETRY_MAX_MS));
+}
+
+//------------------------------------------------------------------------------
+//  展開済みの画像 key を album のエントリに割り当てる
+//  （m_mutex をロックした状態で呼ぶこと。画像が無ければ false を返す）
+//  デコード中に取り消された・要求し直されたエントリには割り当てない
+//------------------------------------------------------------------------------
+bool CoverCache::attach(Album *album, uint64_t key)
+{
+    auto s = m_images.find(key);
+    if( s == m_images.end() )
+    {
+        return false;
+    }
+    auto i = m_entries.find(album);
+    if( i != m_entries.end() && i->second.state == STATE_DECODING )
+    {
+        Entry& entry = i->second;
+        entry.state = STATE_READY;
+        entry.image = s->second.image;
+        entry.key = key;
+        entry.failures = 0;
+        s->second.users++;
+        m_lru.push_front(album);
+        entry.lru = m_lru.begin();
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  展開済み画像の合計サイズが上限を超えたら、最も長く使われていないものから破棄する
+//  （m_mutex をロックした状態で呼ぶこと）
+//------------------------------------------------------------------------------
+void CoverCache::evict()
+{
+    while( m_usage > m_capacity && m_lru.size() > 1 )
+    {
+        Album *album = m_lru.back();
+        m_lru.pop_back();
+        auto i = m_entries.find(album);
+        auto s = m_images.find(i->second.key);
+        if( --s->second.users == 0 )
+        {
+            // どのアルバムからも参照されなくなった
+            m_usage -= s->second.image->getDataSize();
+            m_images.erase(s);
+        }
+        m_entries.erase(i);
+    }
+}
+
+
+
+//==============================================================================
+//  CoverPrefetcher
+//==============================================================================
+const int    CoverPrefetcher::MAX_LOOKAHEAD      = 24;
+const int    CoverPrefetcher::LOOKBEHIND         = 2;
+const double CoverPrefetcher::PREDICTION_SECONDS = 0.5;
+const double CoverPrefetcher::VELOCITY_SMOOTHING = 0.6;
+const int    CoverPrefetcher::IDLE_RESET_MS      = 300;
+
+//------------------------------------------------------------------------------
+CoverPrefetcher::CoverPrefetcher(CoverCache *cache, int lookahead)
+    : m_cache(cache), m_lookahead(lookahead), m_lastFirst(-1), m_velocity(0.0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+//  ブラウズ対象のアルバムのリストを設定する
+//------------------------------------------------------------------------------
+void CoverPrefetcher::setAlbums(const std::vector<Album *>& albums)
+{
+    m_albums = albums;
+    m_lastFirst = -1;
+    m_velocity = 0.0;
+    m_cache->retain(std::set<Album *>());
+}
+
+//------------------------------------------------------------------------------
+//  表示範囲（先頭のインデックスと表示数）の通知
+//  スクロールのたびに呼ぶ。表示中のアルバムを優先して要求し、スクロールの方向と
+//  速度から予測した範囲を先読みする。予測範囲から外れた要求は取り消す
+//------------------------------------------------------------------------------
+void CoverPrefetcher::update(int first, int count)
+{
+    auto now = std::chrono::steady_clock::now();
+    if( m_lastFirst < 0 )
+    {
+        m_lastFirst = first;
+        m_lastTime = now;
+    }
+    else if( first != m_lastFirst )
+    {
+        double dt = std::chrono::duration<double>(now - m_lastTime).count();
+        if( dt > 0.0 )
+        {
+            double v = (first - m_lastFirst) / dt;
+            m_velocity = VELOCITY_SMOOTHING * m_velocity + (1.0 - VELOCITY_SMOOTHING) * v;
+        }
+        m_lastFirst = first;
+        m_lastTime = now;
+    }
+    else if( now - m_lastTime > std::chrono::milliseconds(IDLE_RESET_MS) )
+    {
+        m_velocity = 0.0;
+    }
+
+    int num = (int)m_albums.size();
+    std::set<Album *> keep;
+    for( int n = std::max(first, 0) ; n < std::min(first + count, num) ; n++ )
+    {
+        m_cache->request(m_albums[n], CoverCache::PRIORITY_VISIBLE);
+        keep.insert(m_albums[n]);
+    }
+
+    // 進行方向を先に、表示範囲に近い順に要求する
+    int ahead = m_lookahead + (int)std::ceil(std::fabs(m_velocity) * PREDICTION_SECONDS);
+    ahead = std::min(ahead, MAX_LOOKAHEAD);
+    int forward = (m_velocity >= 0.0) ? 1 : -1;
+    for( int k = 1 ; k <= ahead + LOOKBEHIND ; k++ )
+    {
+        int dir = (k <= ahead) ? forward : -forward;
+        int distance = (k <= ahead) ? k : k - ahead;
+        int n = (dir > 0) ? first + count - 1 + distance : first - distance;
+        if( n < 0 || n >= num )
+        {
+            continue;
+        }
+        m_cache->request(m_albums[n], CoverCache::PRIORITY_PREFETCH);
+        keep.insert(m_albums[n]);
+    }
+
+    m_cache->retain(keep);
+}
@@ -0,0 +1,189 @@
+#ifndef COVER_CACHE_H
+#define COVER_CACHE_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <chrono>
+
+#include "png_image.h"
+#include "mpd_client.h"
+
+//------------------------------------------------------------------------------
+//  １枚のカバーアートを段階的に縮小した画像の系列（ミップマップ）
+//  表示するサイズに最も近いレベルを getLevel() で選んで描画する。
+//  元の解像度の画像は保持しない。maxSize を指定した場合は、そのサイズの表示に使う
+//  レベルより大きいものも保持しない（サムネイルだけを表示する場合など）
+//  packed を指定した場合は各レベルを圧縮して保持し、getPackedLevel() で選んだものを描画時に展開する
+//  再生中画面の背景・アクセントに使う代表色とぼかした背景画像も合わせて保持する
+//------------------------------------------------------------------------------
+class CoverImage
+{
+    private:
+        static const int LEVEL_SIZES[];
+        static const int NUM_LEVELS;
+        static const int NUM_COLORS;
+        static const int ANALYSIS_SIZE;
+        static const int BACKDROP_SIZE;
+        static const int BACKDROP_RADIUS;
+
+        std::vector<PNGImage>    m_levels;          // 大きい順
+        std::vector<PackedImage> m_packedLevels;    // 圧縮して保持する場合（m_levels は空になる）
+        std::vector<uint16_t>    m_palette;         // 代表色（占める割合の大きい順）
+        uint16_t                 m_accentColor;     // 代表色のうち最も鮮やかなもの
+        PNGImage                 m_backdrop;        // 背景用のぼかした画像
+        PackedImage              m_packedBackdrop;  // 圧縮して保持する場合（m_backdrop は空になる）
+
+        void analyze();
+
+    public:
+        CoverImage(PNGImage& source, bool packed = false, int maxSize = 0);
+        bool isPacked(){ return !m_packedLevels.empty(); }
+        PNGImage *getLevel(int size);
+        PackedImage *getPackedLevel(int size);
+        int getNumLevels(){ return (int)(isPacked() ? m_packedLevels.size() : m_levels.size()); }
+        size_t getDataSize();
+        std::vector<uint16_t>& getPalette(){ return m_palette; }
+        uint16_t getDominantColor(){ return m_palette.empty() ? 0x0000 : m_palette[0]; }
+        uint16_t getAccentColor(){ return m_accentColor; }
+        PNGImage *getBackdrop(){ return isPacked() ? NULL : &m_backdrop; }
+        PackedImage *getPackedBackdrop(){ return isPacked() ? &m_packedBackdrop : NULL; }
+};
+
+//------------------------------------------------------------------------------
+//  カバーアート画像のキャッシュ
+//  展開（デコード）は専用のワーカースレッドで行い、UI スレッドは展開済みの画像を
+//  getImage() で受け取るだけにする。MPDClient を渡した場合は MPD サーバーから、
+//  NULL の場合は /mnt/music 以下の coverart.png から読み込む
+//  maxSize には表示する最大のサイズ（長辺のピクセル数）を指定する。0 なら全レベルを保持する
+//------------------------------------------------------------------------------
+class CoverCache
+{
+    public:
+        enum {
+            PRIORITY_VISIBLE  = 0,  // 画面に表示中
+            PRIORITY_PREFETCH = 1   // 先読み
+        };
+
+    private:
+        static const size_t DEFAULT_CAPACITY;
+        static const int    PREFETCH_INTERVAL_MS;
+        static const int    WORKER_NICE;
+        static const int    RETRY_MIN_MS;
+        static const int    RETRY_MAX_MS;
+
+        enum {
+            STATE_QUEUED,       // デコード待ち
+            STATE_FETCHING,     // MPD サーバーから転送中
+            STATE_DECODING,     // デコード中
+            STATE_READY,        // 展開済み
+            STATE_FAILED        // 読み込めなかった
+        };
+
+        struct Entry
+        {
+            int                       state;
+            int                       priority;
+            std::shared_ptr<CoverImage> image;
+            uint64_t                  key;      // 画像の内容のハッシュ値
+            std::list<Album *>::iterator lru;
+            int                       failures; // 続けて失敗した回数
+            std::chrono::steady_clock::time_point retry;    // STATE_FAILED の場合、要求し直せる時刻
+
+            Entry() : state(STATE_QUEUED), priority(PRIORITY_VISIBLE), key(0), failures(0){}
+        };
+
+        // 内容が同じカバーアートは、展開済みの画像を複数のアルバムで共有する
+        struct SharedImage
+        {
+            std::shared_ptr<CoverImage> image;
+            int                         users;  // この画像を参照しているエントリの数
+        };
+
+        // 転送完了の handler が CoverCache の破棄後に呼ばれた場合に備える
+        struct Guard
+        {
+            std::mutex mutex;
+            bool       alive;
+            Guard() : alive(true){}
+        };
+
+        struct Job
+        {
+            Album               *album;
+            std::vector<uint8_t> data;      // 転送済みのデータ（ファイルから読む場合は空）
+        };
+
+        MPDClient                *m_client;
+        std::map<Album *, Entry>  m_entries;
+        std::map<uint64_t, SharedImage> m_images;   // 画像の内容のハッシュ値 → 展開済みの画像
+        std::deque<Album *>       m_queue[2];   // PRIORITY_xxxx ごとのデコード待ち
+        std::deque<Job>           m_fetched;    // 転送が完了してデコードを待つもの
+        std::list<Album *>        m_lru;        // 展開済みの画像（先頭ほど最近使われた）
+        size_t                    m_capacity;   // 展開済み画像の合計サイズの上限（バイト、共有している画像は１回だけ数える）
+        size_t                    m_usage;
+        bool                      m_packed;     // 展開済み画像を圧縮して保持する場合は true
+        int                       m_maxSize;    // 表示する最大のサイズ（0 なら制限しない）
+
+        bool                      m_terminated;
+        std::thread              *m_thread;
+        std::mutex                m_mutex;
+        std::condition_variable   m_condition;
+        std::shared_ptr<Guard>    m_guard;
+
+        void execute();
+        void fetch(Album *album, int priority);
+        void decode(Job& job);
+        bool attach(Album *album, uint64_t key);
+        void fail(Entry& entry);
+        void onFetched(Album *album, std::vector<uint8_t>& data);
+        void cancelEntry(std::map<Album *, Entry>::iterator i);
+        void removeFromQueue(Album *album, int priority);
+        void removeFromFetched(Album *album);
+        void evict();
+
+    public:
+        CoverCache(MPDClient *client = NULL, size_t capacity = DEFAULT_CAPACITY, bool packed = false, int maxSize = 0);
+        ~CoverCache();
+        std::shared_ptr<CoverImage> getImage(Album *album);
+        void request(Album *album, int priority = PRIORITY_VISIBLE);
+        void cancel(Album *album);
+        void retain(const std::set<Album *>& albums);
+};
+
+//------------------------------------------------------------------------------
+//  スクロール位置と速度からこの先表示されるアルバムを予測して、
+//  カバーアートを先読みする
+//------------------------------------------------------------------------------
+class CoverPrefetcher
+{
+    private:
+        static const int    MAX_LOOKAHEAD;
+        static const int    LOOKBEHIND;
+        static const double PREDICTION_SECONDS;
+        static const double VELOCITY_SMOOTHING;
+        static const int    IDLE_RESET_MS;
+
+        CoverCache            *m_cache;
+        std::vector<Album *>   m_albums;
+        int                    m_lookahead;     // 停止時に先読みするアルバム数
+        int                    m_lastFirst;
+        double                 m_velocity;      // スクロール速度（アルバム数/秒、正が下方向）
+        std::chrono::steady_clock::time_point m_lastTime;
+
+    public:
+        CoverPrefetcher(CoverCache *cache, int lookahead = 4);
+        void setAlbums(const std::vector<Album *>& albums);
+        void update(int first, int count);
+        double getVelocity(){ return m_velocity; }
+};
+
+#endif
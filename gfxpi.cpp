@@ -621,6 +621,19 @@ void GraphicsPI::drawImage(Rect& r, std::vector<uint16_t>& image)
      }
 }
 
+//------------------------------------------------------------------------------
+//   圧縮された画像をフレームバッファの各行へ直接展開して描画する
+//   画面と画像の外にはみ出す部分は描かない
+//------------------------------------------------------------------------------
+void GraphicsPI::drawImage(Rect& r, PackedImage& image)
+{
+     if( !m_available ){ return; }
+
+     int right  = std::min<int>(r.left + r.width, m_vinfo.xres);
+     int bottom = std::min<int>(r.top + r.height, m_vinfo.yres);
+     image.unpack(r.left, r.top, m_fbp, right, bottom, m_finfo.line_length / 2);
+}
+
 //------------------------------------------------------------------------------
 void GraphicsPI::getImage(Rect& r, std::vector<uint16_t>& image)
 {
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <vector>
 #include <map>
+#include "png_image.h"
 
 #define   COLOR_WHITE                   0xFFFF
 #define   COLOR_SNOW                    0xFFDE
@@ -362,6 +363,7 @@ class GraphicsPI
           void drawText(Rect& r, const char *str, uint8_t align, uint16_t fgcol);
           void drawText(Rect& r, const char *str, uint8_t align, uint16_t fgcol, uint16_t bkcol);
           void drawImage(Rect& r, std::vector<uint16_t>& image);
+          void drawImage(Rect& r, PackedImage& image);
           void getImage(Rect& r, std::vector<uint16_t>& image);
 };
 
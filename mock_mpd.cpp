@@ -0,0 +1,917 @@
+#include "mock_mpd.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+//==============================================================================
+//  MockMPD
+//==============================================================================
+const char *MockMPD::GREETING = "OK MPD 0.23.5\n";
+
+static const double SONG_DURATION = 240.0;     // 曲の長さ（すべて同じ）
+static const int    POLL_INTERVAL_MS = 100;    // 終了の確認の間隔
+
+static const int ACK_ERROR_ARG      = 2;
+static const int ACK_ERROR_UNKNOWN  = 5;
+static const int ACK_ERROR_SYSTEM   = 52;
+static const int ACK_ERROR_NO_EXIST = 50;
+
+//------------------------------------------------------------------------------
+//  コマンドの行を引数に分ける（"..." の中の \" と \\ を戻す）
+//------------------------------------------------------------------------------
+static void splitArguments(std::string_view line, std::vector<std::string>& args)
+{
+    size_t n = 0;
+    while( n < line.size() )
+    {
+        if( line[n] == ' ' || line[n] == '\t' )
+        {
+            n++;
+            continue;
+        }
+        std::string arg;
+        if( line[n] == '"' )
+        {
+            for( n++ ; n < line.size() && line[n] != '"' ; n++ )
+            {
+                if( line[n] == '\\' && n + 1 < line.size() )
+                {
+                    n++;
+                }
+                arg += line[n];
+            }
+            n++;
+        }
+        else
+        {
+            for( ; n < line.size() && line[n] != ' ' && line[n] != '\t' ; n++ )
+            {
+                arg += line[n];
+            }
+        }
+        args.push_back(arg);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  "START:END" または "POS" を [start, end) にする（無ければ全体）
+//------------------------------------------------------------------------------
+static void parseRange(const std::vector<std::string>& args, size_t index, size_t size, size_t& start, size_t& end)
+{
+    start = 0;
+    end = size;
+    if( args.size() <= index )
+    {
+        return;
+    }
+    const char *p = args[index].c_str();
+    char *colon;
+    start = std::strtoul(p, &colon, 10);
+    if( *colon == ':' )
+    {
+        end = (colon[1] != '\0') ? std::strtoul(colon + 1, NULL, 10) : size;
+    }
+    else
+    {
+        end = start + 1;
+    }
+    start = std::min(start, size);
+    end = std::min(std::max(end, start), size);
+}
+
+//------------------------------------------------------------------------------
+static std::string format(const char *fmt, double value)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), fmt, value);
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+//  port に 0 を指定した場合は空いているポートを使う（getPort() で分かる）
+//------------------------------------------------------------------------------
+MockMPD::MockMPD(int port)
+    : m_listenfd(-1), m_port(0), m_terminated(false), m_thread(NULL), m_version(1), m_nextId(1),
+      m_state(0), m_song(-1), m_volume(50), m_elapsed(0), m_commandCount(0)
+{
+    m_listenfd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    ::setsockopt(m_listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    if( ::bind(m_listenfd, (sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(m_listenfd, 8) != 0 ||
+        ::getsockname(m_listenfd, (sockaddr *)&addr, &length) != 0 )
+    {
+        std::perror("MockMPD");
+        return;
+    }
+    m_port = ntohs(addr.sin_port);
+    m_thread = new std::thread([this](){ accept(); });
+}
+
+//------------------------------------------------------------------------------
+MockMPD::~MockMPD()
+{
+    m_terminated = true;
+    if( m_thread != NULL )
+    {
+        m_thread->join();
+        delete m_thread;
+    }
+    for( auto i = m_workers.begin() ; i != m_workers.end() ; i++ )
+    {
+        i->join();
+    }
+    ::close(m_listenfd);
+}
+
+//------------------------------------------------------------------------------
+void MockMPD::setFaults(const Faults& faults)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_faults = faults;
+}
+
+//------------------------------------------------------------------------------
+//  １行に１曲の URI を書いたファイルをライブラリにする（# で始まる行は無視する）
+//------------------------------------------------------------------------------
+bool MockMPD::loadLibrary(const char *path)
+{
+    std::ifstream file(path);
+    if( !file )
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_library.clear();
+    std::string line;
+    while( std::getline(file, line) )
+    {
+        if( !line.empty() && line[0] != '#' )
+        {
+            m_library.push_back(line);
+        }
+    }
+    std::sort(m_library.begin(), m_library.end());
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  "artistNNN/albumNNNN/trackNN.flac" の形のライブラリを作る（アーティストごとに 10 アルバム）
+//------------------------------------------------------------------------------
+void MockMPD::generateLibrary(int albums, int tracks)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_library.clear();
+    char uri[64];
+    for( int a = 0 ; a < albums ; a++ )
+    {
+        for( int t = 1 ; t <= tracks ; t++ )
+        {
+            std::snprintf(uri, sizeof(uri), "artist%03d/album%04d/track%02d.flac", a / 10, a, t);
+            m_library.push_back(uri);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void MockMPD::setCoverArt(const std::vector<uint8_t>& data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_coverArt = data;
+}
+
+//------------------------------------------------------------------------------
+void MockMPD::accept()
+{
+    pollfd fds;
+    fds.fd = m_listenfd;
+    fds.events = POLLIN;
+    while( !m_terminated )
+    {
+        if( ::poll(&fds, 1, POLL_INTERVAL_MS) <= 0 )
+        {
+            continue;
+        }
+        int fd = ::accept(m_listenfd, NULL, NULL);
+        if( fd < 0 )
+        {
+            continue;
+        }
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        Connection *connection = new Connection();
+        connection->fd = fd;
+        connection->eventfd = ::eventfd(0, EFD_NONBLOCK);
+        connection->idle = 0;
+        connection->pending = 0;
+        connection->binaryLimit = 8192;
+        connection->commands = 0;
+        connection->inList = false;
+        connection->listOk = false;
+        connection->stalled = false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_connections.push_back(connection);
+        m_workers.emplace_back([this, connection](){ serve(connection); });
+    }
+}
+
+//------------------------------------------------------------------------------
+//  １つの接続を処理する（接続ごとのスレッド）
+//------------------------------------------------------------------------------
+void MockMPD::serve(Connection *connection)
+{
+    std::string rx, out;
+    char buffer[4096];
+    bool alive = write(connection, GREETING);
+    while( alive && !m_terminated )
+    {
+        pollfd fds[2];
+        fds[0].fd = connection->fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = connection->eventfd;
+        fds[1].events = POLLIN;
+        if( ::poll(fds, 2, POLL_INTERVAL_MS) <= 0 )
+        {
+            continue;
+        }
+        if( fds[1].revents & POLLIN )
+        {
+            uint64_t value;
+            if( ::read(connection->eventfd, &value, sizeof(value)) > 0 )
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                flushIdle(connection, out);
+            }
+        }
+        if( fds[0].revents & (POLLIN | POLLHUP | POLLERR) )
+        {
+            ssize_t len = ::recv(connection->fd, buffer, sizeof(buffer), 0);
+            if( len <= 0 )
+            {
+                break;
+            }
+            rx.append(buffer, len);
+            size_t pos;
+            while( alive && (pos = rx.find('\n')) != std::string::npos )
+            {
+                alive = process(connection, std::string_view(rx).substr(0, pos), out);
+                rx.erase(0, pos + 1);
+            }
+            int delay;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                delay = m_faults.delayMs;
+            }
+            if( delay > 0 && !out.empty() )
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+            }
+        }
+        if( !out.empty() )
+        {
+            alive = write(connection, out) && alive;
+            out.clear();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ::close(connection->fd);
+    ::close(connection->eventfd);
+    m_connections.remove(connection);
+    delete connection;
+}
+
+//------------------------------------------------------------------------------
+//  Faults::chunkSize を指定した場合は、小分けにして間隔を空けて書き込む
+//------------------------------------------------------------------------------
+bool MockMPD::write(Connection *connection, const std::string& data)
+{
+    size_t chunk;
+    int interval;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        chunk = (m_faults.chunkSize > 0) ? m_faults.chunkSize : data.size();
+        interval = m_faults.chunkDelayMs;
+    }
+    for( size_t n = 0 ; n < data.size() ; )
+    {
+        size_t len = std::min(chunk, data.size() - n);
+        ssize_t sent = ::send(connection->fd, data.data() + n, len, MSG_NOSIGNAL);
+        if( sent < 0 )
+        {
+            return false;
+        }
+        n += sent;
+        if( interval > 0 && n < data.size() )
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  すべての接続に変化を記録し、idle で待っている接続を起こす
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MockMPD::notify(int subsystems)
+{
+    for( auto i = m_connections.begin() ; i != m_connections.end() ; i++ )
+    {
+        (*i)->pending |= subsystems;
+        if( ((*i)->idle & subsystems) != 0 )
+        {
+            uint64_t one = 1;
+            ::write((*i)->eventfd, &one, sizeof(one));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  idle で待っているサブシステムに変化があれば応答する
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MockMPD::flushIdle(Connection *connection, std::string& out)
+{
+    static const struct { const char *name; int flag; } table[] = {
+        { "database", SUBSYSTEM_DATABASE },
+        { "mixer",    SUBSYSTEM_MIXER },
+        { "options",  SUBSYSTEM_OPTIONS },
+        { "player",   SUBSYSTEM_PLAYER },
+        { "playlist", SUBSYSTEM_PLAYLIST }
+    };
+    int changed = connection->idle & connection->pending;
+    if( changed == 0 )
+    {
+        return;
+    }
+    for( auto& t : table )
+    {
+        if( changed & t.flag )
+        {
+            out += "changed: ";
+            out += t.name;
+            out += '\n';
+        }
+    }
+    out += "OK\n";
+    connection->pending &= ~changed;
+    connection->idle = 0;
+}
+
+//------------------------------------------------------------------------------
+//  受け付けたコマンドを数えて、注入する障害を決める
+//  切断する場合は false を返す。ACK を返す場合は error にエラーコードを入れる
+//------------------------------------------------------------------------------
+bool MockMPD::count(Connection *connection, const std::string& name, int& error)
+{
+    connection->commands++;
+    uint64_t n = ++m_commandCount;
+    if( m_faults.disconnectAfter > 0 && connection->commands > m_faults.disconnectAfter )
+    {
+        return false;
+    }
+    error = 0;
+    if( (m_faults.failEvery > 0 && n % m_faults.failEvery == 0) || name == m_faults.failCommand )
+    {
+        error = ACK_ERROR_SYSTEM;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  受信した１行を処理して、応答を out に追加する（切断する場合は false を返す）
+//------------------------------------------------------------------------------
+bool MockMPD::process(Connection *connection, std::string_view line, std::string& out)
+{
+    std::vector<std::string> args;
+    splitArguments(line, args);
+    if( args.empty() )
+    {
+        return true;
+    }
+    const std::string& name = args[0];
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if( connection->stalled || name == m_faults.stallCommand )
+    {
+        connection->stalled = true;
+        return true;
+    }
+    if( name == "idle" )
+    {
+        static const char *names[] = { "player", "mixer", "playlist", "options", "database" };
+        connection->idle = 0;
+        for( size_t n = 1 ; n < args.size() ; n++ )
+        {
+            for( int k = 0 ; k < 5 ; k++ )
+            {
+                if( args[n] == names[k] )
+                {
+                    connection->idle |= (1 << k);
+                }
+            }
+        }
+        if( connection->idle == 0 )
+        {
+            connection->idle = SUBSYSTEM_PLAYER | SUBSYSTEM_MIXER | SUBSYSTEM_PLAYLIST | SUBSYSTEM_OPTIONS | SUBSYSTEM_DATABASE;
+        }
+        flushIdle(connection, out);
+        return true;
+    }
+    if( name == "noidle" )
+    {
+        if( connection->idle != 0 )
+        {
+            connection->idle = 0;
+            out += "OK\n";
+        }
+        return true;
+    }
+    if( name == "command_list_begin" || name == "command_list_ok_begin" )
+    {
+        connection->inList = true;
+        connection->listOk = (name == "command_list_ok_begin");
+        connection->list.clear();
+        return true;
+    }
+    if( connection->inList && name != "command_list_end" )
+    {
+        connection->list.push_back(std::string(line));
+        return true;
+    }
+
+    std::vector<std::string> commands;
+    bool list = connection->inList;
+    if( list )
+    {
+        commands.swap(connection->list);
+        connection->inList = false;
+    }
+    else
+    {
+        commands.push_back(std::string(line));
+    }
+    for( size_t n = 0 ; n < commands.size() ; n++ )
+    {
+        std::vector<std::string> command;
+        splitArguments(commands[n], command);
+        std::string error;
+        int code;
+        if( !count(connection, command[0], code) )
+        {
+            return false;
+        }
+        if( code != 0 )
+        {
+            error = "injected failure";
+        }
+        else
+        {
+            code = execute(connection, command, out, error);
+        }
+        if( code != 0 )
+        {
+            out += "ACK [" + std::to_string(code) + "@" + std::to_string(n) + "] {" + command[0] + "} " + error + "\n";
+            return true;
+        }
+        if( list && connection->listOk )
+        {
+            out += "list_OK\n";
+        }
+    }
+    out += "OK\n";
+    return true;
+}
+
+//------------------------------------------------------------------------------
+double MockMPD::getElapsed()
+{
+    if( m_state != 2 )
+    {
+        return m_elapsed;
+    }
+    double e = m_elapsed + std::chrono::duration<double>(std::chrono::steady_clock::now() - m_started).count();
+    return std::min(e, SONG_DURATION);
+}
+
+//------------------------------------------------------------------------------
+//  from 以降の位置を変更したものとして、キューのバージョンを上げる
+//------------------------------------------------------------------------------
+void MockMPD::touchQueue(size_t from)
+{
+    m_version++;
+    for( size_t n = from ; n < m_queue.size() ; n++ )
+    {
+        m_queue[n].version = m_version;
+    }
+    notify(SUBSYSTEM_PLAYLIST);
+}
+
+//------------------------------------------------------------------------------
+void MockMPD::writeSong(size_t pos, std::string& out)
+{
+    writeTags(m_queue[pos].uri, out);
+    out += "Pos: " + std::to_string(pos) + "\n";
+    out += "Id: " + std::to_string(m_queue[pos].id) + "\n";
+}
+
+//------------------------------------------------------------------------------
+//  uri の曲のタグ（"アーティスト/アルバム/曲" の階層から作る）
+//------------------------------------------------------------------------------
+void MockMPD::writeTags(const std::string& uri, std::string& out)
+{
+    size_t first = uri.find('/');
+    size_t last = uri.rfind('/');
+    out += "file: " + uri + "\n";
+    if( first != std::string::npos )
+    {
+        out += "Artist: " + uri.substr(0, first) + "\n";
+        if( last > first )
+        {
+            out += "Album: " + uri.substr(first + 1, last - first - 1) + "\n";
+        }
+    }
+    out += "Title: " + uri.substr(last + 1) + "\n";
+    out += "duration: " + format("%.3f", SONG_DURATION) + "\n";
+}
+
+//------------------------------------------------------------------------------
+//  uri が曲ならその曲を、ディレクトリならその下の曲をすべてキューに追加する
+//------------------------------------------------------------------------------
+int MockMPD::addSongs(const std::string& uri)
+{
+    std::string prefix = uri.empty() ? "" : uri + "/";
+    size_t from = m_queue.size();
+    for( auto i = m_library.begin() ; i != m_library.end() ; i++ )
+    {
+        if( *i == uri || i->compare(0, prefix.size(), prefix) == 0 )
+        {
+            m_queue.push_back(QueueEntry{ m_nextId++, 0, *i });
+        }
+    }
+    if( m_queue.size() == from )
+    {
+        return ACK_ERROR_NO_EXIST;
+    }
+    touchQueue(from);
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  "(artist == "値")" または "(album == "値")" に一致する曲を追加する
+//  （生成したライブラリの１段目をアーティスト、２段目をアルバムとみなす）
+//------------------------------------------------------------------------------
+int MockMPD::findSongs(const std::string& filter)
+{
+    std::vector<std::string> args;
+    if( filter.size() < 2 || filter.front() != '(' || filter.back() != ')' )
+    {
+        return ACK_ERROR_ARG;
+    }
+    splitArguments(std::string_view(filter).substr(1, filter.size() - 2), args);
+    if( args.size() != 3 || args[1] != "==" || (args[0] != "artist" && args[0] != "album") )
+    {
+        return ACK_ERROR_ARG;
+    }
+    size_t level = (args[0] == "artist") ? 0 : 1;
+    size_t from = m_queue.size();
+    for( auto i = m_library.begin() ; i != m_library.end() ; i++ )
+    {
+        size_t begin = 0;
+        for( size_t n = 0 ; n < level && begin != std::string::npos ; n++ )
+        {
+            begin = i->find('/', begin);
+            begin = (begin != std::string::npos) ? begin + 1 : begin;
+        }
+        if( begin != std::string::npos && i->compare(begin, i->find('/', begin) - begin, args[2]) == 0 )
+        {
+            m_queue.push_back(QueueEntry{ m_nextId++, 0, *i });
+        }
+    }
+    if( m_queue.size() != from )
+    {
+        touchQueue(from);
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  コマンドを１つ実行する。成功すれば 0、失敗すれば ACK のエラーコードを返す
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+int MockMPD::execute(Connection *connection, const std::vector<std::string>& args, std::string& out, std::string& error)
+{
+    const std::string& name = args[0];
+    long arg1 = (args.size() > 1) ? std::strtol(args[1].c_str(), NULL, 10) : -1;
+    size_t start, end;
+
+    if( name == "ping" )
+    {
+        return 0;
+    }
+    if( name == "binarylimit" )
+    {
+        connection->binaryLimit = std::max(arg1, 64L);
+        return 0;
+    }
+    if( name == "status" )
+    {
+        static const char *states[] = { "stop", "pause", "play" };
+        out += "volume: " + std::to_string(m_volume) + "\n";
+        out += "repeat: 0\nrandom: 0\nsingle: 0\nconsume: 0\n";
+        out += "playlist: " + std::to_string(m_version) + "\n";
+        out += "playlistlength: " + std::to_string(m_queue.size()) + "\n";
+        out += "mixrampdb: 0.000000\n";
+        out += std::string("state: ") + states[m_state] + "\n";
+        if( m_song >= 0 && m_song < (int)m_queue.size() )
+        {
+            out += "song: " + std::to_string(m_song) + "\n";
+            out += "songid: " + std::to_string(m_queue[m_song].id) + "\n";
+            if( m_state != 0 )
+            {
+                out += "elapsed: " + format("%.3f", getElapsed()) + "\n";
+                out += "duration: " + format("%.3f", SONG_DURATION) + "\n";
+                out += "bitrate: 1411\naudio: 44100:16:2\n";
+            }
+            if( m_song + 1 < (int)m_queue.size() )
+            {
+                out += "nextsong: " + std::to_string(m_song + 1) + "\n";
+                out += "nextsongid: " + std::to_string(m_queue[m_song + 1].id) + "\n";
+            }
+        }
+        return 0;
+    }
+    if( name == "currentsong" )
+    {
+        if( m_song >= 0 && m_song < (int)m_queue.size() )
+        {
+            writeSong(m_song, out);
+        }
+        return 0;
+    }
+    if( name == "play" || name == "next" || name == "previous" )
+    {
+        int song = (name == "play") ? ((arg1 >= 0) ? (int)arg1 : std::max(m_song, 0)) :
+                   (name == "next") ? m_song + 1 : m_song - 1;
+        if( song < 0 || song >= (int)m_queue.size() )
+        {
+            if( name == "play" )
+            {
+                error = "Bad song index";
+                return ACK_ERROR_ARG;
+            }
+            m_state = 0;
+        }
+        else
+        {
+            if( song != m_song || m_state == 0 )
+            {
+                m_elapsed = 0;
+            }
+            else
+            {
+                m_elapsed = getElapsed();
+            }
+            m_song = song;
+            m_state = 2;
+            m_started = std::chrono::steady_clock::now();
+        }
+        notify(SUBSYSTEM_PLAYER);
+        return 0;
+    }
+    if( name == "pause" )
+    {
+        bool pause = (args.size() > 1) ? (arg1 != 0) : (m_state == 2);
+        if( m_state != 0 )
+        {
+            m_elapsed = getElapsed();
+            m_state = pause ? 1 : 2;
+            m_started = std::chrono::steady_clock::now();
+            notify(SUBSYSTEM_PLAYER);
+        }
+        return 0;
+    }
+    if( name == "stop" )
+    {
+        m_state = 0;
+        m_elapsed = 0;
+        notify(SUBSYSTEM_PLAYER);
+        return 0;
+    }
+    if( name == "seekcur" )
+    {
+        if( m_state == 0 || args.size() < 2 )
+        {
+            error = "Not playing";
+            return ACK_ERROR_ARG;
+        }
+        m_elapsed = std::min(std::max(std::strtod(args[1].c_str(), NULL), 0.0), SONG_DURATION);
+        m_started = std::chrono::steady_clock::now();
+        notify(SUBSYSTEM_PLAYER);
+        return 0;
+    }
+    if( name == "setvol" || name == "volume" )
+    {
+        if( args.size() < 2 )
+        {
+            error = "too few arguments";
+            return ACK_ERROR_ARG;
+        }
+        long volume = (name == "setvol") ? arg1 : m_volume + arg1;     // volume は相対値
+        m_volume = std::min(std::max(volume, 0L), 100L);
+        notify(SUBSYSTEM_MIXER);
+        return 0;
+    }
+    if( name == "add" )
+    {
+        int code = addSongs((args.size() > 1) ? args[1] : "");
+        if( code != 0 )
+        {
+            error = "No such directory";
+        }
+        return code;
+    }
+    if( name == "findadd" )
+    {
+        int code = findSongs((args.size() > 1) ? args[1] : "");
+        if( code != 0 )
+        {
+            error = "Unsupported filter";
+        }
+        return code;
+    }
+    if( name == "clear" )
+    {
+        m_queue.clear();
+        m_song = -1;
+        m_state = 0;
+        touchQueue(0);
+        notify(SUBSYSTEM_PLAYER);
+        return 0;
+    }
+    if( name == "delete" )
+    {
+        parseRange(args, 1, m_queue.size(), start, end);
+        if( start >= end )
+        {
+            error = "Bad song index";
+            return ACK_ERROR_ARG;
+        }
+        m_queue.erase(m_queue.begin() + start, m_queue.begin() + end);
+        if( m_song >= (int)end )
+        {
+            m_song -= (int)(end - start);
+        }
+        else if( m_song >= (int)start )
+        {
+            m_state = 0;
+            m_song = -1;
+            notify(SUBSYSTEM_PLAYER);
+        }
+        touchQueue(start);
+        return 0;
+    }
+    if( name == "move" )
+    {
+        size_t from = (size_t)arg1;
+        size_t to = (args.size() > 2) ? std::strtoul(args[2].c_str(), NULL, 10) : m_queue.size();
+        if( from >= m_queue.size() || to >= m_queue.size() )
+        {
+            error = "Bad song index";
+            return ACK_ERROR_ARG;
+        }
+        QueueEntry entry = m_queue[from];
+        m_queue.erase(m_queue.begin() + from);
+        m_queue.insert(m_queue.begin() + to, entry);
+        m_version++;
+        for( size_t n = std::min(from, to) ; n <= std::max(from, to) ; n++ )
+        {
+            m_queue[n].version = m_version;
+        }
+        notify(SUBSYSTEM_PLAYLIST);
+        return 0;
+    }
+    if( name == "plchangesposid" || name == "plchanges" || name == "playlistinfo" )
+    {
+        bool changes = (name != "playlistinfo");
+        uint32_t version = changes ? (uint32_t)arg1 : 0;
+        parseRange(args, changes ? 2 : 1, m_queue.size(), start, end);
+        for( size_t n = start ; n < end ; n++ )
+        {
+            if( changes && m_queue[n].version <= version )
+            {
+                continue;
+            }
+            if( name == "plchangesposid" )
+            {
+                out += "cpos: " + std::to_string(n) + "\nId: " + std::to_string(m_queue[n].id) + "\n";
+            }
+            else
+            {
+                writeSong(n, out);
+            }
+        }
+        return 0;
+    }
+    if( name == "listall" || name == "listallinfo" )
+    {
+        std::string prefix = (args.size() > 1 && !args[1].empty()) ? args[1] + "/" : "";
+        for( auto i = m_library.begin() ; i != m_library.end() ; i++ )
+        {
+            if( i->compare(0, prefix.size(), prefix) == 0 )
+            {
+                if( name == "listallinfo" )
+                {
+                    writeTags(*i, out);
+                }
+                else
+                {
+                    out += "file: " + *i + "\n";
+                }
+            }
+        }
+        return 0;
+    }
+    if( name == "lsinfo" )
+    {
+        // 曲ならその曲を、ディレクトリなら直下のディレクトリと曲を返す
+        std::string uri = (args.size() > 1) ? args[1] : "";
+        std::string prefix = uri.empty() ? "" : uri + "/";
+        std::string last;
+        bool found = uri.empty();
+        for( auto i = m_library.begin() ; i != m_library.end() ; i++ )
+        {
+            if( *i == uri )
+            {
+                writeTags(*i, out);
+                return 0;
+            }
+            if( i->compare(0, prefix.size(), prefix) != 0 )
+            {
+                continue;
+            }
+            found = true;
+            size_t slash = i->find('/', prefix.size());
+            if( slash == std::string::npos )
+            {
+                writeTags(*i, out);
+            }
+            else if( i->compare(0, slash, last) != 0 )
+            {
+                last = i->substr(0, slash);
+                out += "directory: " + last + "\n";
+            }
+        }
+        if( !found )
+        {
+            error = "No such directory";
+            return ACK_ERROR_NO_EXIST;
+        }
+        return 0;
+    }
+    if( name == "albumart" || name == "readpicture" )
+    {
+        size_t offset = (args.size() > 2) ? std::strtoul(args[2].c_str(), NULL, 10) : 0;
+        if( m_coverArt.empty() )
+        {
+            if( name == "readpicture" )
+            {
+                return 0;
+            }
+            error = "No file exists";
+            return ACK_ERROR_NO_EXIST;
+        }
+        offset = std::min(offset, m_coverArt.size());
+        size_t len = std::min(connection->binaryLimit, m_coverArt.size() - offset);
+        out += "size: " + std::to_string(m_coverArt.size()) + "\n";
+        if( name == "readpicture" )
+        {
+            out += "type: image/png\n";
+        }
+        out += "binary: " + std::to_string(len) + "\n";
+        out.append((const char *)m_coverArt.data() + offset, len);
+        out += "\n";
+        return 0;
+    }
+    error = "unknown command \"" + name + "\"";
+    return ACK_ERROR_UNKNOWN;
+}
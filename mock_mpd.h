@@ -0,0 +1,116 @@
+#ifndef MOCK_MPD_H
+#define MOCK_MPD_H
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <vector>
+#include <list>
+#include <chrono>
+
+//------------------------------------------------------------------------------
+//  計測・試験用の MPD サーバーの代わり
+//  MPDClient が使うコマンド（挨拶、status、currentsong、idle/noidle、コマンドリスト、
+//  キュー操作、listallinfo、lsinfo、albumart/readpicture など）だけを、メモリ上のライブラリとキューで処理する
+//  setFaults() で応答の遅延・分割書き込み・切断・ACK を注入できる
+//------------------------------------------------------------------------------
+class MockMPD
+{
+    public:
+        // 注入する障害（既定はすべて無効）
+        struct Faults
+        {
+            int         delayMs;            // 受信してから応答を返すまでの遅延
+            size_t      chunkSize;          // 0 以外なら応答をこの大きさずつに分けて書き込む
+            int         chunkDelayMs;       // 分けて書き込む間隔
+            int         disconnectAfter;    // 0 以外なら、１つの接続でこの数のコマンドを受け付けた後に切断する
+            int         failEvery;          // 0 以外なら、この数ごとのコマンドに ACK を返す
+            std::string failCommand;        // このコマンドには ACK を返す
+            std::string stallCommand;       // このコマンドを受け取った接続は、以後応答しない
+
+            Faults() : delayMs(0), chunkSize(0), chunkDelayMs(0), disconnectAfter(0), failEvery(0){}
+        };
+
+        enum {
+            SUBSYSTEM_PLAYER   = 0x01,
+            SUBSYSTEM_MIXER    = 0x02,
+            SUBSYSTEM_PLAYLIST = 0x04,
+            SUBSYSTEM_OPTIONS  = 0x08,
+            SUBSYSTEM_DATABASE = 0x10
+        };
+
+    private:
+        static const char *GREETING;
+
+        struct QueueEntry
+        {
+            int         id;
+            uint32_t    version;    // この位置が最後に変わったキューのバージョン
+            std::string uri;
+        };
+
+        struct Connection
+        {
+            int      fd;
+            int      eventfd;       // idle 中の接続を起こす
+            int      idle;          // idle で待っているサブシステム（idle 中でなければ 0）
+            int      pending;       // まだ通知していない変化
+            size_t   binaryLimit;
+            int      commands;      // 受け付けたコマンドの数
+            bool     inList;        // command_list_begin 〜 command_list_end の間
+            bool     listOk;        // command_list_ok_begin で始まった
+            bool     stalled;       // Faults::stallCommand を受け取った
+            std::vector<std::string> list;
+        };
+
+        int                      m_listenfd;
+        int                      m_port;
+        std::atomic<bool>        m_terminated;
+        std::thread             *m_thread;
+        std::list<std::thread>   m_workers;
+        std::list<Connection *>  m_connections;
+        std::mutex               m_mutex;
+
+        Faults                   m_faults;
+        std::vector<std::string> m_library;     // 曲の URI（ディレクトリ順）
+        std::vector<uint8_t>     m_coverArt;
+        std::vector<QueueEntry>  m_queue;
+        uint32_t                 m_version;
+        int                      m_nextId;
+        int                      m_state;       // 0: stop, 1: pause, 2: play
+        int                      m_song;
+        long                     m_volume;
+        double                   m_elapsed;     // m_started の時点の経過時間
+        std::chrono::steady_clock::time_point m_started;
+        std::atomic<uint64_t>    m_commandCount;
+
+        void accept();
+        void serve(Connection *connection);
+        bool write(Connection *connection, const std::string& data);
+        void notify(int subsystems);
+        void flushIdle(Connection *connection, std::string& out);
+        bool process(Connection *connection, std::string_view line, std::string& out);
+        bool count(Connection *connection, const std::string& name, int& error);
+        int execute(Connection *connection, const std::vector<std::string>& args, std::string& out, std::string& error);
+        int addSongs(const std::string& uri);
+        int findSongs(const std::string& filter);
+        void touchQueue(size_t from);
+        double getElapsed();
+        void writeSong(size_t pos, std::string& out);
+        void writeTags(const std::string& uri, std::string& out);
+
+    public:
+        MockMPD(int port = 0);
+        ~MockMPD();
+        int getPort(){ return m_port; }
+        void setFaults(const Faults& faults);
+        bool loadLibrary(const char *path);
+        void generateLibrary(int albums, int tracks);
+        void setCoverArt(const std::vector<uint8_t>& data);
+        uint64_t getCommandCount(){ return m_commandCount; }
+};
+
+#endif
@@ -0,0 +1,1274 @@
+//------------------------------------------------------------------------------
+//  MPD との通信の計測
+//
+//  ./mpd_bench latency [TCP のホスト [ポート [ソケットのパス [回数]]]]
+//      ping の往復時間を TCP（ループバックなど）と Unix ドメインソケットで比べる
+//      既定値は 127.0.0.1 6600 /run/mpd/socket 1000
+//
+//  ./mpd_bench enqueue [ホスト [ポート [ディレクトリ [曲数]]]]
+//      ディレクトリ以下の曲を曲数だけキューに追加する時間を、１曲ずつ応答を待つ場合・
+//      enqueue() でまとめて送る場合・addDirectory() で MPD に列挙させる場合で比べる
+//      既定値は 127.0.0.1 6600 "" 5000（キューの内容は消える）
+//
+//  ./mpd_bench mock [ポート [ライブラリ]]
+//      MockMPD を起動したままにする。ライブラリは１行に１曲の URI を書いたファイル
+//      （省略時は 500 アルバム×10 曲を生成する）。上の計測の相手に使える
+//      既定値は 6600
+//
+//  ./mpd_bench harness [回数]
+//      MockMPD をループバックで起動し、MPDClient を通したコマンドの往復時間と
+//      スループットを、遅延・分割書き込み・ACK・切断を注入しながら計測する
+//      ライブラリ全体の取得（listallinfo）やキューへの追加を続けている間の往復時間も計測する
+//      応答を待たずに反映した操作が、確定または取り消されるまでの時間も計測する
+//      曲の情報のキャッシュと、再生中の曲の情報の取得も確かめる
+//      既定値は 1000
+//
+//  ./mpd_bench parse [行数 [回数]]
+//      status と playlistinfo の応答を読む速さ（行/秒）を、行を std::string にコピーして
+//      stoi() / atof() で変換する読み方と ResponseLine で比べる
+//      既定値は 100000 20
+//
+//  ./mpd_bench cover [回数]
+//      合成した PNG 画像で PackedImage・CoverImage・CoverCache を確かめる。圧縮して展開した
+//      画像が元と一致すること（画面の外にはみ出す場合も含む）と、圧縮・展開の速さを計測する
+//      maxSize ごとに残すレベルと getLevel() が選ぶレベル、２色の画像から求めた代表色の順序と
+//      アクセント色、背景用のぼかしを確かめる。MockMPD から転送して、失敗後に
+//      間隔を空けて要求し直せること、同じ内容の画像を共有すること、上限を超えたら破棄することを確かめる
+//      既定値は 200
+//------------------------------------------------------------------------------
+#include "mpd_client.h"
+#include "mock_mpd.h"
+#include "cover_cache.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include <future>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+
+#include <png.h>
+
+static const int RESPONSE_TIMEOUT_MS = 5000;
+static const int WARMUP_COUNT = 50;
+
+//------------------------------------------------------------------------------
+//  接続して挨拶を受け取る
+//------------------------------------------------------------------------------
+static bool waitGreeting(StreamClient& client, const std::string& address)
+{
+    std::string_view line;
+    if( !client.receive(line, RESPONSE_TIMEOUT_MS) || line.compare(0, 6, "OK MPD") != 0 )
+    {
+        std::cerr << address << ": no response from MPD" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  ping を１つずつ送り、応答が返るまでの時間（マイクロ秒）を samples に入れる
+//------------------------------------------------------------------------------
+static bool measureLatency(const std::string& host, int port, int count, std::vector<double>& samples)
+{
+    StreamClient client(host.c_str(), port);
+    if( !waitGreeting(client, host) )
+    {
+        return false;
+    }
+
+    std::string_view line;
+    for( int n = 0 ; n < WARMUP_COUNT + count ; n++ )
+    {
+        auto start = std::chrono::steady_clock::now();
+        client.sendRawBytes("ping\n", 5);
+        if( !client.receive(line, RESPONSE_TIMEOUT_MS) || line != "OK\n" )
+        {
+            std::cerr << host << ": ping failed" << std::endl;
+            return false;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if( n >= WARMUP_COUNT )
+        {
+            samples.push_back(std::chrono::duration<double, std::micro>(elapsed).count());
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static void printStatistics(const std::string& label, std::vector<double>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+    double mean = std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size();
+    std::cout << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(1)
+              << " min " << std::setw(8) << samples.front()
+              << " median " << std::setw(8) << samples[samples.size() / 2]
+              << " p99 " << std::setw(8) << samples[samples.size() * 99 / 100]
+              << " mean " << std::setw(8) << mean << " [us]" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+static int benchLatency(int argc, char *argv[])
+{
+    std::string host = (argc > 2) ? argv[2] : "127.0.0.1";
+    int port         = (argc > 3) ? std::atoi(argv[3]) : 6600;
+    std::string path = (argc > 4) ? argv[4] : "/run/mpd/socket";
+    int count        = (argc > 5) ? std::atoi(argv[5]) : 1000;
+
+    std::vector<double> tcp, local;
+    if( measureLatency(host, port, count, tcp) )
+    {
+        printStatistics("tcp " + host + ":" + std::to_string(port), tcp);
+    }
+    if( measureLatency(path, 0, count, local) )
+    {
+        printStatistics("unix " + path, local);
+    }
+    return (tcp.empty() || local.empty()) ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//  MPDClient のコマンドの完了を待つ
+//------------------------------------------------------------------------------
+static bool waitCommand(MPDClient& client, const std::string& command, MPDClient::ResponseHandler onLine = NULL)
+{
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    client.sendCommand(command, [done](const CommandResult& r){ done->set_value(r.ok); }, onLine);
+    if( result.wait_for(std::chrono::milliseconds(RESPONSE_TIMEOUT_MS)) != std::future_status::ready )
+    {
+        return false;
+    }
+    return result.get();
+}
+
+//------------------------------------------------------------------------------
+static std::string quote(const std::string& arg)
+{
+    std::string s = "\"";
+    for( auto i = arg.begin() ; i != arg.end() ; i++ )
+    {
+        if( *i == '"' || *i == '\\' )
+        {
+            s += '\\';
+        }
+        s += *i;
+    }
+    return s + "\"";
+}
+
+//------------------------------------------------------------------------------
+//  キューを空にしてから enqueue を実行し、完了までの時間（ミリ秒）を表示する
+//------------------------------------------------------------------------------
+static bool measureEnqueue(MPDClient& client, const std::string& label, size_t count,
+                           std::function<void(MPDClient::CompletionHandler)> enqueue)
+{
+    if( !waitCommand(client, "clear") )
+    {
+        std::cerr << label << ": clear failed" << std::endl;
+        return false;
+    }
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    auto start = std::chrono::steady_clock::now();
+    enqueue([done](const CommandResult& r){ done->set_value(r.ok); });
+    if( result.wait_for(std::chrono::seconds(60)) != std::future_status::ready || !result.get() )
+    {
+        std::cerr << label << ": enqueue failed" << std::endl;
+        return false;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << ms << " [ms] " << std::setw(10) << count * 1000 / ms << " [tracks/s]" << std::endl;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+static int benchEnqueue(int argc, char *argv[])
+{
+    if( argc > 2 )
+    {
+        ::setenv("MPD_HOST", argv[2], 1);
+    }
+    if( argc > 3 )
+    {
+        ::setenv("MPD_PORT", argv[3], 1);
+    }
+    std::string directory = (argc > 4) ? argv[4] : "";
+    size_t count          = (argc > 5) ? std::atoi(argv[5]) : 5000;
+
+    MPDClient client;
+    std::vector<std::string> uris;
+    bool listed = waitCommand(client, "listall " + quote(directory), [&uris, count](std::string_view str){
+        ResponseLine line(str);
+        if( uris.size() < count && line.isKey("file") )
+        {
+            uris.push_back(std::string(line.getValue()));
+        }
+    });
+    if( !listed || uris.empty() )
+    {
+        std::cerr << "listall " << directory << ": no songs" << std::endl;
+        return 1;
+    }
+
+    bool ok = measureEnqueue(client, "add (one by one)", uris.size(), [&client, &uris](MPDClient::CompletionHandler onDone){
+        bool result = true;
+        for( auto i = uris.begin() ; i != uris.end() && result ; i++ )
+        {
+            result = waitCommand(client, "add " + quote(*i));
+        }
+        CommandResult r;
+        r.ok = result;
+        onDone(r);
+    });
+    ok = measureEnqueue(client, "enqueue (chunked)", uris.size(), [&client, &uris](MPDClient::CompletionHandler onDone){
+        client.enqueue(uris, onDone);
+    }) && ok;
+    ok = measureEnqueue(client, "add directory", uris.size(), [&client, &directory](MPDClient::CompletionHandler onDone){
+        client.addDirectory(directory, onDone);
+    }) && ok;
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+static int runMock(int argc, char *argv[])
+{
+    int port = (argc > 2) ? std::atoi(argv[2]) : 6600;
+    MockMPD mock(port);
+    if( mock.getPort() == 0 )
+    {
+        return 1;
+    }
+    if( argc > 3 )
+    {
+        if( !mock.loadLibrary(argv[3]) )
+        {
+            std::cerr << argv[3] << ": cannot read" << std::endl;
+            return 1;
+        }
+    }
+    else
+    {
+        mock.generateLibrary(500, 10);
+    }
+    std::cout << "mock MPD listening on 127.0.0.1:" << mock.getPort() << std::endl;
+    while( true )
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  ping を１つずつ送り、完了までの時間（マイクロ秒）を samples に入れる
+//------------------------------------------------------------------------------
+static bool measureClientLatency(MPDClient& client, int count, std::vector<double>& samples)
+{
+    for( int n = 0 ; n < WARMUP_COUNT + count ; n++ )
+    {
+        auto start = std::chrono::steady_clock::now();
+        if( !waitCommand(client, "ping") )
+        {
+            return false;
+        }
+        if( n >= WARMUP_COUNT )
+        {
+            samples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  count 個の ping を続けて送り、すべて完了するまでの時間を表示する
+//  失敗したコマンドの数を返す（完了しなかった場合は -1）
+//------------------------------------------------------------------------------
+static int measureThroughput(MPDClient& client, const std::string& label, int count)
+{
+    auto remaining = std::make_shared<std::atomic<int>>(count);
+    auto failed = std::make_shared<std::atomic<int>>(0);
+    auto done = std::make_shared<std::promise<void>>();
+    std::future<void> result = done->get_future();
+    auto start = std::chrono::steady_clock::now();
+    for( int n = 0 ; n < count ; n++ )
+    {
+        client.sendCommand("ping", [remaining, failed, done](const CommandResult& r){
+            if( !r.ok )
+            {
+                (*failed)++;
+            }
+            if( --(*remaining) == 0 )
+            {
+                done->set_value();
+            }
+        });
+    }
+    if( result.wait_for(std::chrono::seconds(30)) != std::future_status::ready )
+    {
+        std::cerr << label << ": " << *remaining << " commands not completed" << std::endl;
+        return -1;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << ms << " [ms] " << std::setw(10) << count * 1000 / ms << " [cmds/s] "
+              << *failed << " failed" << std::endl;
+    return *failed;
+}
+
+//------------------------------------------------------------------------------
+//  転送用レーンで listallinfo を繰り返しながら ping の往復時間を計測する
+//  listallinfo が１回も完了しなかった場合と、曲数が合わなかった場合は false を返す
+//------------------------------------------------------------------------------
+static bool measureLatencyDuringSync(MPDClient& client, int count, size_t songs, std::vector<double>& samples)
+{
+    std::atomic<bool> finished(false);
+    std::atomic<int> syncs(0);
+    std::atomic<bool> matched(true);
+    std::thread sync([&](){
+        while( !finished )
+        {
+            size_t files = 0;
+            auto done = std::make_shared<std::promise<bool>>();
+            std::future<bool> result = done->get_future();
+            client.sendBulkCommand("listallinfo",
+                [done](const CommandResult& r){ done->set_value(r.ok); },
+                [&files](std::string_view line){ files += ResponseLine(line).isKey("file"); });
+            if( result.wait_for(std::chrono::seconds(30)) != std::future_status::ready || !result.get() || files != songs )
+            {
+                matched = false;
+                break;
+            }
+            syncs++;
+        }
+    });
+    bool ok = measureClientLatency(client, count, samples);
+    finished = true;
+    sync.join();
+    std::cout << "library syncs            " << syncs << (matched ? "" : " (FAILED)") << std::endl;
+    return ok && matched && syncs > 0;
+}
+
+//------------------------------------------------------------------------------
+//  enqueue() でライブラリの全曲の追加を繰り返しながら ping の往復時間を計測する
+//  最後に追加の途中で cancelCommands() して、未送信の分が取り消されることを確かめる
+//------------------------------------------------------------------------------
+static bool measureLatencyDuringEnqueue(MPDClient& client, int count, std::vector<double>& samples)
+{
+    std::vector<std::string> uris;
+    if( !waitCommand(client, "listall", [&uris](std::string_view str){
+            ResponseLine line(str);
+            if( line.isKey("file") )
+            {
+                uris.push_back(std::string(line.getValue()));
+            }
+        }) )
+    {
+        return false;
+    }
+
+    std::atomic<bool> finished(false);
+    std::atomic<int> enqueues(0);
+    std::atomic<bool> succeeded(true);
+    std::thread enqueue([&](){
+        while( !finished )
+        {
+            auto done = std::make_shared<std::promise<bool>>();
+            std::future<bool> result = done->get_future();
+            client.sendCommand("clear");
+            client.enqueue(uris, [done](const CommandResult& r){ done->set_value(r.ok); });
+            if( result.wait_for(std::chrono::seconds(30)) != std::future_status::ready || !result.get() )
+            {
+                succeeded = false;
+                break;
+            }
+            enqueues++;
+        }
+    });
+    bool ok = measureClientLatency(client, count, samples);
+    finished = true;
+    enqueue.join();
+
+    auto done = std::make_shared<std::promise<std::string>>();
+    std::future<std::string> result = done->get_future();
+    client.enqueue(uris, [done](const CommandResult& r){ done->set_value(r.message); });
+    size_t cancelled = client.cancelCommands();
+    bool aborted = (result.wait_for(std::chrono::seconds(30)) == std::future_status::ready && result.get() == "cancelled");
+    std::cout << "enqueues                 " << enqueues << (succeeded ? "" : " (FAILED)")
+              << ", cancelled " << cancelled << " of " << uris.size() << std::endl;
+    return ok && succeeded && enqueues > 0 && aborted && cancelled > 0;
+}
+
+//------------------------------------------------------------------------------
+//  operation を実行し、完了までの時間（ミリ秒）を返す（失敗した場合は負の値）
+//------------------------------------------------------------------------------
+static double measureCompletion(std::function<void(MPDClient::CompletionHandler)> operation)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    operation([done](const CommandResult& r){ done->set_value(r.ok); });
+    if( result.wait_for(std::chrono::seconds(30)) != std::future_status::ready || !result.get() )
+    {
+        return -1.0;
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+//------------------------------------------------------------------------------
+//  応答を遅らせた大量の enqueue() の途中で一時停止と次の曲を操作し、
+//  どちらも追加の完了を待たずに完了することを確かめる
+//------------------------------------------------------------------------------
+static bool checkTransportDuringEnqueue(MPDClient& client, MockMPD& mock)
+{
+    std::vector<std::string> uris;
+    bool ok = waitCommand(client, "listall", [&uris](std::string_view str){
+        ResponseLine line(str);
+        if( line.isKey("file") )
+        {
+            uris.push_back(std::string(line.getValue()));
+        }
+    });
+    ok = waitCommand(client, "clear") && ok && uris.size() > 3;
+    if( !ok )
+    {
+        return false;
+    }
+    std::vector<std::string> first(uris.begin(), uris.begin() + 3);
+    ok = measureCompletion([&client, &first](MPDClient::CompletionHandler onDone){ client.enqueue(first, onDone); }) >= 0;
+    ok = measureCompletion([&client](MPDClient::CompletionHandler onDone){ client.play(0, onDone); }) >= 0 && ok;
+
+    MockMPD::Faults faults;
+    faults.delayMs = 2;
+    mock.setFaults(faults);
+    auto start = std::chrono::steady_clock::now();
+    auto added = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = added->get_future();
+    client.enqueue(uris, [added](const CommandResult& r){ added->set_value(r.ok); });
+    double pause = measureCompletion([&client](MPDClient::CompletionHandler onDone){ client.togglePause(onDone); });
+    double next = measureCompletion([&client](MPDClient::CompletionHandler onDone){ client.next(onDone); });
+    ok = (result.wait_for(std::chrono::seconds(60)) == std::future_status::ready && result.get()) && ok;
+    double enqueue = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    mock.setFaults(MockMPD::Faults());
+
+    bool overtook = pause >= 0 && next >= 0 && pause + next < enqueue / 2;
+    std::cout << "during enqueue (+2ms)    " << std::fixed << std::setprecision(1)
+              << "pause " << pause << " [ms], next " << next << " [ms], enqueue " << enqueue << " [ms]"
+              << (overtook ? "" : " (WAITED)") << std::endl;
+    return waitCommand(client, "stop") && waitCommand(client, "clear") && ok && overtook;
+}
+
+//------------------------------------------------------------------------------
+//  addDirectory() の直後の play() が、追加の後に実行されることを確かめる
+//------------------------------------------------------------------------------
+static bool checkAddDirectory(MPDClient& client)
+{
+    bool ok = waitCommand(client, "clear");
+    auto added = std::make_shared<std::promise<bool>>();
+    auto played = std::make_shared<std::promise<bool>>();
+    std::future<bool> addResult = added->get_future();
+    std::future<bool> playResult = played->get_future();
+    client.addDirectory("artist000/album0002", [added](const CommandResult& r){ added->set_value(r.ok); });
+    client.play(1, [played](const CommandResult& r){ played->set_value(r.ok); });
+    ok = (addResult.wait_for(std::chrono::seconds(5)) == std::future_status::ready && addResult.get()) && ok;
+    bool ordered = (playResult.wait_for(std::chrono::seconds(5)) == std::future_status::ready && playResult.get());
+    std::cout << "add directory + play     " << (ordered ? "ok" : "OVERTAKEN") << std::endl;
+    return waitCommand(client, "stop") && waitCommand(client, "clear") && ok && ordered;
+}
+
+//------------------------------------------------------------------------------
+//  operation の直後の getStatus() が expected になっているかを確かめ、
+//  確定する（pending が 0 になる）までの時間を表示する。確定後の状態を返す
+//------------------------------------------------------------------------------
+static int measureSettle(MPDClient& client, const std::string& label, int expected, std::function<void()> operation)
+{
+    auto start = std::chrono::steady_clock::now();
+    operation();
+    PlayerStatus status = client.getStatus();
+    double shown = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    bool immediate = (status.state == expected && status.pending > 0);
+    while( status.pending > 0 && std::chrono::steady_clock::now() - start < std::chrono::seconds(5) )
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        status = client.getStatus();
+    }
+    double settled = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(1)
+              << " shown " << (immediate ? "" : "LATE ") << "in " << shown << " [us], settled in " << settled << " [ms]" << std::endl;
+    return immediate ? status.state : -1;
+}
+
+//------------------------------------------------------------------------------
+//  応答を遅らせて、再生の操作が応答を待たずに getStatus() へ反映されることと、
+//  確定後は MPD の状態に、ACK の場合は元の状態に戻ることを確かめる
+//------------------------------------------------------------------------------
+static bool checkOptimisticState(MPDClient& client, MockMPD& mock)
+{
+    std::vector<std::string> uris;
+    for( int n = 1 ; n <= 3 ; n++ )
+    {
+        uris.push_back("artist000/album0000/track0" + std::to_string(n) + ".flac");
+    }
+    MockMPD::Faults faults;
+    faults.delayMs = 20;
+    mock.setFaults(faults);
+    bool ok = waitCommand(client, "clear");
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    client.enqueue(uris, [done](const CommandResult& r){ done->set_value(r.ok); });
+    ok = (client.getQueueLength() == uris.size()) && ok;
+    ok = (result.wait_for(std::chrono::seconds(5)) == std::future_status::ready && result.get()) && ok;
+
+    ok = (measureSettle(client, "play (+20ms delay)", PlayerStatus::PLAYERSTATE_PLAY,
+                        [&client](){ client.play(0); }) == PlayerStatus::PLAYERSTATE_PLAY) && ok;
+    ok = (measureSettle(client, "pause (+20ms delay)", PlayerStatus::PLAYERSTATE_PAUSE,
+                        [&client](){ client.togglePause(); }) == PlayerStatus::PLAYERSTATE_PAUSE) && ok;
+    faults.failCommand = "play";
+    mock.setFaults(faults);
+    ok = (measureSettle(client, "resume (ACK)", PlayerStatus::PLAYERSTATE_PLAY,
+                        [&client](){ client.togglePause(); }) == PlayerStatus::PLAYERSTATE_PAUSE) && ok;
+    mock.setFaults(MockMPD::Faults());
+    return waitCommand(client, "clear") && ok;
+}
+
+//------------------------------------------------------------------------------
+//  lookupSong() の完了を待つ
+//------------------------------------------------------------------------------
+static std::shared_ptr<const SongInfo> waitSong(MPDClient& client, const std::string& file)
+{
+    auto done = std::make_shared<std::promise<std::shared_ptr<const SongInfo>>>();
+    std::future<std::shared_ptr<const SongInfo>> result = done->get_future();
+    client.lookupSong(file, [done](std::shared_ptr<const SongInfo> song){ done->set_value(song); });
+    if( result.wait_for(std::chrono::milliseconds(RESPONSE_TIMEOUT_MS)) != std::future_status::ready )
+    {
+        return NULL;
+    }
+    return result.get();
+}
+
+//------------------------------------------------------------------------------
+//  曲の情報が２回目からはサーバーに問い合わせずに返ることと、同じ曲・同じアルバム名を
+//  共有していること、再生中の曲の情報が currentsong で取得できることを確かめる
+//------------------------------------------------------------------------------
+static bool checkSongCache(MPDClient& client, MockMPD& mock)
+{
+    std::vector<std::string> uris;
+    for( int n = 1 ; n <= 3 ; n++ )
+    {
+        uris.push_back("artist000/album0001/track0" + std::to_string(n) + ".flac");
+    }
+    auto first = waitSong(client, uris[1]);
+    uint64_t commands = mock.getCommandCount();
+    auto second = waitSong(client, uris[1]);
+    auto other = waitSong(client, uris[2]);
+    bool cached = first && second == first && mock.getCommandCount() == commands + 1;
+    bool shared = first && other && first->album == other->album &&
+                  SongInfo::getText(first->album) == "album0001" && SongInfo::getText(first->title) == "track02.flac";
+
+    bool ok = waitCommand(client, "clear");
+    auto done = std::make_shared<std::promise<bool>>();
+    std::future<bool> result = done->get_future();
+    client.enqueue(uris, [done](const CommandResult& r){ done->set_value(r.ok); });
+    client.play(1);     // 追加の完了を待たなくても、追加の後に実行される
+    ok = (result.wait_for(std::chrono::seconds(5)) == std::future_status::ready && result.get()) && ok;
+    std::shared_ptr<const SongInfo> current;
+    auto start = std::chrono::steady_clock::now();
+    while( !current && std::chrono::steady_clock::now() - start < std::chrono::seconds(5) )
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        PlayerStatus status = client.getStatus();
+        current = (status.pending == 0) ? client.getCurrentSong() : NULL;
+    }
+    bool playing = (current == first);
+    std::cout << "song cache               " << (cached ? "hit" : "MISS") << ", " << (shared ? "shared" : "NOT SHARED")
+              << ", now playing " << (playing ? "ok" : "MISMATCH") << std::endl;
+    return waitCommand(client, "stop") && waitCommand(client, "clear") && ok && cached && shared && playing;
+}
+
+//------------------------------------------------------------------------------
+//  カバーアートを転送して、内容が一致するかどうかを返す
+//------------------------------------------------------------------------------
+static bool checkCoverArt(MPDClient& client, const std::vector<uint8_t>& expected)
+{
+    auto done = std::make_shared<std::promise<std::vector<uint8_t>>>();
+    std::future<std::vector<uint8_t>> result = done->get_future();
+    client.fetchCoverArt("artist000/album0000/track01.flac", [done](std::vector<uint8_t>& data){ done->set_value(data); });
+    if( result.wait_for(std::chrono::seconds(30)) != std::future_status::ready )
+    {
+        return false;
+    }
+    return result.get() == expected;
+}
+
+//------------------------------------------------------------------------------
+static int runHarness(int argc, char *argv[])
+{
+    int count = (argc > 2) ? std::atoi(argv[2]) : 1000;
+
+    MockMPD mock;
+    if( mock.getPort() == 0 )
+    {
+        return 1;
+    }
+    mock.generateLibrary(500, 10);
+    std::vector<uint8_t> cover(150 * 1024);
+    std::mt19937 random(1);
+    std::generate(cover.begin(), cover.end(), [&random](){ return (uint8_t)random(); });
+    mock.setCoverArt(cover);
+    ::setenv("MPD_HOST", "127.0.0.1", 1);
+    ::setenv("MPD_PORT", std::to_string(mock.getPort()).c_str(), 1);
+
+    MPDClient client;
+    bool ok = true;
+    std::vector<double> samples;
+    MockMPD::Faults faults;
+
+    ok = measureClientLatency(client, count, samples) && ok;
+    printStatistics("ping", samples);
+    ok = (measureThroughput(client, "pipelined ping", count * 10) == 0) && ok;
+
+    samples.clear();
+    ok = measureLatencyDuringSync(client, count, 500 * 10, samples) && ok;
+    printStatistics("ping (library sync)", samples);
+
+    samples.clear();
+    ok = measureLatencyDuringEnqueue(client, count, samples) && ok;
+    printStatistics("ping (enqueue)", samples);
+    ok = waitCommand(client, "clear") && ok;
+    ok = checkOptimisticState(client, mock) && ok;
+    ok = checkSongCache(client, mock) && ok;
+    ok = checkTransportDuringEnqueue(client, mock) && ok;
+    ok = checkAddDirectory(client) && ok;
+
+    faults.delayMs = 2;
+    mock.setFaults(faults);
+    samples.clear();
+    ok = measureClientLatency(client, count / 10, samples) && ok;
+    printStatistics("ping (+2ms delay)", samples);
+    ok = (measureThroughput(client, "pipelined (+2ms delay)", count * 10) == 0) && ok;
+
+    faults = MockMPD::Faults();
+    faults.chunkSize = 7;
+    mock.setFaults(faults);
+    samples.clear();
+    ok = measureClientLatency(client, count / 10, samples) && ok;
+    printStatistics("ping (7B writes)", samples);
+    bool cover7 = checkCoverArt(client, cover);
+    std::cout << "cover art (7B writes)    " << (cover7 ? "ok" : "MISMATCH") << std::endl;
+    ok = cover7 && ok;
+
+    // 転送が途中で止まってタイムアウトしても、遅れて届く残りを次の転送で受け取らない
+    faults = MockMPD::Faults();
+    faults.chunkSize = 4096;
+    faults.chunkDelayMs = 6000;
+    mock.setFaults(faults);
+    bool stalled = !checkCoverArt(client, cover);
+    mock.setFaults(MockMPD::Faults());
+    bool resumed = checkCoverArt(client, cover);
+    std::cout << "cover art (stalled)      " << (stalled ? "timeout" : "NO TIMEOUT") << ", then "
+              << (resumed ? "ok" : "MISMATCH") << std::endl;
+    ok = stalled && resumed && ok;
+
+    // readpicture がタイムアウトして接続し直した後も、albumart で取得できる
+    faults = MockMPD::Faults();
+    faults.stallCommand = "readpicture";
+    mock.setFaults(faults);
+    bool fallback = checkCoverArt(client, cover);
+    mock.setFaults(MockMPD::Faults());
+    bool synced = checkCoverArt(client, cover);
+    std::cout << "cover art (albumart)     " << (fallback ? "ok" : "MISMATCH") << ", then "
+              << (synced ? "ok" : "MISMATCH") << std::endl;
+    ok = fallback && synced && ok;
+
+    faults = MockMPD::Faults();
+    faults.failEvery = 10;
+    mock.setFaults(faults);
+    int failed = measureThroughput(client, "pipelined (ACK 1/10)", count * 10);
+    ok = (failed > 0) && ok;
+
+    // 切断された時点で応答待ちのコマンドは失敗し、再接続後に残りが実行される
+    faults = MockMPD::Faults();
+    faults.disconnectAfter = count;
+    mock.setFaults(faults);
+    failed = measureThroughput(client, "pipelined (disconnects)", count * 10);
+    ok = (failed >= 0) && ok;
+    mock.setFaults(MockMPD::Faults());
+    auto start = std::chrono::steady_clock::now();
+    bool recovered = waitCommand(client, "ping");
+    std::cout << "recovered after          " << std::fixed << std::setprecision(1)
+              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+              << " [ms]" << std::endl;
+    ok = recovered && ok;
+
+    client.dumpStatistics(std::cout);
+    std::cout << "mock handled " << mock.getCommandCount() << " commands: " << (ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//  status と playlistinfo の応答を並べた count 行の応答を作る
+//------------------------------------------------------------------------------
+static std::string makeResponse(size_t count)
+{
+    static const char *STATUS =
+        "volume: 72\nrepeat: 0\nrandom: 1\nsingle: 0\nconsume: 0\nplaylist: 1234\nplaylistlength: 5000\n"
+        "mixrampdb: -17.000000\nstate: play\nsong: 12\nsongid: 13\nelapsed: 83.452\nduration: 251.373\n"
+        "bitrate: 1411\naudio: 44100:16:2\nnextsong: 13\nnextsongid: 14\n";
+    std::string response = STATUS;
+    size_t lines = std::count(response.begin(), response.end(), '\n');
+    for( int n = 0 ; lines < count ; n++ )
+    {
+        std::stringstream ss;
+        ss << "file: artist" << (n / 100) << "/album" << (n / 10) << "/" << std::setw(2) << std::setfill('0') << (n % 10) << " - Track.flac\n"
+           << "Last-Modified: 2021-05-04T12:34:56Z\n"
+           << "Artist: Artist " << (n / 100) << "\n"
+           << "Album: Album " << (n / 10) << "\n"
+           << "Title: Track " << n << ": Remastered\n"
+           << "Track: " << (n % 10 + 1) << "\n"
+           << "Date: 1973\n"
+           << "Time: " << (180 + n % 120) << "\n"
+           << "duration: " << (180 + n % 120) << "." << std::setw(3) << (n * 37 % 1000) << "\n"
+           << "Pos: " << n << "\n"
+           << "Id: " << (n + 1) << "\n";
+        response += ss.str();
+        lines += 11;
+    }
+    return response;
+}
+
+//------------------------------------------------------------------------------
+//  キーが数値の項目なら 1（整数）か 2（小数）を返す
+//------------------------------------------------------------------------------
+static int getValueType(std::string_view key)
+{
+    static const char *INTEGERS[] = { "volume", "playlist", "playlistlength", "song", "songid", "nextsong", "nextsongid",
+                                      "bitrate", "Track", "Date", "Time", "Pos", "Id" };
+    static const char *DECIMALS[] = { "mixrampdb", "elapsed", "duration" };
+    for( auto name : INTEGERS )
+    {
+        if( key == name )
+        {
+            return 1;
+        }
+    }
+    for( auto name : DECIMALS )
+    {
+        if( key == name )
+        {
+            return 2;
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  これまでの読み方：行を std::string にコピーし、find() で分けて stoi() / atof() で変換する
+//------------------------------------------------------------------------------
+static double parseWithStrings(const std::vector<std::string_view>& lines, size_t& records)
+{
+    double sum = 0;
+    for( auto& element : lines )
+    {
+        std::string line(element.substr(0, element.size() - 1));
+        size_t colon = line.find(": ");
+        if( colon == std::string::npos )
+        {
+            continue;
+        }
+        std::string key = line.substr(0, colon);
+        std::string value = line.substr(colon + 2);
+        switch( getValueType(key) )
+        {
+            case 1:  sum += std::stoi(value); break;
+            case 2:  sum += std::atof(value.c_str()); break;
+            default: sum += value.size(); break;
+        }
+        records += (key == "file" || key == "directory" || key == "playlist");
+    }
+    return sum;
+}
+
+//------------------------------------------------------------------------------
+//  ResponseLine で受信バッファの中を指したまま読む
+//------------------------------------------------------------------------------
+static double parseWithResponseLine(const std::vector<std::string_view>& lines, size_t& records)
+{
+    double sum = 0;
+    ResponseLine line;
+    for( auto& element : lines )
+    {
+        if( !line.parse(element) )
+        {
+            continue;
+        }
+        switch( getValueType(line.getKey()) )
+        {
+            case 1:  sum += line.toInt(); break;
+            case 2:  sum += line.toDouble(); break;
+            default: sum += line.getValue().size(); break;
+        }
+        records += line.isRecordStart();
+    }
+    return sum;
+}
+
+//------------------------------------------------------------------------------
+//  応答の読み方ごとに、１秒あたりに処理できる行数を計測する
+//  両方の読み方で数値の合計と項目の数が一致しなければ失敗とする
+//------------------------------------------------------------------------------
+static int benchParse(int argc, char *argv[])
+{
+    size_t count = (argc > 2) ? std::atoi(argv[2]) : 100000;
+    int rounds   = (argc > 3) ? std::atoi(argv[3]) : 20;
+
+    std::string response = makeResponse(count);
+    std::vector<std::string_view> lines;
+    for( size_t start = 0, end ; (end = response.find('\n', start)) != std::string::npos ; start = end + 1 )
+    {
+        lines.push_back(std::string_view(response).substr(start, end - start + 1));
+    }
+
+    static const struct { const char *label; double (*parse)(const std::vector<std::string_view>&, size_t&); } METHODS[] = {
+        { "std::string + stoi/atof", parseWithStrings },
+        { "ResponseLine",            parseWithResponseLine }
+    };
+    double sums[2];
+    size_t records[2];
+    for( int m = 0 ; m < 2 ; m++ )
+    {
+        records[m] = 0;
+        sums[m] = METHODS[m].parse(lines, records[m]);     // 予熱
+        std::vector<double> samples;
+        for( int n = 0 ; n < rounds ; n++ )
+        {
+            size_t r = 0;
+            auto start = std::chrono::steady_clock::now();
+            METHODS[m].parse(lines, r);
+            samples.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(samples.begin(), samples.end());
+        std::cout << std::left << std::setw(24) << METHODS[m].label << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(8) << lines.size() / samples[samples.size() / 2] / 1e6 << " [M lines/s]"
+                  << std::setw(8) << samples[samples.size() / 2] * 1e3 << " [ms]" << std::endl;
+    }
+    bool ok = (records[0] == records[1]) && std::abs(sums[0] - sums[1]) < 1e-6 * std::abs(sums[0]);
+    std::cout << lines.size() << " lines, " << records[1] << " records: " << (ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+//  color(x, y) が返す色（0xRRGGBB）の PNG 画像を作る
+//------------------------------------------------------------------------------
+static std::vector<uint8_t> makePNG(int width, int height, std::function<uint32_t(int x, int y)> color)
+{
+    std::vector<uint8_t> pixels(width * height * 3);
+    for( int y = 0 ; y < height ; y++ )
+    {
+        for( int x = 0 ; x < width ; x++ )
+        {
+            uint32_t c = color(x, y);
+            uint8_t *p = &pixels[(y * width + x) * 3];
+            p[0] = (uint8_t)(c >> 16);
+            p[1] = (uint8_t)(c >> 8);
+            p[2] = (uint8_t)c;
+        }
+    }
+    png_image image;
+    std::memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    image.width = width;
+    image.height = height;
+    image.format = PNG_FORMAT_RGB;
+    png_alloc_size_t size = 0;
+    std::vector<uint8_t> data;
+    if( png_image_write_get_memory_size(image, size, 0, &pixels[0], 0, NULL) )
+    {
+        data.resize(size);
+        if( !png_image_write_to_memory(&image, &data[0], &size, 0, &pixels[0], 0, NULL) )
+        {
+            data.clear();
+        }
+        data.resize(size);
+    }
+    return data;
+}
+
+//------------------------------------------------------------------------------
+//  写真に近い画像（なめらかなグラデーションにノイズと単色の帯を重ねる）
+//  noise を大きくすると圧縮が効かなくなる
+//------------------------------------------------------------------------------
+static std::vector<uint8_t> makePhotoPNG(int width, int height, int noise)
+{
+    std::mt19937 random(width * 31 + height + noise);
+    return makePNG(width, height, [&random, width, height, noise](int x, int y) -> uint32_t {
+        if( y % 40 < 6 )
+        {
+            return 0x204060;
+        }
+        int r = x * 255 / width, g = y * 255 / height, b = (x + y) * 127 / (width + height) + 64;
+        int d = noise ? (int)(random() % (2 * noise + 1)) - noise : 0;
+        r = std::clamp(r + d, 0, 255);
+        g = std::clamp(g + d, 0, 255);
+        b = std::clamp(b - d, 0, 255);
+        return (r << 16) | (g << 8) | b;
+    });
+}
+
+//------------------------------------------------------------------------------
+//  PackedImage を圧縮・展開して元の画像と一致するかを確かめる
+//  画面（stride > width の領域）の中・一部がはみ出す位置・完全に外の位置に展開し、
+//  はみ出した部分と画像の外の画素を書き換えないことも確かめる
+//  ノイズの多い画像では、圧縮せずに保持する場合の展開も確かめる
+//------------------------------------------------------------------------------
+static bool checkPackedImage()
+{
+    static const int WIDTH = 100, HEIGHT = 80, STRIDE = 112;
+    static const uint16_t BACKGROUND = 0xdead;
+    static const struct { int left, top; } POSITIONS[] = {
+        { 10, 10 }, { -30, -20 }, { 60, 50 }, { 80, -40 }, { -200, 0 }, { 0, 100 }, { 100, 0 }, { 0, -48 }
+    };
+    bool ok = true;
+    for( int noise = 0 ; noise <= 64 ; noise += 64 )
+    {
+        std::vector<uint8_t> data = makePhotoPNG(64, 48, noise);
+        PNGImage source;
+        source.read(&data[0], data.size());
+        PackedImage packed;
+        packed.pack(source);
+
+        std::vector<uint16_t> row(source.getWidth());
+        bool match = packed.getWidth() == source.getWidth() && packed.getHeight() == source.getHeight();
+        for( int y = 0 ; y < source.getHeight() ; y++ )
+        {
+            packed.unpackRow(y, 0, source.getWidth(), &row[0]);
+            match = match && std::equal(row.begin(), row.end(), source.getData().begin() + y * source.getWidth());
+        }
+        for( auto& p : POSITIONS )
+        {
+            std::vector<uint16_t> screen(STRIDE * HEIGHT, BACKGROUND);
+            packed.unpack(p.left, p.top, &screen[0], WIDTH, HEIGHT, STRIDE);
+            for( int y = 0 ; y < HEIGHT ; y++ )
+            {
+                for( int x = 0 ; x < STRIDE ; x++ )
+                {
+                    int sx = x - p.left, sy = y - p.top;
+                    bool inside = x < WIDTH && sx >= 0 && sx < source.getWidth() && sy >= 0 && sy < source.getHeight();
+                    match = match && screen[y * STRIDE + x] == (inside ? source.getPixel(sx, sy) : BACKGROUND);
+                }
+            }
+        }
+        if( !match )
+        {
+            std::cout << "packed image             noise " << noise << ": MISMATCH" << std::endl;
+        }
+        ok = match && ok;
+    }
+    std::cout << "packed image             " << (ok ? "ok" : "MISMATCH") << std::endl;
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+//  320x320 の画像の圧縮と展開にかかる時間を、展開せずにコピーする場合と比べる
+//------------------------------------------------------------------------------
+static void benchPackedImage(int rounds)
+{
+    for( int noise = 0 ; noise <= 8 ; noise += 8 )
+    {
+        std::vector<uint8_t> data = makePhotoPNG(320, 320, noise);
+        PNGImage source;
+        source.read(&data[0], data.size());
+        std::vector<uint16_t>& pixels = source.getData();
+        std::vector<uint16_t> screen(pixels.size());
+        PackedImage packed;
+        std::vector<double> packTimes, unpackTimes, copyTimes;
+        for( int n = 0 ; n < rounds ; n++ )
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            packed.pack(source);
+            auto t1 = std::chrono::steady_clock::now();
+            packed.unpack(0, 0, &screen[0], 320, 320, 320);
+            auto t2 = std::chrono::steady_clock::now();
+            std::copy(pixels.begin(), pixels.end(), screen.begin());
+            auto t3 = std::chrono::steady_clock::now();
+            packTimes.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+            unpackTimes.push_back(std::chrono::duration<double, std::micro>(t2 - t1).count());
+            copyTimes.push_back(std::chrono::duration<double, std::micro>(t3 - t2).count());
+        }
+        std::string label = " (noise " + std::to_string(noise) + ")";
+        std::cout << std::left << std::setw(24) << "packed size" + label << std::right << std::fixed << std::setprecision(1)
+                  << " " << packed.getDataSize() * 100.0 / (pixels.size() * sizeof(uint16_t)) << " [%] of RGB565" << std::endl;
+        printStatistics("pack" + label, packTimes);
+        printStatistics("unpack" + label, unpackTimes);
+        printStatistics("copy" + label, copyTimes);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  長辺の長さ（画像が無ければ 0）
+//------------------------------------------------------------------------------
+template <class T> static int getLongSide(T *image)
+{
+    return image ? std::max(image->getWidth(), image->getHeight()) : 0;
+}
+
+//------------------------------------------------------------------------------
+//  maxSize ごとに CoverImage が残すレベルと、getLevel() が選ぶレベルを確かめる
+//------------------------------------------------------------------------------
+static bool checkCoverLevels()
+{
+    static const struct {
+        int width, height;  // 元画像の大きさ
+        int maxSize;
+        int levels[4];      // 残すレベルの長辺（大きい順、0 で終わり）
+        int sizes[4];       // getLevel() に渡す大きさ
+        int selected[4];    // getLevel() が返すレベルの長辺
+    } CASES[] = {
+        { 500, 500,   0, { 320, 160, 64, 32 }, { 400, 200, 160,  50 }, { 320, 320, 160, 64 } },
+        { 500, 500, 320, { 320, 160, 64, 32 }, { 320, 161,  65,  10 }, { 320, 320, 160, 32 } },
+        { 500, 500, 100, { 160,  64, 32,  0 }, { 320, 100,  64,  33 }, { 160, 160,  64, 64 } },
+        { 500, 500,  64, {  64,  32,  0,  0 }, { 320,  64,  40,  32 }, {  64,  64,  64, 32 } },
+        { 500, 500,  20, {  32,   0,  0,  0 }, { 320,  32,  20,   1 }, {  32,  32,  32, 32 } },
+        { 500, 250,   0, { 320, 160, 64, 32 }, { 320, 100,  64,  32 }, { 320, 160,  64, 32 } },
+        { 100, 100,   0, { 100,  64, 32,  0 }, { 320, 100,  80,  40 }, { 100, 100, 100, 64 } }
+    };
+    bool ok = true;
+    for( auto& c : CASES )
+    {
+        std::vector<uint8_t> data = makePNG(c.width, c.height, [](int x, int y){ return (x * 7 + y * 3) * 0x010203; });
+        PNGImage source;
+        source.read(&data[0], data.size());
+        for( int packed = 0 ; packed < 2 ; packed++ )
+        {
+            CoverImage image(source, packed != 0, c.maxSize);
+            bool match = true;
+            int n = 0;
+            for( ; n < 4 && c.levels[n] != 0 ; n++ )
+            {
+                // 他のレベルより小さい大きさを指定すれば、そのレベルまでが選ばれる
+                int size = packed ? getLongSide(image.getPackedLevel(c.levels[n]))
+                                  : getLongSide(image.getLevel(c.levels[n]));
+                match = match && size == c.levels[n];
+            }
+            match = match && image.getNumLevels() == n;
+            for( int k = 0 ; k < 4 ; k++ )
+            {
+                int size = packed ? getLongSide(image.getPackedLevel(c.sizes[k])) : getLongSide(image.getLevel(c.sizes[k]));
+                match = match && size == c.selected[k];
+            }
+            if( !match )
+            {
+                std::cout << "cover levels             " << c.width << "x" << c.height << " maxSize " << c.maxSize
+                          << (packed ? " (packed)" : "") << ": MISMATCH" << std::endl;
+            }
+            ok = match && ok;
+        }
+    }
+    std::cout << "cover levels             " << (ok ? "ok" : "MISMATCH") << std::endl;
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+//  RGB565 の色 c が 0xRRGGBB の色に近いかどうか（各チャンネルの差が tolerance 以下）
+//------------------------------------------------------------------------------
+static bool isNearColor(uint16_t c, uint32_t rgb, int tolerance = 24)
+{
+    int r = (c >> 11) << 3, g = ((c >> 5) & 0x3F) << 2, b = (c & 0x1F) << 3;
+    return std::abs(r - (int)(rgb >> 16)) <= tolerance && std::abs(g - (int)((rgb >> 8) & 0xFF)) <= tolerance
+        && std::abs(b - (int)(rgb & 0xFF)) <= tolerance;
+}
+
+//------------------------------------------------------------------------------
+//  灰色と赤の２色に塗り分けた画像で、代表色の順序・アクセント色・ぼかしを確かめる
+//  代表色は面積の大きい色が先になり、アクセント色は面積によらず鮮やかな赤になること、
+//  ぼかした画像は境界から離れた部分が元の色のまま、境界では２色の中間になることを確かめる
+//------------------------------------------------------------------------------
+static bool checkCoverColors()
+{
+    static const uint32_t GRAY = 0x808080, RED = 0xe02020;
+    bool ok = true;
+    for( int split = 140 ; split >= 60 ; split -= 80 )
+    {
+        // 左の split 列が灰色、残りが赤
+        std::vector<uint8_t> data = makePNG(200, 200, [split](int x, int y){ return (x < split) ? GRAY : RED; });
+        PNGImage source;
+        source.read(&data[0], data.size());
+        uint32_t major = (split > 100) ? GRAY : RED, minor = (split > 100) ? RED : GRAY;
+
+        std::vector<uint16_t> colors;
+        source.getDominantColors(5, colors);
+        bool ordered = colors.size() >= 2 && isNearColor(colors[0], major) && isNearColor(colors[1], minor);
+
+        PNGImage blurred;
+        source.blur(8, 3, blurred);
+        uint16_t edge = blurred.getPixel(split, 100);
+        bool smooth = isNearColor(blurred.getPixel(10, 100), GRAY, 8) && isNearColor(blurred.getPixel(195, 100), RED, 8)
+                   && !isNearColor(edge, GRAY) && !isNearColor(edge, RED) && isNearColor(edge, 0xb05050, 40);
+
+        CoverImage image(source);
+        PNGImage *backdrop = image.getBackdrop();
+        bool analyzed = image.getPalette().size() >= 2 && isNearColor(image.getDominantColor(), major)
+                     && isNearColor(image.getAccentColor(), RED) && backdrop != NULL && getLongSide(backdrop) == 160
+                     && isNearColor(backdrop->getPixel(2, 80), GRAY, 8) && isNearColor(backdrop->getPixel(157, 80), RED, 8);
+
+        if( !ordered || !smooth || !analyzed )
+        {
+            std::cout << "cover colors             split " << split << ": " << (ordered ? "" : "PALETTE ")
+                      << (smooth ? "" : "BLUR ") << (analyzed ? "" : "ANALYSIS ") << "MISMATCH" << std::endl;
+        }
+        ok = ordered && smooth && analyzed && ok;
+    }
+    std::cout << "cover colors             " << (ok ? "ok" : "MISMATCH") << std::endl;
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+//  album の画像が展開されるまで待つ（timeoutMs 以内に展開されなければ NULL）
+//  retry が true なら、読み込めなかった場合に備えて要求を出し続ける
+//------------------------------------------------------------------------------
+static std::shared_ptr<CoverImage> waitImage(CoverCache& cache, Album *album, int timeoutMs, bool retry = false)
+{
+    auto start = std::chrono::steady_clock::now();
+    while( std::chrono::steady_clock::now() - start < std::chrono::milliseconds(timeoutMs) )
+    {
+        std::shared_ptr<CoverImage> image = cache.getImage(album);
+        if( image )
+        {
+            return image;
+        }
+        if( retry )
+        {
+            cache.request(album);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+//  MockMPD から転送したカバーアートで CoverCache を確かめる
+//  失敗 → 間隔を空けて要求し直す、同じ内容の画像の共有、上限を超えた画像の破棄
+//------------------------------------------------------------------------------
+static bool checkCoverCache(MockMPD& mock)
+{
+    std::vector<uint8_t> red = makePNG(200, 200, [](int x, int y){ return 0xe02020; });
+    std::vector<uint8_t> blue = makePNG(200, 200, [](int x, int y){ return (x < 100) ? 0x2020e0 : 0x101010; });
+    PNGImage source;
+    source.read(&red[0], red.size());
+    size_t size = CoverImage(source).getDataSize();
+
+    picojson::value json;
+    std::string error = picojson::parse(json,
+        "{ \"id\": 1, \"name\": \"Artist\", \"directory\": \"artist000\", \"albums\": ["
+        "{ \"id\": 1, \"title\": \"A\", \"year\": 2000, \"directory\": \"album0000\", \"totalTime\": 0, \"tracks\": [] },"
+        "{ \"id\": 2, \"title\": \"B\", \"year\": 2000, \"directory\": \"album0001\", \"totalTime\": 0, \"tracks\": [] },"
+        "{ \"id\": 3, \"title\": \"C\", \"year\": 2000, \"directory\": \"album0002\", \"totalTime\": 0, \"tracks\": [] } ] }");
+    if( !error.empty() || red.empty() || blue.empty() )
+    {
+        return false;
+    }
+    Artist artist;
+    artist.loadFromJSON(json.get<picojson::object>());
+    Album *a = artist.getAlbum(0), *b = artist.getAlbum(1), *c = artist.getAlbum(2);
+
+    MPDClient client;
+    // 画像１枚分は収まるが、２枚分は収まらない上限
+    CoverCache cache(&client, size * 3 / 2);
+
+    // 画像が無くて失敗した後は、すぐには要求し直さない
+    mock.setCoverArt(std::vector<uint8_t>());
+    cache.request(a);
+    bool failed = !waitImage(cache, a, 500);
+    mock.setCoverArt(red);
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<CoverImage> imageA = waitImage(cache, a, 10000, true);
+    double retryMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    bool retried = failed && imageA && retryMs > 4000.0;
+
+    // 内容が同じ画像は１つを共有し、上限には１回だけ数える
+    cache.request(b);
+    std::shared_ptr<CoverImage> imageB = waitImage(cache, b, 5000);
+    bool shared = imageA && imageB == imageA && cache.getImage(a) == imageA;
+
+    // 別の画像を展開すると、最も長く使われていない画像（a と b が共有するもの）を破棄する
+    mock.setCoverArt(blue);
+    cache.request(c);
+    std::shared_ptr<CoverImage> imageC = waitImage(cache, c, 5000);
+    bool evicted = imageC && imageC != imageA && !cache.getImage(a) && !cache.getImage(b);
+    mock.setCoverArt(std::vector<uint8_t>());
+
+    std::cout << "cover cache              " << (retried ? "retried" : "NOT RETRIED") << " after "
+              << std::fixed << std::setprecision(1) << retryMs << " [ms], " << (shared ? "shared" : "NOT SHARED")
+              << ", " << (evicted ? "evicted" : "NOT EVICTED") << std::endl;
+    return retried && shared && evicted;
+}
+
+//------------------------------------------------------------------------------
+static int runCover(int argc, char *argv[])
+{
+    int rounds = std::max((argc > 2) ? std::atoi(argv[2]) : 200, 1);
+
+    MockMPD mock;
+    if( mock.getPort() == 0 )
+    {
+        return 1;
+    }
+    ::setenv("MPD_HOST", "127.0.0.1", 1);
+    ::setenv("MPD_PORT", std::to_string(mock.getPort()).c_str(), 1);
+
+    bool ok = true;
+    ok = checkPackedImage() && ok;
+    benchPackedImage(rounds);
+    ok = checkCoverLevels() && ok;
+    ok = checkCoverColors() && ok;
+    ok = checkCoverCache(mock) && ok;
+
+    std::cout << "cover: " << (ok ? "PASS" : "FAIL") << std::endl;
+    return ok ? 0 : 1;
+}
+
+//------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+    std::string mode = (argc > 1) ? argv[1] : "";
+    if( mode == "latency" )
+    {
+        return benchLatency(argc, argv);
+    }
+    if( mode == "enqueue" )
+    {
+        return benchEnqueue(argc, argv);
+    }
+    if( mode == "mock" )
+    {
+        return runMock(argc, argv);
+    }
+    if( mode == "harness" )
+    {
+        return runHarness(argc, argv);
+    }
+    if( mode == "parse" )
+    {
+        return benchParse(argc, argv);
+    }
+    if( mode == "cover" )
+    {
+        return runCover(argc, argv);
+    }
+    std::cerr << "usage: " << argv[0] << " latency [host [port [socket [count]]]]" << std::endl;
+    std::cerr << "       " << argv[0] << " enqueue [host [port [directory [count]]]]" << std::endl;
+    std::cerr << "       " << argv[0] << " mock [port [library]]" << std::endl;
+    std::cerr << "       " << argv[0] << " harness [count]" << std::endl;
+    std::cerr << "       " << argv[0] << " parse [lines [rounds]]" << std::endl;
+    std::cerr << "       " << argv[0] << " cover [rounds]" << std::endl;
+    return 1;
+}
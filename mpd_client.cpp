@@ -3,59 +3,440 @@
 #include <stdexcept>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <fstream>
 #include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <cmath>
+#include <array>
 
 #include <strings.h>
 
 
 
 //==============================================================================
-//  TCPClient
+//  RingBuffer
 //==============================================================================
-const int  TCPClient::BUFFER_SIZE = 256;
-const char TCPClient::DELIMITOR   = '\n';
+const size_t RingBuffer::npos = (size_t)-1;
 
 //------------------------------------------------------------------------------
-TCPClient::TCPClient(const char *host, uint32_t port) 
-    : m_host(host), m_port(port), m_sockfd(-1), m_terminated(false)
+RingBuffer::RingBuffer(size_t capacity) : m_head(0), m_tail(0)
 {
-    connect();
+    size_t size = 1;
+    while( size < capacity )
+    {
+        size <<= 1;
+    }
+    m_data.resize(size);
+    m_mask = size - 1;
+}
+
+//------------------------------------------------------------------------------
+//  空いている分だけ書き込み、書き込めたバイト数を返す
+//------------------------------------------------------------------------------
+size_t RingBuffer::write(const void *data, size_t len)
+{
+    len = std::min(len, getFreeSpace());
+    size_t index = m_tail & m_mask;
+    size_t first = std::min(len, m_data.size() - index);
+    ::memcpy(&m_data[index], data, first);
+    ::memcpy(&m_data[0], (const uint8_t *)data + first, len - first);
+    m_tail += len;
+    return len;
+}
+
+//------------------------------------------------------------------------------
+//  末尾に連続して書き込める領域を返す（len にそのバイト数が入る）
+//  書き込んだ分は commit() で確定する
+//------------------------------------------------------------------------------
+uint8_t *RingBuffer::getWritePointer(size_t& len)
+{
+    size_t index = m_tail & m_mask;
+    len = std::min(getFreeSpace(), m_data.size() - index);
+    return &m_data[index];
+}
+
+//------------------------------------------------------------------------------
+void RingBuffer::commit(size_t len)
+{
+    m_tail += std::min(len, getFreeSpace());
+}
+
+//------------------------------------------------------------------------------
+//  先頭から連続して読み出せる領域を返す（len にそのバイト数が入る）
+//------------------------------------------------------------------------------
+const uint8_t *RingBuffer::getReadPointer(size_t& len)
+{
+    size_t index = m_head & m_mask;
+    len = std::min(getSize(), m_data.size() - index);
+    return &m_data[index];
+}
+
+//------------------------------------------------------------------------------
+//  先頭から len バイトを連続した領域として参照する
+//  バッファの終端をまたぐ場合だけ scratch へ連結してそちらを返す
+//------------------------------------------------------------------------------
+const uint8_t *RingBuffer::peek(size_t len, std::string& scratch)
+{
+    size_t index = m_head & m_mask;
+    if( index + len <= m_data.size() )
+    {
+        return &m_data[index];
+    }
+    size_t first = m_data.size() - index;
+    scratch.assign((const char *)&m_data[index], first);
+    scratch.append((const char *)&m_data[0], len - first);
+    return (const uint8_t *)scratch.data();
+}
+
+//------------------------------------------------------------------------------
+void RingBuffer::consume(size_t len)
+{
+    m_head += std::min(len, getSize());
+}
+
+//------------------------------------------------------------------------------
+//  先頭から from バイト目以降で最初に c が現れる位置（先頭からのオフセット）を返す
+//  見つからなければ npos
+//------------------------------------------------------------------------------
+size_t RingBuffer::find(uint8_t c, size_t from)
+{
+    size_t size = getSize();
+    while( from < size )
+    {
+        size_t index = (m_head + from) & m_mask;
+        size_t len = std::min(size - from, m_data.size() - index);
+        const uint8_t *p = (const uint8_t *)::memchr(&m_data[index], c, len);
+        if( p != NULL )
+        {
+            return from + (p - &m_data[index]);
+        }
+        from += len;
+    }
+    return npos;
+}
+
+
+
+//==============================================================================
+//  HostResolver
+//==============================================================================
+const int HostResolver::CACHE_SECONDS = 300;
+
+std::map<std::string, HostResolver::Entry> HostResolver::s_cache;
+std::mutex                                 HostResolver::s_mutex;
+std::condition_variable                    HostResolver::s_condition;
+
+//------------------------------------------------------------------------------
+std::string HostResolver::makeKey(const std::string& host, uint32_t port)
+{
+    return host + ":" + std::to_string(port);
+}
+
+//------------------------------------------------------------------------------
+//  host:port のアドレスを addresses に返す
+//  キャッシュが有効ならそれを、無ければ解決用のスレッドを起こして最大 timeoutMs 待つ
+//  解決が終わった場合（失敗して addresses が空の場合も含む）は true、
+//  時間内に終わらなかった場合と、結果が invalidate() で消された場合は false を返す
+//  （解決はそのまま続くか、次に呼んだときにやり直すので、後で呼び直せばよい）
+//------------------------------------------------------------------------------
+bool HostResolver::resolve(const std::string& host, uint32_t port, std::vector<Address>& addresses, int timeoutMs)
+{
+    std::string key = makeKey(host, port);
+    std::unique_lock<std::mutex> lock(s_mutex);
+    auto i = s_cache.find(key);
+    if( i == s_cache.end() || (!i->second.resolving && std::chrono::steady_clock::now() >= i->second.expire) )
+    {
+        Entry& entry = s_cache[key];
+        entry.resolving = true;
+
+        // getaddrinfo は止められないので、待つ側が諦めても構わないよう切り離して実行する
+        std::thread([host, port, key](){
+            struct addrinfo hints;
+            ::memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            struct addrinfo *result = NULL;
+            int error = ::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+
+            std::vector<Address> found;
+            for( struct addrinfo *p = result ; p != NULL ; p = p->ai_next )
+            {
+                Address a;
+                ::memcpy(&a.addr, p->ai_addr, p->ai_addrlen);
+                a.length = p->ai_addrlen;
+                a.family = p->ai_family;
+                found.push_back(a);
+            }
+            if( result != NULL )
+            {
+                ::freeaddrinfo(result);
+            }
+            if( error != 0 )
+            {
+                std::cerr << "getaddrinfo(" << host << "): " << ::gai_strerror(error) << std::endl;
+            }
+
+            std::lock_guard<std::mutex> lock(s_mutex);
+            Entry& entry = s_cache[key];
+            entry.addresses = found;
+            entry.resolving = false;
+            // 解決できなかった場合はキャッシュせず、次回もう一度問い合わせる
+            entry.expire = std::chrono::steady_clock::now() +
+                           std::chrono::seconds(found.empty() ? 0 : CACHE_SECONDS);
+            s_condition.notify_all();
+        }).detach();
+    }
+
+    // 待っている間に invalidate() で消されることがあるので、起きるたびに探し直す
+    auto resolved = [&key](){
+        auto i = s_cache.find(key);
+        return i == s_cache.end() || !i->second.resolving;
+    };
+    if( !s_condition.wait_for(lock, std::chrono::milliseconds(timeoutMs), resolved) )
+    {
+        return false;
+    }
+    i = s_cache.find(key);
+    if( i == s_cache.end() )
+    {
+        return false;
+    }
+    addresses = i->second.addresses;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  キャッシュしたアドレスに接続できなかった場合に呼び、次回は解決し直させる
+//------------------------------------------------------------------------------
+void HostResolver::invalidate(const std::string& host, uint32_t port)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+    auto i = s_cache.find(makeKey(host, port));
+    if( i != s_cache.end() && !i->second.resolving )
+    {
+        s_cache.erase(i);
+    }
+}
+
+
+
+//==============================================================================
+//  StreamClient
+//==============================================================================
+const int    StreamClient::RESOLVE_WAIT_MS = 100;
+const int    StreamClient::CONNECT_TIMEOUT_MS = 3000;
+const int    StreamClient::RECONNECT_MIN_MS = 250;
+const int    StreamClient::RECONNECT_MAX_MS = 8000;
+const size_t StreamClient::MIN_READ_SIZE = 4096;
+const size_t StreamClient::MAX_READ_SIZE = 64 * 1024;
+const size_t StreamClient::RX_CAPACITY = 128 * 1024;
+const size_t StreamClient::TX_CAPACITY = 64 * 1024;
+const int    StreamClient::SEND_WAIT_MS = 100;
+const char   StreamClient::DELIMITOR   = '\n';
+const char  *StreamClient::BINARY_HEADER = "binary: ";
+
+//------------------------------------------------------------------------------
+StreamClient::StreamClient(const char *host, uint32_t port) 
+    : m_host(host), m_port(port), m_connected(false), m_sockfd(-1),
+      m_txBuffer(TX_CAPACITY), m_rxBuffer(RX_CAPACITY), m_rxScanned(0), m_rxHeld(0),
+      m_binaryRemaining(0), m_readSize(MIN_READ_SIZE), m_rxDiscard(0), m_generation(0),
+      m_writing(false), m_reading(true), m_terminated(false), m_reconnect(false)
+{
+    m_eventfd = ::eventfd(0, EFD_NONBLOCK);
+    m_epollfd = ::epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = m_eventfd;
+    ::epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_eventfd, &ev);
+
     m_thread = new std::thread([this](){ execute(); });
 }
 
 //------------------------------------------------------------------------------
-TCPClient::~TCPClient()
+StreamClient::~StreamClient()
 {
     m_terminated = true;
+    wakeup();
     m_thread->join();
     delete m_thread;
-    ::close(m_sockfd);
+    ::close(m_epollfd);
+    ::close(m_eventfd);
+}
+
+//------------------------------------------------------------------------------
+//  Unix ドメインソケットのアドレス（@ で始まる名前は抽象名前空間）
+//------------------------------------------------------------------------------
+static HostResolver::Address makeLocalAddress(const std::string& path)
+{
+    HostResolver::Address a;
+    struct sockaddr_un *un = (struct sockaddr_un *)&a.addr;
+    ::memset(un, 0, sizeof(*un));
+    un->sun_family = AF_UNIX;
+    size_t len = std::min(path.length(), sizeof(un->sun_path) - 1);
+    ::memcpy(un->sun_path, path.c_str(), len);
+    if( path[0] == '@' )
+    {
+        un->sun_path[0] = '\0';
+        a.length = offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    else
+    {
+        a.length = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    }
+    a.family = AF_UNIX;
+    return a;
 }
 
 //------------------------------------------------------------------------------
-void TCPClient::connect()
+//  解決したアドレスへ順にノンブロッキングで接続を試みる
+//------------------------------------------------------------------------------
+bool StreamClient::connect()
 {
-    ::bzero(&m_servaddr, sizeof(m_servaddr));
-    m_servaddr.sin_family = AF_INET;
-    m_server = gethostbyname(m_host.c_str());
-    ::bcopy((char *)m_server->h_addr, (char *)&m_servaddr.sin_addr.s_addr, m_server->h_length);
-    m_servaddr.sin_port = htons(m_port);
+    std::vector<HostResolver::Address> addresses;
+    if( isLocal() )
+    {
+        addresses.push_back(makeLocalAddress(m_host));
+    }
+    else
+    {
+        while( !HostResolver::resolve(m_host, m_port, addresses, RESOLVE_WAIT_MS) )
+        {
+            if( m_terminated )
+            {
+                return false;
+            }
+        }
+    }
+
+    for( auto i = addresses.begin() ; i != addresses.end() && !m_terminated ; i++ )
+    {
+        m_sockfd = ::socket(i->family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if( m_sockfd < 0 )
+        {
+            continue;
+        }
+        if( i->family != AF_UNIX )
+        {
+            // 同じホスト内の接続では、相手の消失は keepalive を待たずに分かる
+            enableKeepalive();
+            disableNagle();
+        }
+
+        if( ::connect(m_sockfd, (struct sockaddr *)&i->addr, i->length) == 0 ||
+            (errno == EINPROGRESS && waitConnected()) )
+        {
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = m_sockfd;
+            ::epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_sockfd, &ev);
+
+            m_mutex.lock();
+            m_connected = true;
+            m_generation++;
+            m_writing = false;
+            m_reading = true;
+            auto handler = m_connectionHandler;
+            m_mutex.unlock();
+            if( handler )
+            {
+                handler(true);
+            }
+            return true;
+        }
+        ::close(m_sockfd);
+        m_sockfd = -1;
+    }
+
+    if( !addresses.empty() && !isLocal() )
+    {
+        // キャッシュしたアドレスが古くなっているかもしれないので、次回は解決し直す
+        HostResolver::invalidate(m_host, m_port);
+    }
+    return false;
+}
 
-    m_sockfd = ::socket(AF_INET, SOCK_STREAM, 0);
+//------------------------------------------------------------------------------
+//  ノンブロッキングの connect() が完了するまで最大 CONNECT_TIMEOUT_MS 待つ
+//------------------------------------------------------------------------------
+bool StreamClient::waitConnected()
+{
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.fd = m_sockfd;
+    ::epoll_ctl(m_epollfd, EPOLL_CTL_ADD, m_sockfd, &ev);
+
+    auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(CONNECT_TIMEOUT_MS);
+    bool completed = false;
+    while( !completed && !m_terminated )
+    {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(limit - std::chrono::steady_clock::now());
+        if( remaining.count() <= 0 )
+        {
+            break;
+        }
+        struct epoll_event events[2];
+        int n = ::epoll_wait(m_epollfd, events, 2, (int)remaining.count());
+        for( int i = 0 ; i < n ; i++ )
+        {
+            if( events[i].data.fd == m_eventfd )
+            {
+                uint64_t value;
+                ::read(m_eventfd, &value, sizeof(value));
+            }
+            else
+            {
+                completed = true;
+            }
+        }
+    }
+    ::epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_sockfd, NULL);
 
-    enableKeepalive();
+    if( !completed )
+    {
+        if( !m_terminated )
+        {
+            std::cerr << "connect " << m_host << ": timed out" << std::endl;
+        }
+        return false;
+    }
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if( ::getsockopt(m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0 )
+    {
+        std::cerr << "connect " << m_host << ": " << ::strerror(error) << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    if( ::connect(m_sockfd, (struct sockaddr *)&m_servaddr, sizeof(m_servaddr)) < 0 )
+//------------------------------------------------------------------------------
+//  timeoutMs 経つか終了要求があるまで待つ（送信データの追加では起きない）
+//------------------------------------------------------------------------------
+void StreamClient::waitWakeup(int timeoutMs)
+{
+    auto limit = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while( !m_terminated )
     {
-        perror("connect");
-        throw std::runtime_error("Unable to connect MPD server");
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(limit - std::chrono::steady_clock::now());
+        if( remaining.count() <= 0 )
+        {
+            break;
+        }
+        struct epoll_event ev;
+        if( ::epoll_wait(m_epollfd, &ev, 1, (int)remaining.count()) > 0 )
+        {
+            uint64_t value;
+            ::read(m_eventfd, &value, sizeof(value));
+        }
     }
 }
 
 //------------------------------------------------------------------------------
-bool TCPClient::hadError()
+bool StreamClient::hadError()
 {
     int error = 0;
     socklen_t len = sizeof(error);
@@ -65,7 +446,7 @@ bool TCPClient::hadError()
 }
 
 //------------------------------------------------------------------------------
-bool TCPClient::enableKeepalive() 
+bool StreamClient::enableKeepalive() 
 {
     int yes = 1;
 
@@ -96,426 +477,3053 @@ bool TCPClient::enableKeepalive()
 }
 
 //------------------------------------------------------------------------------
-void TCPClient::execute()
+//  コマンドは１行ずつ小さく送るので、Nagle アルゴリズムで送信を遅らせない
+//------------------------------------------------------------------------------
+void StreamClient::disableNagle()
+{
+    int yes = 1;
+    ::setsockopt(m_sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int));
+}
+
+//------------------------------------------------------------------------------
+//  接続できなかった場合や切断された場合は、間隔を倍々に広げながら再接続を試みる
+//  （接続できれば間隔は元に戻す）
+//------------------------------------------------------------------------------
+void StreamClient::execute()
 {
+    int backoff = RECONNECT_MIN_MS;
     while( !m_terminated )
     {
-        internalSend();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        internalReceive();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if( !connect() )
+        {
+            waitWakeup(backoff);
+            backoff = std::min(backoff * 2, RECONNECT_MAX_MS);
+            continue;
+        }
+        backoff = RECONNECT_MIN_MS;
+        serve();
+        disconnect();
     }
 }
 
 //------------------------------------------------------------------------------
-void TCPClient::sendRawBytes(const void *data, uint32_t len)
+//  ソケットが読み書き可能になるか、eventfd で起こされるまでブロックする
+//  （待ち時間は無いので、何も起きていない間はスレッドは一度も起きない）
+//  切断されるか終了要求があれば戻る
+//------------------------------------------------------------------------------
+void StreamClient::serve()
 {
-    uint8_t *p = (uint8_t *)data;
-    m_mutex.lock();
-    for( uint32_t n = 0 ; n < len ; n++ )
+    struct epoll_event events[2];
+    bool alive = true;
+    while( alive && !m_terminated )
     {
-        m_txBuffer.push_back(p[n]);
+        int n = ::epoll_wait(m_epollfd, events, 2, -1);
+        if( n < 0 )
+        {
+            if( errno != EINTR )
+            {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for( int i = 0 ; i < n && alive ; i++ )
+        {
+            if( events[i].data.fd == m_eventfd )
+            {
+                uint64_t value;
+                ::read(m_eventfd, &value, sizeof(value));
+                if( m_reconnect )
+                {
+                    alive = false;
+                    continue;
+                }
+                // 送信データが追加されていれば、EPOLLOUT を待たずにそのまま書き込んでみる
+                alive = internalSend();
+                continue;
+            }
+            if( events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) )
+            {
+                alive = internalReceive();
+            }
+            if( alive && (events[i].events & EPOLLOUT) )
+            {
+                alive = internalSend();
+            }
+        }
+        updateEvents();
     }
-    m_mutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-void TCPClient::internalSend()
-{    
+//  ソケットを閉じて、切断前の接続の送受信データを捨てる
+//------------------------------------------------------------------------------
+void StreamClient::disconnect()
+{
+    ::epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_sockfd, NULL);
+
     m_mutex.lock();
+    m_connected = false;
+    ::close(m_sockfd);
+    m_sockfd = -1;
+    m_txBuffer.clear();
+    // 受信済みで取り出されていない分は、取り出す側で捨てる（m_rxDiscard 参照）
+    m_rxDiscard = m_rxBuffer.getWritePosition();
+    m_binaryRemaining = 0;
+    m_reconnect = false;
+    auto handler = m_connectionHandler;
+    m_mutex.unlock();
 
-    if( m_txBuffer.empty() )
+    m_rxCondition.notify_all();
+    if( handler && !m_terminated )
+    {
+        handler(false);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  切断して接続し直す（応答の途中でタイムアウトした場合など、受信データの区切りが
+//  分からなくなったときに使う）。切断されるまで待つので、戻った後に受信するのは次の接続のデータ
+//------------------------------------------------------------------------------
+void StreamClient::reconnect()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if( !m_connected )
+    {
+        return;
+    }
+    m_reconnect = true;
+    wakeup();
+    m_rxCondition.wait(lock, [this](){ return !m_reconnect || m_terminated; });
+}
+
+//------------------------------------------------------------------------------
+void StreamClient::wakeup()
+{
+    uint64_t value = 1;
+    ::write(m_eventfd, &value, sizeof(value));
+}
+
+//------------------------------------------------------------------------------
+//  送信し切れていないデータがある間だけ EPOLLOUT を、
+//  受信バッファに空きがある間だけ EPOLLIN を監視する
+//  EPOLLHUP / EPOLLERR は監視を止められないので、受信バッファが一杯の間はソケットを
+//  epoll から外す（その間の送信は eventfd で起こされた時に行う）
+//------------------------------------------------------------------------------
+void StreamClient::updateEvents()
+{
+    if( !m_connected )
     {
-        m_mutex.unlock();
         return;
     }
+    m_mutex.lock();
+    bool writing = !m_txBuffer.isEmpty();
+    bool reading = m_rxBuffer.getFreeSpace() > 0;
+    int op = (reading != m_reading) ? (reading ? EPOLL_CTL_ADD : EPOLL_CTL_DEL) :
+             (reading && writing != m_writing) ? EPOLL_CTL_MOD : 0;
+    m_writing = writing;
+    m_reading = reading;
+    m_mutex.unlock();
+    if( op != 0 )
+    {
+        struct epoll_event ev;
+        ev.events = (uint32_t)EPOLLIN | (writing ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = m_sockfd;
+        ::epoll_ctl(m_epollfd, op, m_sockfd, &ev);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  受信データが届くたびに（受信スレッドから）呼ばれる関数を設定する
+//------------------------------------------------------------------------------
+void StreamClient::setNotifier(std::function<void()> notifier)
+{
+    m_mutex.lock();
+    m_notifier = notifier;
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  接続・切断のたびに（受信スレッドから）呼ばれる関数を設定する
+//  切断時は、呼ばれた時点で未送信・未受信のデータはすでに捨てられている
+//------------------------------------------------------------------------------
+void StreamClient::setConnectionHandler(std::function<void(bool connected)> handler)
+{
+    m_mutex.lock();
+    m_connectionHandler = handler;
+    m_mutex.unlock();
+}
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
+//------------------------------------------------------------------------------
+//  再接続されたかどうかの確認に使う
+//------------------------------------------------------------------------------
+unsigned StreamClient::getGeneration()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_generation;
+}
 
-    fd_set mask;
-    FD_ZERO(&mask);
-    FD_SET(m_sockfd, &mask);
+//------------------------------------------------------------------------------
+//  送信バッファに収まらない分は、呼び出したスレッドで直接書き出して空きを作る
+//  （１つの StreamClient へ送信するスレッドは１つだけとする）
+//------------------------------------------------------------------------------
+void StreamClient::sendRawBytes(const void *data, uint32_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while( m_connected )
+    {
+        size_t n = m_txBuffer.write(p, len);
+        p += n;
+        len -= n;
+        if( len == 0 || !flush() )
+        {
+            break;
+        }
+        if( m_txBuffer.getFreeSpace() == 0 )
+        {
+            // 再接続で m_sockfd が書き換えられるので、ロックを外す前に取り出しておく
+            struct pollfd fd = { m_sockfd, POLLOUT, 0 };
+            lock.unlock();
+            ::poll(&fd, 1, SEND_WAIT_MS);
+            lock.lock();
+        }
+    }
+    lock.unlock();
+    wakeup();
+}
 
-    int w = m_sockfd + 1;
-    
-    switch( ::select(w, NULL, &mask, NULL, &tv) )
+//------------------------------------------------------------------------------
+//  送信バッファの内容をソケットへ書き込めるだけ書き込む
+//  m_mutex をロックした状態で呼ぶこと。書き込みエラーの場合は false を返す
+//------------------------------------------------------------------------------
+bool StreamClient::flush()
+{
+    while( !m_txBuffer.isEmpty() )
     {
-        case -1:
-            if( errno != EINTR )
+        size_t len;
+        const uint8_t *p = m_txBuffer.getReadPointer(len);
+        // 切断されたソケットへの書き込みで SIGPIPE が発生しないようにする
+        ssize_t n = ::send(m_sockfd, p, len, MSG_NOSIGNAL);
+        if( n < 0 )
+        {
+            if( errno == EINTR )
             {
-                perror("select(recv)");
+                continue;
             }
-            break;
-        case 0:
-            // timeout
-            break;
-        default:
-            if( FD_ISSET(m_sockfd, &mask) ) 
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
             {
-                int sentBytes = ::write(m_sockfd, &m_txBuffer[0], m_txBuffer.size());
-                if( sentBytes < 0 )
+                perror("send");
+                return false;
+            }
+            break;
+        }
+        m_txBuffer.consume(n);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  書き込みエラー（切断）の場合は false を返す
+//------------------------------------------------------------------------------
+bool StreamClient::internalSend()
+{    
+    m_mutex.lock();
+    bool alive = !m_connected || flush();
+    m_mutex.unlock();
+    return alive;
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//  先頭の行が揃っていればそのバイト数（\n を含む）を、揃っていなければ 0 を返す
+//  バイナリデータが receiveBinary() で読まれずに残っている場合は読み捨てる
+//------------------------------------------------------------------------------
+size_t StreamClient::scanRxElement()
+{
+    if( m_binaryRemaining > 0 )
+    {
+        size_t n = std::min(m_binaryRemaining, m_rxBuffer.getSize());
+        m_rxBuffer.consume(n);
+        m_binaryRemaining -= n;
+        if( m_binaryRemaining > 0 )
+        {
+            return 0;
+        }
+    }
+
+    // 前回探し終えたところから続けて探す
+    size_t pos = m_rxBuffer.find(DELIMITOR, m_rxScanned);
+    if( pos != RingBuffer::npos )
+    {
+        m_rxScanned = pos;
+        return pos + 1;
+    }
+    m_rxScanned = m_rxBuffer.getSize();
+
+    if( m_rxBuffer.getFreeSpace() == 0 )
+    {
+        // バッファ全体を使っても１行に満たない（プロトコル上ありえないので捨てる）
+        // 受信スレッドが書き込み中の領域があるので clear() はせず、末尾まで読み進める
+        std::cerr << "StreamClient: received line exceeds " << m_rxBuffer.getCapacity() << " bytes" << std::endl;
+        m_rxBuffer.consume(m_rxBuffer.getSize());
+        m_rxScanned = 0;
+        if( !m_reading )
+        {
+            wakeup();
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//  element はバッファ内を直接指す（終端をまたぐ要素だけ m_rxScratch へ連結する）
+//------------------------------------------------------------------------------
+bool StreamClient::takeRxElement(std::string_view& element)
+{
+    size_t length = scanRxElement();
+    if( length == 0 )
+    {
+        return false;
+    }
+    const char *p = (const char *)m_rxBuffer.peek(length, m_rxScratch);
+    element = std::string_view(p, length);
+    m_rxHeld = length;
+    m_rxScanned = 0;
+
+    const size_t headerLength = ::strlen(BINARY_HEADER);
+    if( element.compare(0, headerLength, BINARY_HEADER) == 0 )
+    {
+        // 続く N バイトは改行を含みうるので、行単位をやめて N バイト単位で受け取る
+        // （バイナリデータの後ろには \n が１つ付く）
+        m_binaryRemaining = (size_t)ResponseLine::parseInt(element.substr(headerLength)) + 1;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  受信済みのバイナリデータを data の後ろへ追加する（m_mutex をロックした状態で呼ぶこと）
+//  読み進めたバイト数を返す
+//------------------------------------------------------------------------------
+size_t StreamClient::takeBinary(std::vector<uint8_t>& data)
+{
+    size_t taken = 0;
+    while( m_binaryRemaining > 0 && !m_rxBuffer.isEmpty() )
+    {
+        size_t len;
+        const uint8_t *p = m_rxBuffer.getReadPointer(len);
+        len = std::min(len, m_binaryRemaining);
+        // 末尾の \n はデータに含めない
+        size_t payload = std::min(len, m_binaryRemaining - 1);
+        data.insert(data.end(), p, p + payload);
+        m_rxBuffer.consume(len);
+        m_binaryRemaining -= len;
+        taken += len;
+    }
+    if( taken > 0 && !m_reading )
+    {
+        wakeup();
+    }
+    return taken;
+}
+
+//------------------------------------------------------------------------------
+//  前回渡した要素の領域を解放する（m_mutex をロックした状態で呼ぶこと）
+//------------------------------------------------------------------------------
+void StreamClient::releaseRxElement()
+{
+    m_rxBuffer.consume(m_rxHeld);
+    m_rxHeld = 0;
+
+    // 切断前の接続から受信した残りは捨てる
+    size_t position = m_rxBuffer.getReadPosition();
+    if( position < m_rxDiscard )
+    {
+        m_rxBuffer.consume(m_rxDiscard - position);
+        m_rxScanned = 0;
+        m_binaryRemaining = 0;
+    }
+    if( !m_reading )
+    {
+        // 受信バッファが一杯で止めていた EPOLLIN の監視を再開させる
+        wakeup();
+    }
+}
+
+//------------------------------------------------------------------------------
+//  受信済みの要素を１つ取り出す（揃っていなければ false を返す）
+//  element は次に receive() を呼ぶまで有効。受信するスレッドは１つだけとする
+//------------------------------------------------------------------------------
+bool StreamClient::receive(std::string_view& element)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    releaseRxElement();
+    return takeRxElement(element);
+}
+
+//------------------------------------------------------------------------------
+//  受信データが揃うまで最大 timeoutMs ミリ秒待つ
+//------------------------------------------------------------------------------
+bool StreamClient::receive(std::string_view& element, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    releaseRxElement();
+    m_rxCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+        [this](){ return scanRxElement() > 0; });
+    return takeRxElement(element);
+}
+
+//------------------------------------------------------------------------------
+//  "binary: N" の行を受け取った後、続くバイナリデータを data の後ろへ追加する
+//  最大 timeoutMs ミリ秒待ち、少しでも受け取れれば true を返す
+//  getBinaryRemaining() が 0 になるまで繰り返し呼ぶこと
+//------------------------------------------------------------------------------
+bool StreamClient::receiveBinary(std::vector<uint8_t>& data, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    releaseRxElement();
+    m_rxCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+        [this](){ return m_binaryRemaining == 0 || !m_rxBuffer.isEmpty(); });
+    return takeBinary(data) > 0;
+}
+
+//------------------------------------------------------------------------------
+//  まだ受け取っていないバイナリデータのバイト数（末尾の \n は含まない）
+//------------------------------------------------------------------------------
+size_t StreamClient::getBinaryRemaining()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return (m_binaryRemaining > 1) ? m_binaryRemaining - 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+//  受信バッファの空き領域へ直接、読めるだけ読み込む（切断された場合は false を返す）
+//  要求したバイト数を満たす読み込みが続けば１回の要求量を増やし、
+//  満たなければ減らす
+//------------------------------------------------------------------------------
+bool StreamClient::internalReceive()
+{
+    bool received = false;
+    bool alive = true;
+    while( true )
+    {
+        // 書き込み先の領域は受信スレッドだけが触るので、read() の間はロックを外してよい
+        size_t space;
+        m_mutex.lock();
+        uint8_t *p = m_rxBuffer.getWritePointer(space);
+        m_mutex.unlock();
+        if( space == 0 )
+        {
+            // 受信バッファが一杯（取り出されるまで EPOLLIN の監視を止める）
+            break;
+        }
+        size_t request = std::min(space, m_readSize);
+        ssize_t tn = ::read(m_sockfd, p, request);
+        if( tn > 0 )
+        {
+            m_mutex.lock();
+            m_rxBuffer.commit(tn);
+            m_mutex.unlock();
+            if( (size_t)tn == request && request == m_readSize )
+            {
+                m_readSize = std::min(m_readSize * 2, MAX_READ_SIZE);
+            }
+            else if( (size_t)tn < request / 2 )
+            {
+                m_readSize = std::max(m_readSize / 2, MIN_READ_SIZE);
+            }
+            received = true;
+            continue;
+        }
+        if( tn == 0 )
+        {
+            alive = false;
+        }
+        else if( errno == EINTR )
+        {
+            continue;
+        }
+        else if( errno != EAGAIN && errno != EWOULDBLOCK )
+        {
+            perror("read");
+            alive = false;
+        }
+        break;
+    }
+
+    if( received )
+    {
+        m_mutex.lock();
+        std::function<void()> notifier = m_notifier;
+        m_mutex.unlock();
+        m_rxCondition.notify_all();
+        if( notifier )
+        {
+            notifier();
+        }
+    }
+    return alive;
+}
+
+
+
+//==============================================================================
+//   ResponseLine
+//==============================================================================
+//------------------------------------------------------------------------------
+//  "key: value\n" を最初の ": " で分ける（value に ": " が含まれていてもよい）
+//  "OK" や "list_OK" のように ": " を含まない行は false を返す
+//------------------------------------------------------------------------------
+bool ResponseLine::parse(std::string_view line)
+{
+    size_t colon = line.find(": ");
+    if( colon == std::string_view::npos )
+    {
+        m_key = m_value = std::string_view();
+        return false;
+    }
+    m_key = line.substr(0, colon);
+    m_value = line.substr(colon + 2);
+    if( !m_value.empty() && m_value.back() == '\n' )
+    {
+        m_value.remove_suffix(1);
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  lsinfo / listallinfo / playlistinfo などの応答で、次の項目が始まる行なら true を返す
+//  （status のように項目が１つだけの応答の "playlist" には使わないこと）
+//------------------------------------------------------------------------------
+bool ResponseLine::isRecordStart() const
+{
+    return m_key == "file" || m_key == "directory" || m_key == "playlist";
+}
+
+//------------------------------------------------------------------------------
+//  先頭の符号と数字だけを読む（数字が無ければ 0）
+//------------------------------------------------------------------------------
+int64_t ResponseLine::parseInt(std::string_view str)
+{
+    size_t n = 0;
+    bool negative = false;
+    if( n < str.size() && (str[n] == '-' || str[n] == '+') )
+    {
+        negative = (str[n++] == '-');
+    }
+    uint64_t value = 0;
+    for( ; n < str.size() && str[n] >= '0' && str[n] <= '9' ; n++ )
+    {
+        value = value * 10 + (str[n] - '0');
+    }
+    return negative ? -(int64_t)value : (int64_t)value;
+}
+
+//------------------------------------------------------------------------------
+//  "-123.456" の形式の固定小数点数を読む（指数表記や nan は 0 になる）
+//  仮数を整数で数えてから 10 のべき乗で割るので、15 桁までは strtod() と同じ値になる
+//------------------------------------------------------------------------------
+double ResponseLine::parseDouble(std::string_view str)
+{
+    static const double POW10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+    };
+    static const int      MAX_DIGITS = 15;
+    static const uint64_t MAX_MANTISSA = 100000000000000ull;    // これ以上の桁は捨てる
+
+    size_t n = 0;
+    bool negative = false;
+    if( n < str.size() && (str[n] == '-' || str[n] == '+') )
+    {
+        negative = (str[n++] == '-');
+    }
+    uint64_t mantissa = 0;
+    for( ; n < str.size() && str[n] >= '0' && str[n] <= '9' ; n++ )
+    {
+        mantissa = mantissa * 10 + (str[n] - '0');
+    }
+    int digits = 0;
+    if( n < str.size() && str[n] == '.' )
+    {
+        for( n++ ; n < str.size() && str[n] >= '0' && str[n] <= '9' && digits < MAX_DIGITS && mantissa < MAX_MANTISSA ; n++ )
+        {
+            mantissa = mantissa * 10 + (str[n] - '0');
+            digits++;
+        }
+    }
+    double value = (double)mantissa / POW10[digits];
+    return negative ? -value : value;
+}
+
+//==============================================================================
+//   PlayerStatus
+//==============================================================================
+//  status の応答のキー
+//  キーから表の位置を求めるハッシュ（FNV-1a）の種は、これらのキーが衝突しないように
+//  選んである。キーを増やして衝突した場合はコンパイルエラーになるので、種を選び直すこと
+//------------------------------------------------------------------------------
+enum {
+    KEY_VOLUME,
+    KEY_REPEAT,
+    KEY_RANDOM,
+    KEY_SINGLE,
+    KEY_CONSUME,
+    KEY_PLAYLIST,
+    KEY_PLAYLISTLENGTH,
+    KEY_MIXRAMPDB,
+    KEY_STATE,
+    KEY_SONG,
+    KEY_SONGID,
+    KEY_NEXTSONG,
+    KEY_NEXTSONGID,
+    KEY_ELAPSED,
+    KEY_DURATION,
+    KEY_BITRATE,
+    KEY_XFADE,
+    KEY_AUDIO,
+    KEY_UPDATING_DB,
+    KEY_ERROR,
+    NUM_STATUS_KEYS
+};
+
+struct StatusKey
+{
+    const char *name;
+    const char *defaultValue;   // 応答に含まれなかった場合の値
+};
+
+static constexpr StatusKey STATUS_KEYS[NUM_STATUS_KEYS] = {
+    { "volume",         "-1" },
+    { "repeat",         "0" },
+    { "random",         "0" },
+    { "single",         "0" },
+    { "consume",        "0" },
+    { "playlist",       "0" },
+    { "playlistlength", "0" },
+    { "mixrampdb",      "0" },
+    { "state",          "stop" },
+    { "song",           "-1" },
+    { "songid",         "-1" },
+    { "nextsong",       "-1" },
+    { "nextsongid",     "-1" },
+    { "elapsed",        "0" },
+    { "duration",       "0" },
+    { "bitrate",        "0" },
+    { "xfade",          "0" },
+    { "audio",          "" },
+    { "updating_db",    "0" },
+    { "error",          "" }
+};
+
+static constexpr uint32_t STATUS_HASH_SEED  = 2166136287u;
+static constexpr size_t   STATUS_TABLE_SIZE = 64;
+
+//------------------------------------------------------------------------------
+static constexpr size_t hashStatusKey(const char *key, size_t len)
+{
+    uint32_t h = STATUS_HASH_SEED;
+    for( size_t n = 0 ; n < len ; n++ )
+    {
+        h = (h ^ (uint8_t)key[n]) * 16777619u;
+    }
+    return h % STATUS_TABLE_SIZE;
+}
+
+//------------------------------------------------------------------------------
+static constexpr size_t keyLength(const char *key)
+{
+    size_t n = 0;
+    while( key[n] != '\0' )
+    {
+        n++;
+    }
+    return n;
+}
+
+//------------------------------------------------------------------------------
+//  表の位置 → KEY_xxxx（空きは -1）
+//------------------------------------------------------------------------------
+static constexpr std::array<int8_t, STATUS_TABLE_SIZE> makeStatusTable()
+{
+    std::array<int8_t, STATUS_TABLE_SIZE> table{};
+    for( size_t n = 0 ; n < STATUS_TABLE_SIZE ; n++ )
+    {
+        table[n] = -1;
+    }
+    for( int k = 0 ; k < NUM_STATUS_KEYS ; k++ )
+    {
+        table[hashStatusKey(STATUS_KEYS[k].name, keyLength(STATUS_KEYS[k].name))] = (int8_t)k;
+    }
+    return table;
+}
+
+static constexpr std::array<int8_t, STATUS_TABLE_SIZE> STATUS_TABLE = makeStatusTable();
+
+//------------------------------------------------------------------------------
+static constexpr bool isPerfectHash()
+{
+    for( int k = 0 ; k < NUM_STATUS_KEYS ; k++ )
+    {
+        if( STATUS_TABLE[hashStatusKey(STATUS_KEYS[k].name, keyLength(STATUS_KEYS[k].name))] != k )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(isPerfectHash(), "status keys collide; choose another STATUS_HASH_SEED");
+
+//------------------------------------------------------------------------------
+//  field が value と異なれば更新して、m_changed に flag を立てる
+//------------------------------------------------------------------------------
+template<typename T> static void updateField(T& field, T value, uint32_t flag, uint32_t& changed)
+{
+    if( field != value )
+    {
+        field = value;
+        changed |= flag;
+    }
+}
+
+//------------------------------------------------------------------------------
+static void updateField(std::string& field, std::string_view value, uint32_t flag, uint32_t& changed)
+{
+    if( field != value )
+    {
+        field.assign(value.data(), value.size());
+        changed |= flag;
+    }
+}
+
+const double PlayerStatus::ELAPSED_TOLERANCE = 0.5;    // 秒単位
+
+//------------------------------------------------------------------------------
+PlayerStatus::PlayerStatus()
+    : volume(50), state(PLAYERSTATE_STOP), song(-1), songId(-1), nextSong(-1), nextSongId(-1),
+      elapsed(0), duration(0), bitrate(0), playlistVersion(0), playlistLength(0),
+      random(false), repeat(false), single(SINGLE_OFF), consume(false), crossfade(0),
+      mixrampDb(0), updatingDb(0), pending(0), m_seen(0), m_changed(0), m_rxElapsed(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+//  str は \n で終わる "key: value" の１行
+//------------------------------------------------------------------------------
+void PlayerStatus::parseStatusResponse(std::string_view str)
+{
+    ResponseLine line;
+    if( !line.parse(str) )
+    {
+        return;
+    }
+    std::string_view name = line.getKey();
+    int key = STATUS_TABLE[hashStatusKey(name.data(), name.size())];
+    if( key < 0 || name != STATUS_KEYS[key].name )
+    {
+        return;
+    }
+    m_seen |= (1u << key);
+    applyValue(key, line.getValue());
+}
+
+//------------------------------------------------------------------------------
+//  応答に含まれなかった項目を既定値に戻し、前回の endResponse() から変化した項目を返す
+//------------------------------------------------------------------------------
+uint32_t PlayerStatus::endResponse()
+{
+    for( int key = 0 ; key < NUM_STATUS_KEYS ; key++ )
+    {
+        if( (m_seen & (1u << key)) == 0 )
+        {
+            applyValue(key, STATUS_KEYS[key].defaultValue);
+        }
+    }
+
+    // 曲の切り替え・一時停止・再開・シークの場合だけ経過時間を合わせ直す
+    auto now = std::chrono::steady_clock::now();
+    if( (m_changed & (CHANGED_STATE | CHANGED_SONG)) != 0 || std::abs(m_rxElapsed - getElapsed(now)) > ELAPSED_TOLERANCE )
+    {
+        this->elapsed   = m_rxElapsed;
+        this->timestamp = now;
+        m_changed |= CHANGED_ELAPSED;
+    }
+    uint32_t changed = m_changed;
+    m_changed = 0;
+    return changed;
+}
+
+//------------------------------------------------------------------------------
+//  now の時点の経過時間（再生中は最後に合わせた時刻からの経過を足す）
+//------------------------------------------------------------------------------
+double PlayerStatus::getElapsed(std::chrono::steady_clock::time_point now) const
+{
+    if( this->state != PLAYERSTATE_PLAY )
+    {
+        return this->elapsed;
+    }
+    double e = this->elapsed + std::chrono::duration<double>(now - this->timestamp).count();
+    if( this->duration > 0 && e > this->duration )
+    {
+        e = this->duration;     // 曲の切り替えは player の変化で通知される
+    }
+    return e;
+}
+
+//------------------------------------------------------------------------------
+//  source の fields（CHANGED_xxxx）の項目だけを上書きする
+//------------------------------------------------------------------------------
+void PlayerStatus::overlay(const PlayerStatus& source, uint32_t fields)
+{
+    if( (fields & CHANGED_VOLUME) != 0 )
+    {
+        this->volume = source.volume;
+    }
+    if( (fields & CHANGED_STATE) != 0 )
+    {
+        this->state = source.state;
+    }
+    if( (fields & CHANGED_SONG) != 0 )
+    {
+        this->song   = source.song;
+        this->songId = source.songId;
+    }
+    if( (fields & CHANGED_NEXTSONG) != 0 )
+    {
+        this->nextSong   = source.nextSong;
+        this->nextSongId = source.nextSongId;
+    }
+    if( (fields & CHANGED_ELAPSED) != 0 )
+    {
+        this->elapsed   = source.elapsed;
+        this->timestamp = source.timestamp;
+    }
+    if( (fields & CHANGED_DURATION) != 0 )
+    {
+        this->duration = source.duration;
+    }
+    if( (fields & CHANGED_PLAYLIST) != 0 )
+    {
+        this->playlistLength = source.playlistLength;
+    }
+}
+
+//------------------------------------------------------------------------------
+//  source の fields の項目が一致すれば true を返す（経過時間は ELAPSED_TOLERANCE まで、
+//  曲の切り替えに伴う nextsong と duration は比べない）
+//------------------------------------------------------------------------------
+bool PlayerStatus::matches(const PlayerStatus& source, uint32_t fields, std::chrono::steady_clock::time_point now) const
+{
+    return ((fields & CHANGED_VOLUME) == 0 || this->volume == source.volume) &&
+           ((fields & CHANGED_STATE) == 0 || this->state == source.state) &&
+           ((fields & CHANGED_SONG) == 0 || this->song == source.song) &&
+           ((fields & CHANGED_ELAPSED) == 0 || std::abs(getElapsed(now) - source.getElapsed(now)) <= ELAPSED_TOLERANCE) &&
+           ((fields & CHANGED_PLAYLIST) == 0 || this->playlistLength == source.playlistLength);
+}
+
+//------------------------------------------------------------------------------
+//  value は応答の行の値か、応答に含まれなかった場合の既定値
+//------------------------------------------------------------------------------
+void PlayerStatus::applyValue(int key, std::string_view value)
+{
+    switch( key )
+    {
+        case KEY_VOLUME:
+            updateField(this->volume, (long)ResponseLine::parseInt(value), CHANGED_VOLUME, m_changed);
+            break;
+        case KEY_REPEAT:
+            updateField(this->repeat, value == "1", CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_RANDOM:
+            updateField(this->random, value == "1", CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_SINGLE:
+            updateField(this->single, (value == "oneshot") ? (int)SINGLE_ONESHOT :
+                                      (value == "1") ? (int)SINGLE_ON : (int)SINGLE_OFF, CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_CONSUME:
+            updateField(this->consume, value == "1", CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_PLAYLIST:
+            updateField(this->playlistVersion, (uint32_t)ResponseLine::parseInt(value), CHANGED_PLAYLIST, m_changed);
+            break;
+        case KEY_PLAYLISTLENGTH:
+            updateField(this->playlistLength, (int)ResponseLine::parseInt(value), CHANGED_PLAYLIST, m_changed);
+            break;
+        case KEY_MIXRAMPDB:
+            updateField(this->mixrampDb, ResponseLine::parseDouble(value), CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_STATE:
+            updateField(this->state, (value == "play") ? (int)PLAYERSTATE_PLAY :
+                                     (value == "pause") ? (int)PLAYERSTATE_PAUSE : (int)PLAYERSTATE_STOP, CHANGED_STATE, m_changed);
+            break;
+        case KEY_SONG:
+            updateField(this->song, (int)ResponseLine::parseInt(value), CHANGED_SONG, m_changed);
+            break;
+        case KEY_SONGID:
+            updateField(this->songId, (int)ResponseLine::parseInt(value), CHANGED_SONG, m_changed);
+            break;
+        case KEY_NEXTSONG:
+            updateField(this->nextSong, (int)ResponseLine::parseInt(value), CHANGED_NEXTSONG, m_changed);
+            break;
+        case KEY_NEXTSONGID:
+            updateField(this->nextSongId, (int)ResponseLine::parseInt(value), CHANGED_NEXTSONG, m_changed);
+            break;
+        case KEY_ELAPSED:
+            // 補間している値と比べて、合わせ直すかどうかは endResponse() で決める
+            m_rxElapsed = ResponseLine::parseDouble(value);
+            break;
+        case KEY_DURATION:
+            updateField(this->duration, ResponseLine::parseDouble(value), CHANGED_DURATION, m_changed);
+            break;
+        case KEY_BITRATE:
+            updateField(this->bitrate, (int)ResponseLine::parseInt(value), CHANGED_BITRATE, m_changed);
+            break;
+        case KEY_XFADE:
+            updateField(this->crossfade, (int)ResponseLine::parseInt(value), CHANGED_OPTIONS, m_changed);
+            break;
+        case KEY_AUDIO:
+            updateField(this->audio, value, CHANGED_AUDIO, m_changed);
+            break;
+        case KEY_UPDATING_DB:
+            updateField(this->updatingDb, (int)ResponseLine::parseInt(value), CHANGED_UPDATING, m_changed);
+            break;
+        case KEY_ERROR:
+            updateField(this->error, value, CHANGED_ERROR, m_changed);
+            break;
+    }
+}
+
+//==============================================================================
+//  SongInfo / SongCache
+//==============================================================================
+//------------------------------------------------------------------------------
+//  文字列は SongCache で共有しているので、内容ではなく指す先を比べる
+//------------------------------------------------------------------------------
+bool SongInfo::operator==(const SongInfo& other) const
+{
+    return file == other.file && title == other.title && artist == other.artist && album == other.album &&
+           albumArtist == other.albumArtist && duration == other.duration && track == other.track && year == other.year;
+}
+
+//------------------------------------------------------------------------------
+const std::string& SongInfo::getText(const Text& text)
+{
+    static const std::string empty;
+    return text ? *text : empty;
+}
+
+const size_t SongCache::DEFAULT_CAPACITY = 8192;   // 曲数
+
+//------------------------------------------------------------------------------
+SongCache::SongCache(size_t capacity)
+    : m_capacity(capacity), m_evicted(0), m_hits(0), m_misses(0)
+{
+
+}
+
+//------------------------------------------------------------------------------
+//  str と同じ内容の共有の文字列を返す（空の場合は NULL）
+//------------------------------------------------------------------------------
+SongInfo::Text SongCache::intern(std::string_view str)
+{
+    if( str.empty() )
+    {
+        return NULL;
+    }
+    auto i = m_strings.find(str);
+    if( i != m_strings.end() )
+    {
+        return i->second;
+    }
+    SongInfo::Text text = std::make_shared<const std::string>(str);
+    m_strings.emplace(std::string_view(*text), text);
+    return text;
+}
+
+//------------------------------------------------------------------------------
+//  曲の情報の行なら song に反映して true を返す
+//  項目の始まり（file / directory / playlist）では song を空にしてから読む
+//------------------------------------------------------------------------------
+bool SongCache::parseField(const ResponseLine& line, SongInfo& song)
+{
+    if( line.isRecordStart() )
+    {
+        song = SongInfo();
+        if( line.isKey("file") )
+        {
+            song.file = intern(line.getValue());
+        }
+    }
+    else if( line.isKey("Title") )
+    {
+        song.title = intern(line.getValue());
+    }
+    else if( line.isKey("Artist") )
+    {
+        song.artist = intern(line.getValue());
+    }
+    else if( line.isKey("Album") )
+    {
+        song.album = intern(line.getValue());
+    }
+    else if( line.isKey("AlbumArtist") )
+    {
+        song.albumArtist = intern(line.getValue());
+    }
+    else if( line.isKey("Track") )
+    {
+        song.track = (uint16_t)line.toInt();    // "3/12" の形式もある
+    }
+    else if( line.isKey("Date") )
+    {
+        song.year = (uint16_t)line.toInt();     // "1973-05-04" の形式もある
+    }
+    else if( line.isKey("duration") || line.isKey("Time") )
+    {
+        song.duration = (float)line.toDouble(); // Time は古い MPD の整数の秒数（duration が後に続く）
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  lsinfo / listallinfo / currentsong などの応答の１行
+//  受信し終えた曲はキャッシュに入れて reader.songs に加える
+//------------------------------------------------------------------------------
+void SongCache::parse(std::string_view str, Reader& reader)
+{
+    ResponseLine line;
+    if( !line.parse(str) )
+    {
+        return;
+    }
+    if( line.isRecordStart() )
+    {
+        endResponse(reader);
+    }
+    parseField(line, reader.song);
+}
+
+//------------------------------------------------------------------------------
+//  最後の曲をキャッシュに入れる
+//------------------------------------------------------------------------------
+void SongCache::endResponse(Reader& reader)
+{
+    if( reader.song.file )
+    {
+        reader.songs.push_back(insert(reader.song));
+    }
+    reader.song = SongInfo();
+}
+
+//------------------------------------------------------------------------------
+//  song（file は必須）をキャッシュに入れて、共有する写しを返す
+//  内容が同じ曲が既にあればそれを返す（タグが書き換えられていれば置き換える）
+//------------------------------------------------------------------------------
+std::shared_ptr<const SongInfo> SongCache::insert(const SongInfo& song)
+{
+    auto i = m_songs.find(*song.file);
+    if( i != m_songs.end() )
+    {
+        m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+        if( *i->second.song == song )
+        {
+            return i->second.song;
+        }
+        // キーが指している file の文字列は引き継ぐ
+        auto copy = std::make_shared<SongInfo>(song);
+        copy->file = i->second.song->file;
+        i->second.song = copy;
+        return copy;
+    }
+
+    auto copy = std::make_shared<SongInfo>(song);
+    copy->file = intern(*song.file);
+    std::string_view key = *copy->file;
+    m_lru.push_front(key);
+    m_songs.emplace(key, Entry{ copy, m_lru.begin() });
+    evict();
+    return copy;
+}
+
+//------------------------------------------------------------------------------
+//  file の曲の情報を返す（無ければ NULL）
+//------------------------------------------------------------------------------
+std::shared_ptr<const SongInfo> SongCache::find(std::string_view file)
+{
+    auto i = m_songs.find(file);
+    if( i == m_songs.end() )
+    {
+        m_misses++;
+        return NULL;
+    }
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+    return i->second.song;
+}
+
+//------------------------------------------------------------------------------
+//  capacity 曲を超えた分を、最近使われていないものから捨てる
+//------------------------------------------------------------------------------
+void SongCache::evict()
+{
+    while( m_songs.size() > m_capacity )
+    {
+        m_songs.erase(m_lru.back());
+        m_lru.pop_back();
+        m_evicted++;
+    }
+    if( m_evicted > m_capacity / 4 )
+    {
+        sweep();
+    }
+}
+
+//------------------------------------------------------------------------------
+//  どの曲からも使われなくなった文字列を捨てる
+//  （キャッシュの外で SongInfo を持っている間は、その文字列も残る）
+//------------------------------------------------------------------------------
+void SongCache::sweep()
+{
+    for( auto i = m_strings.begin() ; i != m_strings.end() ; )
+    {
+        if( i->second.use_count() == 1 )
+        {
+            i = m_strings.erase(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+    m_evicted = 0;
+}
+
+//==============================================================================
+//  PlayQueue
+//==============================================================================
+//------------------------------------------------------------------------------
+//  再接続した場合など、キューのバージョンが続いている保証が無い場合は最初から取り直す
+//------------------------------------------------------------------------------
+void PlayQueue::reset()
+{
+    m_entries.clear();
+    m_version = 0;
+    m_changePos = -1;
+}
+
+//------------------------------------------------------------------------------
+//  plchangesposid の応答の１行（"cpos: 位置" と "Id: songid" の組）
+//  songid が変わった位置は、曲の情報を取り直すまで STATE_EMPTY にする
+//------------------------------------------------------------------------------
+void PlayQueue::parseChange(std::string_view str)
+{
+    ResponseLine line;
+    if( !line.parse(str) )
+    {
+        return;
+    }
+    if( line.isKey("cpos") )
+    {
+        m_changePos = (int)line.toInt();
+    }
+    else if( line.isKey("Id") && m_changePos >= 0 )
+    {
+        int id = (int)line.toInt();
+        if( (size_t)m_changePos >= m_entries.size() )
+        {
+            m_entries.resize(m_changePos + 1);
+        }
+        QueueEntry& entry = m_entries[m_changePos];
+        if( entry.id != id )
+        {
+            entry = QueueEntry();
+            entry.id = id;
+        }
+        m_changePos = -1;
+    }
+}
+
+//------------------------------------------------------------------------------
+//  plchanges / playlistinfo / currentsong の応答の１行
+//  曲ごとに file から始まり、Pos, Id の順で終わる。曲の情報は cache に入れて共有し、
+//  songid が一致する位置にだけ反映する
+//  （要求してから応答までにキューが変わっていれば、次の差分で取り直す）
+//------------------------------------------------------------------------------
+void PlayQueue::parseSong(std::string_view str, SongReader& reader, SongCache& cache)
+{
+    ResponseLine line;
+    if( !line.parse(str) )
+    {
+        return;
+    }
+    if( line.isKey("Pos") )
+    {
+        reader.pos = (int)line.toInt();
+    }
+    else if( line.isKey("Id") )
+    {
+        reader.lastId = (int)line.toInt();
+        reader.last = reader.song.file ? cache.insert(reader.song) : NULL;
+        if( reader.last && reader.pos >= 0 && (size_t)reader.pos < m_entries.size() )
+        {
+            QueueEntry& entry = m_entries[reader.pos];
+            if( entry.id == reader.lastId || entry.id < 0 )
+            {
+                entry.id = reader.lastId;
+                entry.state = QueueEntry::STATE_LOADED;
+                entry.song = reader.last;
+            }
+        }
+        reader.song = SongInfo();
+        reader.pos = -1;
+    }
+    else
+    {
+        if( line.isRecordStart() )
+        {
+            reader.pos = -1;
+        }
+        cache.parseField(line, reader.song);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  差分をすべて受け取ったら、status で得たバージョンと曲数に合わせる
+//  （末尾から削除された曲は plchangesposid には現れないので、曲数で切り詰める）
+//------------------------------------------------------------------------------
+void PlayQueue::commit(uint32_t version, size_t length)
+{
+    m_entries.resize(length);
+    m_version = version;
+}
+
+//------------------------------------------------------------------------------
+//  [start, end) のうち曲の情報が無い範囲を [first, last] に返し、要求中にする
+//------------------------------------------------------------------------------
+bool PlayQueue::requestMissing(size_t start, size_t end, size_t& first, size_t& last)
+{
+    end = std::min(end, m_entries.size());
+    bool found = false;
+    for( size_t n = start ; n < end ; n++ )
+    {
+        if( m_entries[n].state == QueueEntry::STATE_EMPTY )
+        {
+            if( !found )
+            {
+                first = n;
+                found = true;
+            }
+            last = n;
+        }
+    }
+    if( found )
+    {
+        for( size_t n = first ; n <= last ; n++ )
+        {
+            if( m_entries[n].state == QueueEntry::STATE_EMPTY )
+            {
+                m_entries[n].state = QueueEntry::STATE_REQUESTED;
+            }
+        }
+    }
+    return found;
+}
+
+//------------------------------------------------------------------------------
+//  要求したが受け取れなかった曲を STATE_EMPTY に戻す
+//------------------------------------------------------------------------------
+void PlayQueue::cancelRequests(size_t first, size_t last)
+{
+    for( size_t n = first ; n <= last && n < m_entries.size() ; n++ )
+    {
+        if( m_entries[n].state == QueueEntry::STATE_REQUESTED )
+        {
+            m_entries[n].state = QueueEntry::STATE_EMPTY;
+        }
+    }
+}
+
+//==============================================================================
+//  CommandResult
+//==============================================================================
+//------------------------------------------------------------------------------
+//  "ACK [error@command_listNum] {current_command} message_text" を読み取る
+//------------------------------------------------------------------------------
+void CommandResult::parseAck(std::string_view line)
+{
+    this->ok = false;
+    size_t open = line.find('[');
+    if( open != std::string_view::npos )
+    {
+        this->error = (int)ResponseLine::parseInt(line.substr(open + 1));
+    }
+    size_t close = line.find("} ");
+    std::string_view text = (close != std::string_view::npos) ? line.substr(close + 2) : line;
+    if( !text.empty() && text.back() == '\n' )
+    {
+        text.remove_suffix(1);
+    }
+    this->message = std::string(text);
+}
+
+//==============================================================================
+//  LatencyHistogram
+//==============================================================================
+//------------------------------------------------------------------------------
+int LatencyHistogram::getBucket(uint64_t value)
+{
+    if( value < SUB_BUCKETS )
+    {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    if( msb >= MAX_BITS )
+    {
+        return NUM_BUCKETS - 1;
+    }
+    int shift = msb - SUB_BUCKET_BITS;
+    return SUB_BUCKETS * (shift + 1) + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+//------------------------------------------------------------------------------
+//  区間の中央の値
+//------------------------------------------------------------------------------
+uint64_t LatencyHistogram::getBucketValue(int bucket)
+{
+    if( bucket < SUB_BUCKETS )
+    {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return lower + ((1ULL << shift) >> 1);
+}
+
+//------------------------------------------------------------------------------
+void LatencyHistogram::clear()
+{
+    std::memset(m_counts, 0, sizeof(m_counts));
+    m_count = 0;
+    m_sum = 0;
+    m_max = 0;
+}
+
+//------------------------------------------------------------------------------
+void LatencyHistogram::record(uint64_t us)
+{
+    m_counts[getBucket(us)]++;
+    m_count++;
+    m_sum += us;
+    m_max = std::max(m_max, us);
+}
+
+//------------------------------------------------------------------------------
+//  percent（0〜100）パーセンタイルの値
+//------------------------------------------------------------------------------
+uint64_t LatencyHistogram::getPercentile(double percent) const
+{
+    if( m_count == 0 )
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)std::ceil(m_count * percent / 100.0);
+    uint64_t sum = 0;
+    for( int n = 0 ; n < NUM_BUCKETS ; n++ )
+    {
+        sum += m_counts[n];
+        if( sum >= target && m_counts[n] > 0 )
+        {
+            return std::min(getBucketValue(n), m_max);
+        }
+    }
+    return m_max;
+}
+
+//==============================================================================
+//  MPDClient
+//==============================================================================
+const char  *MPDClient::SERVER_ADDR = "raspberrypi.local";   // 同じ Pi で動かす場合は "/run/mpd/socket"
+const int    MPDClient::SERVER_PORT = 6600;
+const char  *MPDClient::BEGIN_COMMAND_LIST = "command_list_ok_begin";
+const char  *MPDClient::END_COMMAND_LIST = "command_list_end";
+const char  *MPDClient::IDLE_COMMAND = "idle player mixer playlist options";
+const int    MPDClient::MAX_COMMAND_LIST = 64;
+const size_t MPDClient::MAX_COMMAND_LIST_BYTES = 64 * 1024;    // MPD の max_command_list_size（既定 2048KB）より十分小さく
+const int    MPDClient::MAX_BACKGROUND_INFLIGHT = 2;
+const int    MPDClient::COVERART_BINARY_LIMIT = 65536;
+const int    MPDClient::BULK_TIMEOUT_MS = 5000;
+const int    MPDClient::KEEPALIVE_INTERVAL_MS = 30000;  // MPD の connection_timeout（既定 60 秒）より短く
+const int    MPDClient::PENDING_TIMEOUT_MS = 1000;      // 状態が変わらなかった操作（一時停止中の pause など）は通知が来ない
+const int    MPDClient::TERMINATE_TIMEOUT_MS = 1000;
+
+//------------------------------------------------------------------------------
+//  コマンド引数のクォート（" と \ はエスケープする）
+//------------------------------------------------------------------------------
+static std::string quoteArgument(const std::string& arg)
+{
+    std::string s = "\"";
+    for( auto i = arg.begin() ; i != arg.end() ; i++ )
+    {
+        if( *i == '"' || *i == '\\' )
+        {
+            s += '\\';
+        }
+        s += *i;
+    }
+    s += '"';
+    return s;
+}
+
+//------------------------------------------------------------------------------
+//  接続先は環境変数 MPD_HOST / MPD_PORT で変えられる（mpc などと同じ）
+//  MPD_HOST に /run/mpd/socket のようなパスを指定すると Unix ドメインソケットで接続する
+//  （"password@host" の形式の場合、パスワードは使わない）
+//------------------------------------------------------------------------------
+std::string MPDClient::getServerAddress()
+{
+    const char *env = std::getenv("MPD_HOST");
+    if( env == NULL || *env == '\0' )
+    {
+        return SERVER_ADDR;
+    }
+    std::string host = env;
+    size_t at = host.rfind('@');
+    if( at != std::string::npos && at > 0 )
+    {
+        host = host.substr(at + 1);
+    }
+    return host;
+}
+
+//------------------------------------------------------------------------------
+int MPDClient::getServerPort()
+{
+    const char *env = std::getenv("MPD_PORT");
+    int port = (env != NULL) ? std::atoi(env) : 0;
+    return (port > 0) ? port : SERVER_PORT;
+}
+
+//------------------------------------------------------------------------------
+//  MPD へは３本の接続を張る
+//  操作用: play などのコマンドだけを送る（idle で塞がないので noidle を挟まずにすぐ送れる）
+//  通知用: idle で変化を待ち、通知されたら状態とキューの差分を取り直す
+//  転送用: カバーアートやライブラリ全体の取得など、応答の大きいコマンド
+//------------------------------------------------------------------------------
+MPDClient::MPDClient()
+    : m_currentSongId(-1), m_currentSongRequest(-1), m_queueStart(0), m_queueEnd(0), m_terminated(false), m_rxReady(true), m_changed(0), m_statusChanged(0),
+      m_pendingSeq(0), m_statusSerial(0), m_statusConfirmed(0)
+{
+    std::string host = getServerAddress();
+    int port = getServerPort();
+    openChannel(m_command, host, port);
+    openChannel(m_notify, host, port);
+    m_bulkClient = new StreamClient(host.c_str(), port);
+    m_thread = new std::thread([this](){ update(); });
+    m_bulkThread = new std::thread([this](){ executeBulk(); });
+}
+
+//------------------------------------------------------------------------------
+MPDClient::~MPDClient()
+{
+    terminate();
+    delete m_command.client;
+    delete m_notify.client;
+    delete m_bulkClient;
+}
+
+//------------------------------------------------------------------------------
+//  操作用・通知用の接続は、どちらも受信したら update() のスレッドを起こす
+//------------------------------------------------------------------------------
+void MPDClient::openChannel(Channel& channel, const std::string& host, int port)
+{
+    Channel *c = &channel;
+    channel.client = new StreamClient(host.c_str(), port);
+    channel.client->setNotifier([this](){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_rxReady = true;
+        m_condition.notify_all();
+    });
+    channel.client->setConnectionHandler([this, c](bool connected){ onConnectionChanged(*c, connected); });
+}
+
+//------------------------------------------------------------------------------
+//  changed には前回の getStatus() から変化した項目（PlayerStatus::CHANGED_xxxx）を返す
+//  応答を待っている操作は、操作した時点で反映した状態を返す
+//------------------------------------------------------------------------------
+PlayerStatus MPDClient::getStatus(uint32_t *changed)
+{
+    m_mutex.lock();
+    retirePending();
+    PlayerStatus s = predictStatus();
+    if( changed != NULL )
+    {
+        *changed = m_statusChanged;
+        m_statusChanged = 0;
+    }
+    m_mutex.unlock();
+    return s;
+}
+
+//------------------------------------------------------------------------------
+//  キューの [start, end) を表示する。まだ情報の無い曲を playlistinfo で取得する
+//------------------------------------------------------------------------------
+void MPDClient::setQueueWindow(size_t start, size_t end)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queueStart = start;
+    m_queueEnd = end;
+    requestQueueWindow();
+}
+
+//------------------------------------------------------------------------------
+size_t MPDClient::getQueueLength()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return predictQueueLength();
+}
+
+//------------------------------------------------------------------------------
+//  キューの [start, end) の写しを返す（情報を取得中の曲は state が STATE_LOADED 以外）
+//  version にはキューのバージョンを返す
+//  追加を要求して確定していない曲は、id が -1 の STATE_REQUESTED になる
+//  （情報がキャッシュにあればその情報を、無ければ file だけを持つ）
+//------------------------------------------------------------------------------
+std::vector<QueueEntry> MPDClient::getQueue(size_t start, size_t end, uint32_t *version)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<QueueEntry> entries;
+    size_t length = predictQueueLength();
+    for( size_t n = start ; n < end && n < length ; n++ )
+    {
+        entries.push_back(predictEntry(n));
+    }
+    if( version != NULL )
+    {
+        *version = m_queue.getVersion();
+    }
+    return entries;
+}
+
+//------------------------------------------------------------------------------
+//  再生中の曲の情報を返す（まだ分からない場合は NULL）
+//  キューで情報を取得済みならそれを、無ければ currentsong で取得したものを返す
+//------------------------------------------------------------------------------
+std::shared_ptr<const SongInfo> MPDClient::getCurrentSong()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    PlayerStatus s = predictStatus();
+    if( s.song < 0 )
+    {
+        return NULL;
+    }
+    QueueEntry entry = predictEntry(s.song);
+    if( entry.song && (entry.id == s.songId || entry.id < 0) )
+    {
+        return entry.song;
+    }
+    return (s.songId >= 0 && s.songId == m_currentSongId) ? m_currentSong : NULL;
+}
+
+//------------------------------------------------------------------------------
+//  file の曲の情報を handler に渡す
+//  キャッシュにあればすぐに（この呼び出しの中で）、無ければ lsinfo で取得してから呼ぶ
+//------------------------------------------------------------------------------
+void MPDClient::lookupSong(const std::string& file, SongInfoHandler handler)
+{
+    m_mutex.lock();
+    std::shared_ptr<const SongInfo> song = m_songs.find(file);
+    if( song )
+    {
+        m_mutex.unlock();
+        handler(song);
+        return;
+    }
+    auto reader = std::make_shared<SongCache::Reader>();
+    queueCommand("lsinfo " + quoteArgument(file),
+                 [this, reader, handler](const CommandResult& result){
+                     m_mutex.lock();
+                     m_songs.endResponse(*reader);
+                     m_mutex.unlock();
+                     handler((result.ok && !reader->songs.empty()) ? reader->songs.back() : NULL);
+                 },
+                 [this, reader](std::string_view line){ m_songs.parse(line, *reader); });
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  コマンドの種類ごとの時間（マイクロ秒）の分布と、やりとりの量を書き出す
+//  queued: 送るまでの待ち時間、server: 送ってから最初の応答まで、total: 完了まで
+//------------------------------------------------------------------------------
+void MPDClient::dumpStatistics(std::ostream& out)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    out << std::left << std::setw(16) << "command" << std::right << std::setw(8) << "count" << std::setw(7) << "ACK"
+        << std::setw(10) << "queued50" << std::setw(10) << "queued99"
+        << std::setw(10) << "server50" << std::setw(10) << "server99" << std::setw(10) << "serverMax"
+        << std::setw(10) << "total50" << std::setw(10) << "total99" << std::setw(10) << "totalMax" << std::endl;
+    for( auto i = m_statistics.begin() ; i != m_statistics.end() ; i++ )
+    {
+        const CommandStatistics& s = i->second;
+        out << std::left << std::setw(16) << i->first << std::right << std::setw(8) << s.total.getCount() << std::setw(7) << s.failed
+            << std::setw(10) << s.queued.getPercentile(50) << std::setw(10) << s.queued.getPercentile(99)
+            << std::setw(10) << s.server.getPercentile(50) << std::setw(10) << s.server.getPercentile(99) << std::setw(10) << s.server.getMax()
+            << std::setw(10) << s.total.getPercentile(50) << std::setw(10) << s.total.getPercentile(99) << std::setw(10) << s.total.getMax()
+            << std::endl;
+    }
+    out << "sent " << m_counters.commandsSent << " commands (" << m_counters.commandLists << " lists, "
+        << m_counters.idles << " idle) in " << m_counters.writes << " writes, " << m_counters.bytesSent << " bytes" << std::endl;
+    out << "received " << m_counters.linesReceived << " lines, " << m_counters.bytesReceived << " bytes, "
+        << m_counters.connects << " connects" << std::endl;
+    out << "song cache " << m_songs.getSize() << " songs, " << m_songs.getNumStrings() << " strings, "
+        << m_songs.getHits() << " hits, " << m_songs.getMisses() << " misses" << std::endl;
+}
+
+//------------------------------------------------------------------------------
+void MPDClient::resetStatistics()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_statistics.clear();
+    m_counters = ProtocolCounters();
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::requestQueueWindow()
+{
+    size_t first, last;
+    if( !m_queue.requestMissing(m_queueStart, m_queueEnd, first, last) )
+    {
+        return;
+    }
+    auto reader = std::make_shared<PlayQueue::SongReader>();
+    queueCommand("playlistinfo " + std::to_string(first) + ":" + std::to_string(last + 1),
+                 [this, first, last](const CommandResult&){
+                     // 成功・失敗にかかわらず、受け取れなかった曲は要求中から戻す
+                     std::lock_guard<std::mutex> lock(m_mutex);
+                     m_queue.cancelRequests(first, last);
+                 },
+                 [this, reader](std::string_view line){ m_queue.parseSong(line, *reader, m_songs); });
+}
+
+//------------------------------------------------------------------------------
+//  再生中の曲の情報がキューにもキャッシュにも無ければ currentsong で取得する
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::requestCurrentSong()
+{
+    int pos = m_playerStatus.song;
+    int id = m_playerStatus.songId;
+    if( id < 0 || id == m_currentSongId || id == m_currentSongRequest )
+    {
+        return;
+    }
+    if( pos >= 0 && (size_t)pos < m_queue.getLength() )
+    {
+        const QueueEntry& entry = m_queue.getEntry(pos);
+        if( entry.id == id && entry.song )
+        {
+            m_currentSong = entry.song;
+            m_currentSongId = id;
+            return;
+        }
+    }
+
+    // 応答には Pos と Id も含まれるので、キューのその位置にも反映する
+    m_currentSongRequest = id;
+    auto reader = std::make_shared<PlayQueue::SongReader>();
+    queueCommand("currentsong",
+                 [this, reader, id](const CommandResult& result){
+                     std::lock_guard<std::mutex> lock(m_mutex);
+                     if( result.ok && reader->last && reader->lastId == id )
+                     {
+                         m_currentSong = reader->last;
+                         m_currentSongId = id;
+                     }
+                     if( m_currentSongRequest == id )
+                     {
+                         m_currentSongRequest = -1;
+                     }
+                 },
+                 [this, reader](std::string_view line){ m_queue.parseSong(line, *reader, m_songs); });
+}
+
+//------------------------------------------------------------------------------
+//  action を確定していない操作として加え、結果で確定・取り消しする CompletionHandler を返す
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+MPDClient::CompletionHandler MPDClient::addPending(PendingAction& action, CompletionHandler onDone)
+{
+    if( action.fields == 0 )
+    {
+        return onDone;      // 結果を予測できない操作
+    }
+    action.seq = ++m_pendingSeq;
+    m_pending.push_back(action);
+    m_statusChanged |= action.fields;
+
+    uint32_t seq = action.seq;
+    return [this, seq, onDone](const CommandResult& result){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            settlePending(seq, result.ok);
+        }
+        if( onDone )
+        {
+            onDone(result);
+        }
+    };
+}
+
+//------------------------------------------------------------------------------
+//  seq の操作のコマンドが完了した。失敗した場合は取り消し、成功した場合は
+//  この後に送る status の応答を待って確定する
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::settlePending(uint32_t seq, bool ok)
+{
+    auto i = std::find_if(m_pending.begin(), m_pending.end(), [seq](const PendingAction& a){ return a.seq == seq; });
+    if( i == m_pending.end() )
+    {
+        return;
+    }
+    if( !ok )
+    {
+        m_statusChanged |= i->fields;
+        m_pending.erase(i);
+        return;
+    }
+    i->done = true;
+    i->barrier = m_statusSerial;
+    i->doneTime = std::chrono::steady_clock::now();
+}
+
+//------------------------------------------------------------------------------
+//  MPD の状態に反映された操作を取り除く
+//  OK の後、MPD の状態が操作の後の状態と一致するか、OK の後に送った status の応答を
+//  受け取れば確定する（一致しなければ MPD の状態に合わせる）
+//  同じ項目を変える古い操作が残っている間は、新しい操作も取り除かない
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::retirePending()
+{
+    auto now = std::chrono::steady_clock::now();
+    uint32_t blocked = 0;
+    for( auto i = m_pending.begin() ; i != m_pending.end() ; )
+    {
+        bool confirmed = i->done && (m_statusConfirmed > i->barrier || m_playerStatus.matches(i->target, i->fields, now) ||
+                                     now - i->doneTime > std::chrono::milliseconds(PENDING_TIMEOUT_MS));
+        if( confirmed && (i->fields & blocked) == 0 )
+        {
+            m_statusChanged |= i->fields;
+            i = m_pending.erase(i);
+        }
+        else
+        {
+            blocked |= i->fields;
+            i++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  MPD から受け取った状態に、確定していない操作を古い順に重ねる
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+PlayerStatus MPDClient::predictStatus()
+{
+    PlayerStatus status = m_playerStatus.clone();
+    for( auto i = m_pending.begin() ; i != m_pending.end() ; i++ )
+    {
+        status.overlay(i->target, i->fields);
+    }
+    status.pending = (int)m_pending.size();
+    return status;
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+size_t MPDClient::predictQueueLength()
+{
+    size_t length = m_queue.getLength();
+    for( auto i = m_pending.begin() ; i != m_pending.end() ; i++ )
+    {
+        if( i->clearQueue )
+        {
+            length = i->uris.size();
+        }
+        else if( !i->uris.empty() )
+        {
+            length = std::max(length, i->queueBase + i->uris.size());
+        }
+    }
+    return length;
+}
+
+//------------------------------------------------------------------------------
+//  キューの pos の曲。追加が確定していない位置は要求した URI を返す
+//  （キューを置き換える操作でなければ、MPD に追加済みの曲はそちらを使う）
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+QueueEntry MPDClient::predictEntry(size_t pos)
+{
+    for( auto i = m_pending.rbegin() ; i != m_pending.rend() ; i++ )
+    {
+        if( pos >= i->queueBase && pos < i->queueBase + i->uris.size() )
+        {
+            if( !i->clearQueue && pos < m_queue.getLength() )
+            {
+                break;
+            }
+            QueueEntry entry;
+            entry.state = QueueEntry::STATE_REQUESTED;
+            const std::string& uri = i->uris[pos - i->queueBase];
+            entry.song = m_songs.find(uri);
+            if( !entry.song )
+            {
+                SongInfo song;
+                song.file = m_songs.intern(uri);
+                entry.song = std::make_shared<const SongInfo>(song);
+            }
+            return entry;
+        }
+    }
+    return (pos < m_queue.getLength()) ? m_queue.getEntry(pos) : QueueEntry();
+}
+
+//------------------------------------------------------------------------------
+//  キューの song の曲を先頭から再生する状態を action に設定する
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::predictSong(PendingAction& action, int song)
+{
+    QueueEntry entry = predictEntry(song);
+    action.target.song = song;
+    action.target.songId = entry.id;
+    action.target.nextSong = -1;       // random の場合は分からないので、次の status を待つ
+    action.target.nextSongId = -1;
+    action.target.elapsed = 0;
+    action.target.timestamp = std::chrono::steady_clock::now();
+    action.target.duration = entry.song ? entry.song->duration : 0;
+    action.fields |= PlayerStatus::CHANGED_SONG | PlayerStatus::CHANGED_NEXTSONG |
+                     PlayerStatus::CHANGED_ELAPSED | PlayerStatus::CHANGED_DURATION;
+}
+
+//------------------------------------------------------------------------------
+//  "changed: xxxx" の xxxx を SUBSYSTEM_xxxx に変換する
+//------------------------------------------------------------------------------
+static int parseSubsystem(std::string_view name)
+{
+    static const struct { const char *name; int flag; } table[] = {
+        { "player",   MPDClient::SUBSYSTEM_PLAYER },
+        { "mixer",    MPDClient::SUBSYSTEM_MIXER },
+        { "playlist", MPDClient::SUBSYSTEM_PLAYLIST },
+        { "options",  MPDClient::SUBSYSTEM_OPTIONS }
+    };
+    for( auto& t : table )
+    {
+        if( name == t.name )
+        {
+            return t.flag;
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//  受信した応答を１行ずつ処理する
+//  応答は接続ごとにコマンドを送った順に返るので、channel の応答待ちの先頭のコマンドに振り分ける
+//  完了したコマンドの CompletionHandler は completions に積み、ロックを外してから呼ぶ
+//------------------------------------------------------------------------------
+void MPDClient::processResponse(Channel& channel, std::string_view line, Completions& completions)
+{
+    if( !channel.ready )
+    {
+        if( line.compare(0, 6, "OK MPD") == 0 )
+        {
+            channel.ready = true;
+            channel.lastSent = std::chrono::steady_clock::now();
+            if( &channel == &m_notify )
+            {
+                // 切断されていた間の変化は通知されないので、すべて取り直す
+                m_queue.reset();
+                m_changed = SUBSYSTEM_ALL;
+            }
+        }
+        return;
+    }
+    if( channel.inflight.empty() )
+    {
+        return;
+    }
+
+    Batch& batch = channel.inflight.front();
+    if( batch.current == batch.commands.size() )
+    {
+        // コマンドリストの最後の list_OK の後の OK
+        channel.inflight.pop_front();
+        return;
+    }
+    Command& command = batch.commands[batch.current];
+    if( command.responded == std::chrono::steady_clock::time_point() )
+    {
+        command.responded = std::chrono::steady_clock::now();
+    }
+    if( line == "list_OK\n" )
+    {
+        // command_list_ok_begin の中のコマンドが１つ完了した
+        recordCompletion(command, true);
+        completions.push_back(std::make_pair(command.onDone, CommandResult()));
+        batch.current++;
+        return;
+    }
+    if( line == "OK\n" || line.compare(0, 4, "ACK ") == 0 )
+    {
+        if( line == "OK\n" )
+        {
+            for( ; batch.current < batch.commands.size() ; batch.current++ )
+            {
+                recordCompletion(batch.commands[batch.current], true);
+                completions.push_back(std::make_pair(batch.commands[batch.current].onDone, CommandResult()));
+            }
+        }
+        else
+        {
+            CommandResult result;
+            result.parseAck(line);
+            recordCompletion(command, false);
+            completions.push_back(std::make_pair(command.onDone, result));
+
+            // エラーになったコマンドより後ろは実行されていない。後から送ったコマンドリストは
+            // MPD がすでに実行しているので、送り直すと順序が入れ替わってしまう
+            // （キューへの追加なら曲順が変わる）。送り直さずに ACK の結果で完了させる
+            for( size_t n = batch.current + 1 ; n < batch.commands.size() ; n++ )
+            {
+                recordCompletion(batch.commands[n], false);
+                completions.push_back(std::make_pair(batch.commands[n].onDone, result));
+            }
+        }
+        channel.inflight.pop_front();
+        return;
+    }
+    if( command.onLine )
+    {
+        command.onLine(line);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  完了したコマンドの各段階の時間を、コマンドの種類ごとに記録する
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::recordCompletion(Command& command, bool ok)
+{
+    auto now = std::chrono::steady_clock::now();
+    if( command.responded == std::chrono::steady_clock::time_point() )
+    {
+        command.responded = now;
+    }
+    std::string_view text = command.text;
+    std::string_view name = text.substr(0, text.find(' '));
+    auto i = m_statistics.find(name);
+    if( i == m_statistics.end() )
+    {
+        i = m_statistics.emplace(std::string(name), CommandStatistics()).first;
+    }
+    auto us = [](std::chrono::steady_clock::duration d){
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    i->second.queued.record(us(command.sent - command.queued));
+    i->second.server.record(us(command.responded - command.sent));
+    i->second.total.record(us(now - command.queued));
+    if( !ok )
+    {
+        i->second.failed++;
+    }
+}
+
+//------------------------------------------------------------------------------
+//  切断された場合、応答待ちのコマンドは MPD が実行したかどうか分からないので失敗とする
+//  （送り直すと next などが２回実行されかねない）。未送信のコマンドは再接続後に送る
+//  通知用の接続は、再接続後に挨拶を待って、すべてのサブシステムの状態を取り直す
+//------------------------------------------------------------------------------
+void MPDClient::onConnectionChanged(Channel& channel, bool connected)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if( !connected )
+    {
+        CommandResult lost;
+        lost.ok = false;
+        lost.message = "connection lost";
+        for( auto i = channel.inflight.begin() ; i != channel.inflight.end() ; i++ )
+        {
+            for( size_t n = i->current ; n < i->commands.size() ; n++ )
+            {
+                m_lost.push_back(std::make_pair(i->commands[n].onDone, lost));
+            }
+        }
+        channel.inflight.clear();
+        channel.ready = false;
+    }
+    else
+    {
+        m_counters.connects++;
+    }
+    m_rxReady = true;
+    m_condition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+//  commands を１回分として out へ書き出し、channel の応答待ちに加える
+//------------------------------------------------------------------------------
+void MPDClient::sendBatch(Channel& channel, std::vector<Command>& commands, std::string& out)
+{
+    bool list = (commands.size() > 1);
+    if( list )
+    {
+        out += BEGIN_COMMAND_LIST;
+        out += '\n';
+        m_counters.commandLists++;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for( auto i = commands.begin() ; i != commands.end() ; i++ )
+    {
+        out += i->text;
+        out += '\n';
+        if( i->queued == std::chrono::steady_clock::time_point() )
+        {
+            i->queued = now;    // MPDClient が内部で送るコマンド
+        }
+        i->sent = now;
+    }
+    m_counters.commandsSent += commands.size();
+    if( list )
+    {
+        out += END_COMMAND_LIST;
+        out += '\n';
+    }
+
+    Batch batch;
+    batch.commands.swap(commands);
+    batch.current = 0;
+    channel.inflight.push_back(batch);
+    channel.lastSent = now;
+}
+
+//------------------------------------------------------------------------------
+//  応答待ちの PRIORITY_BACKGROUND のコマンドリストの数
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+int MPDClient::countBackground()
+{
+    int count = 0;
+    for( auto i = m_command.inflight.begin() ; i != m_command.inflight.end() ; i++ )
+    {
+        count += (i->commands.front().priority == PRIORITY_BACKGROUND);
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+//  未送信のコマンドを、優先度の高い順に応答を待たずに送る（パイプライン化）
+//  MAX_COMMAND_LIST 個・MAX_COMMAND_LIST_BYTES バイトまでずつ command_list_ok_begin で
+//  まとめて、コマンドごとの応答を list_OK で区切って受け取る
+//  MPD は接続ごとに受信した順に実行するので、PRIORITY_BACKGROUND のコマンドリストは
+//  MAX_BACKGROUND_INFLIGHT 個までしか応答待ちにしない（後から送る操作は、
+//  実行中のコマンドリストの切れ目で割り込める）
+//------------------------------------------------------------------------------
+void MPDClient::doSend(std::string& out)
+{
+    int background = countBackground();
+    for( int priority = 0 ; priority < NUM_PRIORITIES ; priority++ )
+    {
+        std::deque<Command>& queue = m_txBuffer[priority];
+        while( !queue.empty() )
+        {
+            if( priority == PRIORITY_BACKGROUND && background++ >= MAX_BACKGROUND_INFLIGHT )
+            {
+                break;
+            }
+            std::vector<Command> commands;
+            size_t bytes = 0;
+            while( !queue.empty() && (int)commands.size() < MAX_COMMAND_LIST )
+            {
+                bytes += queue.front().text.length() + 1;
+                if( !commands.empty() && bytes > MAX_COMMAND_LIST_BYTES )
                 {
-                    perror("write");
                     break;
                 }
-                if( sentBytes > 0 )
+                commands.push_back(queue.front());
+                queue.pop_front();
+            }
+            sendBatch(m_command, commands, out);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  doSend() で送れるコマンドがあれば true を返す
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+bool MPDClient::hasSendable()
+{
+    if( !m_txBuffer[PRIORITY_INTERACTIVE].empty() || !m_txBuffer[PRIORITY_NORMAL].empty() )
+    {
+        return true;
+    }
+    return !m_txBuffer[PRIORITY_BACKGROUND].empty() && countBackground() < MAX_BACKGROUND_INFLIGHT;
+}
+
+//------------------------------------------------------------------------------
+//  通知用の接続で、取り直す状態があれば status などを、無ければ idle を送る
+//  （取り直しの応答を受け取ってから次の idle を送るので、noidle は使わない）
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::refreshStatus(std::string& out)
+{
+    std::vector<Command> commands(1);
+    if( m_changed != 0 )
+    {
+        // 監視しているサブシステムの状態は、いずれも status で取り直せる
+        int changed = m_changed;
+        m_changed = 0;
+        commands[0].text = "status";
+        commands[0].onLine = [this](std::string_view line){ m_playerStatus.parseStatusResponse(line); };
+        commands[0].onDone = [this](const CommandResult& result){
+            if( result.ok )
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_statusChanged |= m_playerStatus.endResponse();
+            }
+        };
+        m_playerStatus.beginResponse();
+        if( (changed & SUBSYSTEM_PLAYLIST) != 0 )
+        {
+            // キューの差分も同じコマンドリストで取得する（status の playlist と食い違わない）
+            std::string version = std::to_string(m_queue.getVersion());
+            commands.resize(2);
+            commands[1].text = "plchangesposid " + version;
+            commands[1].onLine = [this](std::string_view line){ m_queue.parseChange(line); };
+            commands[1].onDone = [this](const CommandResult& result){
+                if( result.ok )
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_queue.commit(m_playerStatus.playlistVersion, m_playerStatus.playlistLength);
+                    requestQueueWindow();
+                }
+            };
+            if( m_queueStart < m_queueEnd )
+            {
+                // 表示範囲の曲は情報もまとめて取得する
+                auto reader = std::make_shared<PlayQueue::SongReader>();
+                commands.resize(3);
+                commands[2].text = "plchanges " + version + " " + std::to_string(m_queueStart) + ":" + std::to_string(m_queueEnd);
+                commands[2].onLine = [this, reader](std::string_view line){ m_queue.parseSong(line, *reader, m_songs); };
+            }
+        }
+
+        // 最後の応答を受け取った時点で、それまでに完了した操作は反映されている
+        uint64_t serial = ++m_statusSerial;
+        CompletionHandler last = commands.back().onDone;
+        commands.back().onDone = [this, serial, last](const CommandResult& result){
+            if( last )
+            {
+                last(result);
+            }
+            if( result.ok )
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_statusConfirmed = serial;
+                retirePending();
+                requestCurrentSong();
+            }
+        };
+    }
+    else
+    {
+        commands[0].text = IDLE_COMMAND;
+        commands[0].onLine = [this](std::string_view str){
+            ResponseLine line(str);
+            if( line.isKey("changed") )
+            {
+                m_changed |= parseSubsystem(line.getValue());
+            }
+        };
+        m_counters.idles++;
+    }
+    sendBatch(m_notify, commands, out);
+}
+
+//------------------------------------------------------------------------------
+//  out を channel へ送る
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::flush(Channel& channel, std::string& out)
+{
+    if( out.empty() )
+    {
+        return;
+    }
+    m_counters.bytesSent += out.length();
+    m_counters.writes++;
+    channel.client->sendRawBytes(out.data(), out.length());
+    out.clear();
+    m_condition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+//  操作用と通知用の接続の応答を、このスレッドでまとめて処理する
+//  操作用の接続には未送信のコマンドを溜めずにすぐ送り、通知用の接続は常に idle で待たせておく
+//  （通知もコマンドの追加も無ければ、このスレッドも通信も止まったままになる）
+//------------------------------------------------------------------------------
+void MPDClient::update()
+{
+    std::string_view line;
+    std::string commandOut, notifyOut;
+    Completions completions;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while( !m_terminated )
+    {
+        m_rxReady = false;
+        completions.insert(completions.end(), m_lost.begin(), m_lost.end());
+        m_lost.clear();
+        for( Channel *channel : { &m_notify, &m_command } )
+        {
+            while( channel->client->receive(line) )
+            {
+                m_counters.bytesReceived += line.size();
+                m_counters.linesReceived++;
+                processResponse(*channel, line, completions);
+            }
+        }
+
+        if( m_command.ready )
+        {
+            releaseCoalesced();
+            doSend(commandOut);
+        }
+        if( m_notify.ready && m_notify.inflight.empty() )
+        {
+            refreshStatus(notifyOut);
+        }
+        flush(m_command, commandOut);
+        flush(m_notify, notifyOut);
+
+        if( !completions.empty() )
+        {
+            lock.unlock();
+            for( auto i = completions.begin() ; i != completions.end() ; i++ )
+            {
+                if( i->first )
                 {
-                    auto s = m_txBuffer.begin();
-                    auto e = m_txBuffer.begin();
-                    std::advance(e, sentBytes);
-                    m_txBuffer.erase(s, e);
+                    i->first(i->second);
                 }
             }
-            break;
+            completions.clear();
+            lock.lock();
+            continue;
+        }
+
+        auto ready = [this](){
+            if( m_command.ready )
+            {
+                releaseCoalesced();
+            }
+            return m_terminated || m_rxReady || (m_command.ready && hasSendable());
+        };
+        if( !m_command.ready )
+        {
+            m_condition.wait(lock, ready);
+        }
+        else if( !m_condition.wait_until(lock, m_command.lastSent + std::chrono::milliseconds(KEEPALIVE_INTERVAL_MS), ready) )
+        {
+            // 操作の無い間に MPD から切断されないよう、操作用の接続にも時々コマンドを送る
+            queueCommand("ping", NULL, NULL, COALESCE_NONE, PRIORITY_BACKGROUND);
+        }
+    }
+
+    // 終了までに完了しなかったコマンドは失敗として通知する
+    CommandResult aborted;
+    aborted.ok = false;
+    aborted.message = "terminated";
+    for( Channel *channel : { &m_command, &m_notify } )
+    {
+        for( auto i = channel->inflight.begin() ; i != channel->inflight.end() ; i++ )
+        {
+            for( size_t n = i->current ; n < i->commands.size() ; n++ )
+            {
+                completions.push_back(std::make_pair(i->commands[n].onDone, aborted));
+            }
+        }
+        channel->inflight.clear();
+    }
+    for( int priority = 0 ; priority < NUM_PRIORITIES ; priority++ )
+    {
+        for( auto i = m_txBuffer[priority].begin() ; i != m_txBuffer[priority].end() ; i++ )
+        {
+            completions.push_back(std::make_pair(i->onDone, aborted));
+        }
+        m_txBuffer[priority].clear();
+    }
+    for( auto i = m_coalesced.begin() ; i != m_coalesced.end() ; i++ )
+    {
+        completions.push_back(std::make_pair(i->second.onDone, aborted));
+    }
+    completions.insert(completions.end(), m_lost.begin(), m_lost.end());
+    m_lost.clear();
+    m_coalesced.clear();
+    lock.unlock();
+    for( auto i = completions.begin() ; i != completions.end() ; i++ )
+    {
+        if( i->first )
+        {
+            i->first(i->second);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+//  coalesce を指定したコマンドは、同じ種類の未送信のコマンドがあれば置き換える
+//  （置き換えられたコマンドの onDone は、置き換えたコマンドの結果で呼ぶ）
+//------------------------------------------------------------------------------
+void MPDClient::queueCommand(const std::string& text, CompletionHandler onDone, ResponseHandler onLine, int coalesce, int priority)
+{
+    Command command;
+    command.text = text;
+    command.onLine = onLine;
+    command.onDone = onDone;
+    command.coalesce = coalesce;
+    command.priority = priority;
+    command.queued = std::chrono::steady_clock::now();
+    if( coalesce == COALESCE_NONE )
+    {
+        m_txBuffer[priority].push_back(command);
+    }
+    else
+    {
+        auto i = m_coalesced.find(coalesce);
+        if( i != m_coalesced.end() && i->second.onDone )
+        {
+            // 置き換えが続いても、連なった handler を毎回コピーしないよう共有する
+            auto replaced = std::make_shared<CompletionHandler>(std::move(i->second.onDone));
+            command.onDone = [replaced, onDone](const CommandResult& result){
+                (*replaced)(result);
+                if( onDone )
+                {
+                    onDone(result);
+                }
+            };
+        }
+        m_coalesced[coalesce] = command;
+    }
+    m_condition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+//  キューを編集するコマンドを PRIORITY_BACKGROUND で送る
+//  appended は追加する曲数（置き換える場合や、曲数が分からない場合は -1）
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::queueEdit(const std::string& text, CompletionHandler onDone, int appended)
+{
+    Command command;
+    command.text = text;
+    command.onDone = onDone;
+    command.priority = PRIORITY_BACKGROUND;
+    command.appended = appended;
+    command.queued = std::chrono::steady_clock::now();
+    m_txBuffer[PRIORITY_BACKGROUND].push_back(command);
+    m_condition.notify_all();
+}
+
+//------------------------------------------------------------------------------
+//  キューの pos の曲が、未送信のキューの編集で決まる場合は true を返す
+//  （キューを置き換える編集があるか、pos が未送信の追加の曲の位置にあたる場合）
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+bool MPDClient::dependsOnEdits(int pos)
+{
+    size_t appended = 0;
+    const std::deque<Command>& queue = m_txBuffer[PRIORITY_BACKGROUND];
+    for( auto i = queue.begin() ; i != queue.end() ; i++ )
+    {
+        if( i->appended < 0 )
+        {
+            return true;
+        }
+        appended += i->appended;
+    }
+    return appended > 0 && pos >= 0 && (size_t)pos + appended >= predictQueueLength();
+}
+
+//------------------------------------------------------------------------------
+//  COALESCE_xxxx のコマンドは種類ごとに１つずつしか応答待ちにしない
+//  応答待ちの間に操作された分は m_coalesced で最新のものにまとめておき、
+//  応答が返ってから送る（１往復に１回まで間引かれる）
+//  m_mutex をロックした状態で呼ぶこと
+//------------------------------------------------------------------------------
+void MPDClient::releaseCoalesced()
+{
+    if( m_coalesced.empty() )
+    {
+        return;
+    }
+    int inflight = COALESCE_NONE;
+    for( auto i = m_command.inflight.begin() ; i != m_command.inflight.end() ; i++ )
+    {
+        for( size_t n = i->current ; n < i->commands.size() ; n++ )
+        {
+            inflight |= i->commands[n].coalesce;
+        }
+    }
+    for( auto i = m_coalesced.begin() ; i != m_coalesced.end() ; )
+    {
+        if( (inflight & i->first) == 0 )
+        {
+            m_txBuffer[i->second.priority].push_back(i->second);
+            i = m_coalesced.erase(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  任意のコマンドを送る
+//  応答の各行は onLine へ、結果（OK/ACK）は onDone へ渡される
+//  続けて呼んだコマンドはまとめて送られ、１往復で実行される
+//  優先度の異なるコマンドの間では、実行される順序は保証されない
+//------------------------------------------------------------------------------
+void MPDClient::sendCommand(const std::string& command, CompletionHandler onDone, ResponseHandler onLine, int coalesce, int priority)
+{
+    m_mutex.lock();
+    queueCommand(command, onDone, onLine, coalesce, priority);
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  priority の未送信のコマンドを取り消す（送信済みのコマンドリストは取り消せない）
+//  PRIORITY_BACKGROUND では、キューの編集の後ろに並べた play も取り消す
+//  取り消したコマンドの onDone は失敗として呼ぶ。取り消した数を返す
+//------------------------------------------------------------------------------
+size_t MPDClient::cancelCommands(int priority)
+{
+    std::deque<Command> cancelled;
+    m_mutex.lock();
+    cancelled.swap(m_txBuffer[priority]);
+    m_mutex.unlock();
+
+    CommandResult result;
+    result.ok = false;
+    result.message = "cancelled";
+    for( auto i = cancelled.begin() ; i != cancelled.end() ; i++ )
+    {
+        if( i->onDone )
+        {
+            i->onDone(result);
+        }
+    }
+    return cancelled.size();
+}
+
+//------------------------------------------------------------------------------
+//  listallinfo のように応答の大きいコマンドを転送用レーンで送る
+//  操作用の接続とは別なので、転送中も play などは待たされない
+//  onLine は MPDClient をロックして、onDone は転送用レーンのスレッドで呼ばれる
+//------------------------------------------------------------------------------
+void MPDClient::sendBulkCommand(const std::string& command, CompletionHandler onDone, ResponseHandler onLine)
+{
+    Command c;
+    c.text = command;
+    c.onLine = onLine;
+    c.onDone = onDone;
+    c.queued = std::chrono::steady_clock::now();
+    m_bulkMutex.lock();
+    m_bulkCommands.push_back(c);
+    m_bulkCondition.notify_one();
+    m_bulkMutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  count 個のコマンドがすべて完了したら onDone を１回だけ呼ぶハンドラを作る
+//  （結果は最初に失敗したコマンドのもの。すべて成功なら OK）
+//------------------------------------------------------------------------------
+static MPDClient::CompletionHandler joinCompletions(int count, MPDClient::CompletionHandler onDone)
+{
+    if( !onDone )
+    {
+        return NULL;
+    }
+    auto remaining = std::make_shared<int>(count);
+    auto first = std::make_shared<CommandResult>();
+    return [remaining, first, onDone](const CommandResult& result){
+        if( !result.ok && first->ok )
+        {
+            *first = result;
+        }
+        if( --(*remaining) == 0 )
+        {
+            onDone(*first);
+        }
+    };
+}
+
+//------------------------------------------------------------------------------
+//  キューを uris（Song::getURI() など）で置き換える
+//  曲の追加は PRIORITY_BACKGROUND で送る。続けて play() で追加した曲を指定しても、追加の後に実行される
+//------------------------------------------------------------------------------
+void MPDClient::addPlaylist(const std::vector<std::string>& uris, CompletionHandler onDone)
+{
+    m_mutex.lock();
+    PendingAction action;
+    action.clearQueue = true;
+    action.uris = uris;
+    action.target.state = PlayerStatus::PLAYERSTATE_STOP;
+    action.target.playlistLength = (int)uris.size();
+    action.fields = PlayerStatus::CHANGED_STATE | PlayerStatus::CHANGED_ELAPSED | PlayerStatus::CHANGED_PLAYLIST;
+    CompletionHandler handler = joinCompletions((int)uris.size() + 2, addPending(action, onDone));
+    queueEdit("stop", handler, -1);
+    queueEdit("clear", handler, -1);
+    for( auto i = uris.begin() ; i != uris.end() ; i++ )
+    {
+        queueEdit("add " + quoteArgument(*i), handler, 1);
+    }
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  キューの末尾に uris を追加する
+//  多数の曲でも、doSend() で大きさを制限したコマンドリストに分けて続けて送る
+//  （PRIORITY_BACKGROUND なので、再生の操作や状態の取得は待たされない。cancelCommands() で中断できる）
+//------------------------------------------------------------------------------
+void MPDClient::enqueue(const std::vector<std::string>& uris, CompletionHandler onDone)
+{
+    m_mutex.lock();
+    PendingAction action;
+    action.queueBase = predictQueueLength();
+    action.uris = uris;
+    action.target.playlistLength = (int)(action.queueBase + uris.size());
+    action.fields = PlayerStatus::CHANGED_PLAYLIST;
+    CompletionHandler handler = joinCompletions((int)uris.size(), addPending(action, onDone));
+    for( auto i = uris.begin() ; i != uris.end() ; i++ )
+    {
+        queueEdit("add " + quoteArgument(*i), handler, 1);
     }
+    m_mutex.unlock();
+}
 
+//------------------------------------------------------------------------------
+//  ディレクトリ以下の曲をすべてキューの末尾に追加する（曲の列挙は MPD が行う）
+//  追加される曲が分からないので、確定するまで getStatus() には反映しない
+//------------------------------------------------------------------------------
+void MPDClient::addDirectory(const std::string& uri, CompletionHandler onDone)
+{
+    m_mutex.lock();
+    queueDirectory(uri, std::vector<std::string>(), onDone);
     m_mutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-std::string TCPClient::receive()
+//  ライブラリの曲の一覧から追加される曲が分かるので、enqueue() と同じく応答を待たずに反映する
+//------------------------------------------------------------------------------
+void MPDClient::addAlbum(Album *album, CompletionHandler onDone)
 {
-    std::string r;
-    m_mutex.lock();
-    if( !m_rxBuffer.empty() )
+    std::vector<std::string> uris;
+    for( int n = 0 ; n < album->getNumTracks() ; n++ )
     {
-        r = m_rxBuffer.front();
-        m_rxBuffer.pop_front();
+        uris.push_back(album->getSong(n)->getURI());
     }
+    m_mutex.lock();
+    queueDirectory(album->getPath(), uris, onDone);
     m_mutex.unlock();
-    return r;
 }
 
 //------------------------------------------------------------------------------
-void TCPClient::internalReceive()
+void MPDClient::addArtist(Artist *artist, CompletionHandler onDone)
 {
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 10000;
-
-    fd_set mask;
-    FD_ZERO(&mask);
-    FD_SET(m_sockfd, &mask);
-
-    int w = m_sockfd + 1;
-
-    switch( ::select(w, &mask, NULL, NULL, &tv) )
+    std::vector<std::string> uris;
+    for( int m = 0 ; m < artist->getNumAlbums() ; m++ )
     {
-        case -1:
-            if( errno != EINTR )
-            {
-                perror("select(recv)");
-            }
-            break;
-        case 0:
-            // timeout
-            break;
-        default:
-            if( FD_ISSET(m_sockfd, &mask) )
-            {
-                std::vector<uint8_t> rbuf(BUFFER_SIZE);
-                int tn = ::read(m_sockfd, &rbuf[0], BUFFER_SIZE);
-                if( tn > 0 )
-                {
-                    std::string lines(((char *)&rbuf[0]));
-                    m_mutex.lock();
-                    addRxLines(lines);
-                    m_mutex.unlock();
-                }
-            }
-            break;
+        Album *album = artist->getAlbum(m);
+        for( int n = 0 ; n < album->getNumTracks() ; n++ )
+        {
+            uris.push_back(album->getSong(n)->getURI());
+        }
     }
+    m_mutex.lock();
+    queueDirectory(artist->getPath(), uris, onDone);
+    m_mutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-//  １行単位で m_rxBuffer へ文字列を追加
-//  （各文字列にはデリミタ\nが付く）
+//  "add <ディレクトリ>" をキューの編集として送る
+//  uris は追加されるはずの曲（分からなければ空）で、確定するまでの予測に使う
+//  m_mutex をロックした状態で呼ぶこと
 //------------------------------------------------------------------------------
-void TCPClient::addRxLines(std::string buffer)
+void MPDClient::queueDirectory(const std::string& uri, const std::vector<std::string>& uris, CompletionHandler onDone)
 {
-    auto offset = std::string::size_type(0);
-    auto list = std::vector<std::string>();
-    while( true ) 
-    {
-        auto pos = buffer.find(DELIMITOR, offset);
-        if( pos == std::string::npos )
-        {
-            list.push_back(buffer.substr(offset));
-            break;
-        }
-        list.push_back(buffer.substr(offset, pos - offset + 1));
-        offset = pos + 1;
-    }
-    for( auto i = list.begin() ; i != list.end() ; i++ )
+    PendingAction action;
+    if( !uris.empty() )
     {
-        // m_rxBuffer の後端の文字列にデリミタが含まれているか確認する。
-        // 含まれていない場合は前回の受信時に受信データが「泣き別れ」になっているので、
-        // push_back ではなく、後端の要素に追加する必要がある。
-        if( m_rxBuffer.empty() || m_rxBuffer.back().find(DELIMITOR) != std::string::npos )
-        {
-            m_rxBuffer.push_back(*i);
-        }
-        else
-        {
-            m_rxBuffer.back() += *i;
-        }
+        action.queueBase = predictQueueLength();
+        action.uris = uris;
+        action.target.playlistLength = (int)(action.queueBase + uris.size());
+        action.fields = PlayerStatus::CHANGED_PLAYLIST;
     }
+    queueEdit("add " + quoteArgument(uri), addPending(action, onDone), uris.empty() ? -1 : (int)uris.size());
 }
 
+//------------------------------------------------------------------------------
+//  再生の操作は、応答を待たずに getStatus() へ反映する（ACK の場合は元に戻る）
+//  song の曲がまだ送っていないキューの編集で決まる場合は、編集の後に並べて追い越さない
+//------------------------------------------------------------------------------
+void MPDClient::play(int song, CompletionHandler onDone)
+{
+    m_mutex.lock();
+    PendingAction action;
+    action.target.state = PlayerStatus::PLAYERSTATE_PLAY;
+    action.fields = PlayerStatus::CHANGED_STATE;
+    predictSong(action, song);
+    std::stringstream ss;
+    ss << "play " << song;  // song は 0 が先頭の曲になる
+    int priority = dependsOnEdits(song) ? PRIORITY_BACKGROUND : PRIORITY_INTERACTIVE;
+    queueCommand(ss.str(), addPending(action, onDone), NULL, COALESCE_NONE, priority);
+    m_mutex.unlock();
+}
 
-
-//==============================================================================
-//   PlayerStatus
-//==============================================================================
-void PlayerStatus::parseStatusResponse(const std::string& str)
+//------------------------------------------------------------------------------
+//  続けて押された場合も、確定していない操作の後の状態で切り替える
+//------------------------------------------------------------------------------
+void MPDClient::togglePause(CompletionHandler onDone)
 {
-    if( str.find("song:") == 0 )
+    m_mutex.lock();
+    PlayerStatus status = predictStatus();
+    auto now = std::chrono::steady_clock::now();
+    PendingAction action;
+    action.target.elapsed = status.getElapsed(now);
+    action.target.timestamp = now;
+    action.fields = PlayerStatus::CHANGED_STATE | PlayerStatus::CHANGED_ELAPSED;
+    if( status.state == PlayerStatus::PLAYERSTATE_PAUSE )
+    {
+        action.target.state = PlayerStatus::PLAYERSTATE_PLAY;
+        queueCommand("play", addPending(action, onDone), NULL, COALESCE_NONE, PRIORITY_INTERACTIVE);
+    }
+    else if( status.state == PlayerStatus::PLAYERSTATE_PLAY )
     {
-        this->song = std::stoi(str.c_str()+6);
+        action.target.state = PlayerStatus::PLAYERSTATE_PAUSE;
+        queueCommand("pause", addPending(action, onDone), NULL, COALESCE_NONE, PRIORITY_INTERACTIVE);
     }
-    if( str.find("state:") == 0 )
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  次の曲は status の nextsong で分かる。続けて押された場合は、random でなければ
+//  キューの順に進める（最後の曲の次は、repeat でなければ停止する）
+//------------------------------------------------------------------------------
+void MPDClient::next(CompletionHandler onDone)
+{
+    m_mutex.lock();
+    PlayerStatus status = predictStatus();
+    PendingAction action;
+    if( status.state != PlayerStatus::PLAYERSTATE_STOP )
     {
-        if( str.find("stop") != std::string::npos )
+        int song = status.nextSong;
+        if( song < 0 && !status.random && status.song >= 0 )
         {
-            this->state = PLAYERSTATE_STOP;
-            this->elapsed = 0;
+            song = (status.song + 1 < status.playlistLength) ? status.song + 1 : (status.repeat ? 0 : -1);
         }
-        else if( str.find("pause") != std::string::npos )
+        if( song >= 0 )
         {
-            this->state = PLAYERSTATE_PAUSE;
+            predictSong(action, song);
         }
-        else if( str.find("play") != std::string::npos )
+        else if( !status.random )
         {
-            this->state = PLAYERSTATE_PLAY;
+            action.target.state = PlayerStatus::PLAYERSTATE_STOP;
+            action.target.timestamp = std::chrono::steady_clock::now();
+            action.fields = PlayerStatus::CHANGED_STATE | PlayerStatus::CHANGED_ELAPSED;
         }
     }
-    if( str.find("elapsed:") == 0 )
+    queueCommand("next", addPending(action, onDone), NULL, COALESCE_NONE, PRIORITY_INTERACTIVE);
+    m_mutex.unlock();
+}
+
+//------------------------------------------------------------------------------
+//  先頭の曲の前は、repeat なら最後の曲、そうでなければ先頭の曲を最初から再生する
+//------------------------------------------------------------------------------
+void MPDClient::previous(CompletionHandler onDone)
+{
+    m_mutex.lock();
+    PlayerStatus status = predictStatus();
+    PendingAction action;
+    if( status.state != PlayerStatus::PLAYERSTATE_STOP && !status.random && status.song >= 0 )
     {
-        this->elapsed = (int)std::atof(str.c_str()+9);
+        predictSong(action, (status.song > 0) ? status.song - 1 :
+                            (status.repeat && status.playlistLength > 0) ? status.playlistLength - 1 : status.song);
     }
+    queueCommand("previous", addPending(action, onDone), NULL, COALESCE_NONE, PRIORITY_INTERACTIVE);
+    m_mutex.unlock();
 }
 
-//==============================================================================
-//  MPDClient
-//==============================================================================
-const char *MPDClient::SERVER_ADDR = "raspberrypi.local";   //127.0.0.1";
-const int   MPDClient::SERVER_PORT = 6600;
-const char *MPDClient::BEGIN_COMMAND_LIST = "command_list_begin";
-const char *MPDClient::END_COMMAND_LIST = "command_list_end";
-
 //------------------------------------------------------------------------------
-MPDClient::MPDClient() : m_state(STATE_WAIT_CONNECTION), m_terminated(false)
+void MPDClient::stop(CompletionHandler onDone)
 {
-    m_tcpClient = new TCPClient(SERVER_ADDR, SERVER_PORT);
-    m_thread = new std::thread([this](){ update(); });
+    m_mutex.lock();
+    PendingAction action;
+    action.target.state = PlayerStatus::PLAYERSTATE_STOP;
+    action.target.timestamp = std::chrono::steady_clock::now();
+    action.fields = PlayerStatus::CHANGED_STATE | PlayerStatus::CHANGED_ELAPSED;
+    queueCommand("stop", addPending(action, onDone), NULL, COALESCE_NONE, PRIORITY_INTERACTIVE);
+    m_mutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-MPDClient::~MPDClient()
+void MPDClient::setVolume(long value, CompletionHandler onDone)
 {
-    terminate();
-    delete m_tcpClient;
+    m_mutex.lock();
+    PendingAction action;
+    action.target.volume = value;
+    action.fields = PlayerStatus::CHANGED_VOLUME;
+    std::stringstream ss;
+    ss << "volume " << value;
+    queueCommand(ss.str(), addPending(action, onDone), NULL, COALESCE_VOLUME, PRIORITY_INTERACTIVE);
+    m_mutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-PlayerStatus MPDClient::getStatus()
+//  再生中の曲の seconds 秒の位置へ移動する
+//------------------------------------------------------------------------------
+void MPDClient::seek(double seconds, CompletionHandler onDone)
 {
     m_mutex.lock();
-    PlayerStatus s = m_playerStatus.clone();
+    PendingAction action;
+    action.target.elapsed = seconds;
+    action.target.timestamp = std::chrono::steady_clock::now();
+    action.fields = PlayerStatus::CHANGED_ELAPSED;
+    std::stringstream ss;
+    ss << "seekcur " << std::fixed << std::setprecision(3) << seconds;
+    queueCommand(ss.str(), addPending(action, onDone), NULL, COALESCE_SEEK, PRIORITY_INTERACTIVE);
     m_mutex.unlock();
-    return s;
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::update()
+void MPDClient::terminate()
 {
-    int idleState = 0;
-
-    while( !m_terminated )
+    // 最後の stop が完了する（または時間切れになる）まで待つ
+    auto stopped = std::make_shared<bool>(false);
+    stop([this, stopped](const CommandResult&){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        *stopped = true;
+        m_condition.notify_all();
+    });
     {
-        m_mutex.lock();
-
-        switch( m_state )
-        {
-            case STATE_WAIT_CONNECTION:
-                doReceive();
-                if( m_rxBuffer.front().find("OK") != std::string::npos )
-                {
-                    m_state = STATE_READY;
-                }
-                break;
-            case STATE_READY:
-                if( !m_txBuffer.empty() )
-                {
-                    doSend();
-                }
-                else
-                {
-                    if( idleState == 0 )
-                    {
-                        m_tcpClient->sendRawBytes("status\n", 7);
-                    }
-                    else
-                    {
-                        m_tcpClient->sendRawBytes("currentsong\n", 12);
-                    }
-                    idleState = 1 - idleState;
-                }
-                m_state = STATE_WAIT_RESPONSE;
-                break;
-            case STATE_WAIT_RESPONSE:
-                doReceive();
-                while( !m_rxBuffer.empty() )
-                {
-                    std::string str = m_rxBuffer.front();
-                    m_rxBuffer.pop_front();
-                    m_playerStatus.parseStatusResponse(str);
-                    if( str.find("OK") == 0 )
-                    {
-                        m_state = STATE_READY;
-                    }
-                }
-                break;
-        }
-
-        m_mutex.unlock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_condition.wait_for(lock, std::chrono::milliseconds(TERMINATE_TIMEOUT_MS),
+            [stopped](){ return *stopped; });
+        m_terminated = true;
+        m_condition.notify_all();
     }
+    m_thread->join();
+
+    m_bulkMutex.lock();
+    m_bulkCondition.notify_all();
+    m_bulkMutex.unlock();
+    m_bulkThread->join();
+    delete m_bulkThread;
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::doReceive()
+//  カバーアートの取得を要求する
+//  uri にはアルバム内の曲の URI を指定する。取得は転送用レーンで行われ、
+//  完了すると（そのスレッド上で）handler が呼ばれる
+//  先読みでない要求は、待ち行列中の先読みの要求より先に処理する
+//------------------------------------------------------------------------------
+void MPDClient::fetchCoverArt(const std::string& uri, CoverArtHandler handler, bool prefetch)
 {
-    std::string str = m_tcpClient->receive();
-    while( str.length() > 0 )
+    CoverArtRequest request;
+    request.uri = uri;
+    request.handler = handler;
+    request.prefetch = prefetch;
+    m_bulkMutex.lock();
+    auto i = m_coverRequests.end();
+    if( !prefetch )
     {
-        m_rxBuffer.push_back(str);
-        str = m_tcpClient->receive();
+        i = std::find_if(m_coverRequests.begin(), m_coverRequests.end(),
+            [](const CoverArtRequest& r){ return r.prefetch; });
     }
+    m_coverRequests.insert(i, request);
+    m_bulkCondition.notify_one();
+    m_bulkMutex.unlock();
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::doSend()
+//  まだ転送を開始していないカバーアートの要求を取り消す
+//  （取り消した要求の handler は呼ばれない。取り消した要求があれば true を返す）
+//------------------------------------------------------------------------------
+bool MPDClient::cancelCoverArt(const std::string& uri)
 {
-    if( m_txBuffer.empty() )
-    {
-        return;
-    }
+    m_bulkMutex.lock();
+    auto i = std::remove_if(m_coverRequests.begin(), m_coverRequests.end(),
+        [&uri](const CoverArtRequest& r){ return r.uri == uri; });
+    bool removed = (i != m_coverRequests.end());
+    m_coverRequests.erase(i, m_coverRequests.end());
+    m_bulkMutex.unlock();
+    return removed;
+}
 
-    std::string cmd;
-    if( m_txBuffer.front().find(BEGIN_COMMAND_LIST) != std::string::npos )
+//------------------------------------------------------------------------------
+//  転送用レーンの処理（バックグラウンドスレッドで実行）
+//------------------------------------------------------------------------------
+void MPDClient::executeBulk()
+{
+    unsigned generation = 0;    // 挨拶と binarylimit の設定を済ませた接続
+    while( true )
     {
-        do
+        CoverArtRequest request;
+        Command command;
+        bool cover;
+        {
+            std::unique_lock<std::mutex> lock(m_bulkMutex);
+            m_bulkCondition.wait(lock, [this](){ return m_terminated || !m_coverRequests.empty() || !m_bulkCommands.empty(); });
+            if( m_terminated )
+            {
+                break;
+            }
+            // 表示中のカバーアート、コマンド、先読みのカバーアートの順に処理する
+            cover = !m_coverRequests.empty() && (!m_coverRequests.front().prefetch || m_bulkCommands.empty());
+            if( cover )
+            {
+                request = m_coverRequests.front();
+                m_coverRequests.pop_front();
+            }
+            else
+            {
+                command = m_bulkCommands.front();
+                m_bulkCommands.pop_front();
+            }
+        }
+
+        if( !cover )
+        {
+            CommandResult result;
+            if( !prepareBulkLane(generation) || !runBulkCommand(command, result) )
+            {
+                result.ok = false;
+                result.message = m_terminated ? "terminated" : "timeout";
+            }
+            if( command.onDone )
+            {
+                command.onDone(result);
+            }
+            continue;
+        }
+
+        // 埋め込み画像(readpicture)を優先し、無ければディレクトリ内の画像ファイル(albumart)を探す
+        // （readpicture がタイムアウトして接続し直した場合は、挨拶と binarylimit をやり直してから送る）
+        std::vector<uint8_t> data;
+        if( prepareBulkLane(generation) && !readCoverArt("readpicture", request.uri, data) && prepareBulkLane(generation) )
+        {
+            readCoverArt("albumart", request.uri, data);
+        }
+
+        try
         {
-            cmd = m_txBuffer.front();
-            m_tcpClient->sendRawBytes((cmd+"\n").c_str(), cmd.length()+1);
-            m_txBuffer.pop_front();
+            request.handler(data);
+        }
+        catch( std::exception& e )
+        {
+            std::cerr << "Cover art of " << request.uri << ": " << e.what() << std::endl;
         }
-        while( !m_txBuffer.empty() && (cmd.find(END_COMMAND_LIST) == std::string::npos) );
-        m_state = STATE_WAIT_RESPONSE;
     }
-    else
+
+    // 実行しなかったコマンドは失敗として通知する
+    CommandResult aborted;
+    aborted.ok = false;
+    aborted.message = "terminated";
+    std::deque<Command> commands;
+    m_bulkMutex.lock();
+    commands.swap(m_bulkCommands);
+    m_bulkMutex.unlock();
+    for( auto i = commands.begin() ; i != commands.end() ; i++ )
     {
-        cmd = m_txBuffer.front();
-        m_tcpClient->sendRawBytes((cmd+"\n").c_str(), cmd.length()+1);
-        m_txBuffer.pop_front();
+        if( i->onDone )
+        {
+            i->onDone(aborted);
+        }
     }
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::addPlaylist(std::vector<std::string>& songs)
+//  転送用レーンが初めて、または再接続された後であれば、
+//  挨拶を受け取って binarylimit を設定し直す
+//------------------------------------------------------------------------------
+bool MPDClient::prepareBulkLane(unsigned& generation)
 {
-    m_mutex.lock();
-    m_txBuffer.push_back(BEGIN_COMMAND_LIST);
-    m_txBuffer.push_back("stop");
-    m_txBuffer.push_back("clear");
-    char buf[20];
-    for( int i = 0 ; i < (int)songs.size() ; i++ )
+    if( m_bulkClient->isConnected() && m_bulkClient->getGeneration() == generation )
     {
-        std::stringstream ss;
-        ss << "add " << songs[i] << ".mp3";
-        m_txBuffer.push_back(ss.str());
+        return true;
     }
-    m_txBuffer.push_back(END_COMMAND_LIST);
-    m_mutex.unlock();
-}
 
-//------------------------------------------------------------------------------
-void MPDClient::play(int song)
-{
-    m_mutex.lock();
+    std::string_view line;
+    if( !receiveBulkResponse(line) || line.compare(0, 6, "OK MPD") != 0 )
+    {
+        std::cerr << "Bulk lane is not available" << std::endl;
+        return false;
+    }
+    generation = m_bulkClient->getGeneration();
+
+    // 1回の応答で受け取るバイナリデータの上限を引き上げる
+    // （binarylimit を知らない古い MPD は ACK を返すが、既定値のまま転送できる）
     std::stringstream ss;
-    ss << "play " << song;  // song は 0 が先頭の曲になる
-    m_txBuffer.push_back(ss.str());
-    m_mutex.unlock();
+    ss << "binarylimit " << COVERART_BINARY_LIMIT << "\n";
+    std::string cmd = ss.str();
+    m_bulkClient->sendRawBytes(cmd.c_str(), cmd.length());
+    return receiveBulkResponse(line);
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::togglePause()
+//  転送用レーンの応答を１要素受け取る
+//  タイムアウトまたは終了要求の場合は false を返す
+//  （遅れて届く応答の残りを次のコマンドの応答と取り違えないよう、接続し直す）
+//------------------------------------------------------------------------------
+bool MPDClient::receiveBulkResponse(std::string_view& line)
 {
-    m_mutex.lock();
-    if( m_playerStatus.state == PlayerStatus::PLAYERSTATE_PAUSE )
-    {
-        m_txBuffer.push_back("play");
-    }
-    else if( m_playerStatus.state == PlayerStatus::PLAYERSTATE_PLAY )
+    // 終了要求に気付けるよう、短い時間ずつ区切って待つ
+    const int SLICE_MS = 100;
+    for( int waited = 0 ; !m_terminated && waited < BULK_TIMEOUT_MS ; waited += SLICE_MS )
     {
-        m_txBuffer.push_back("pause");
+        if( m_bulkClient->receive(line, SLICE_MS) )
+        {
+            return true;
+        }
     }
-    m_mutex.unlock();
+    m_bulkClient->reconnect();
+    return false;
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::next()
-{
-    m_mutex.lock();
-    m_txBuffer.push_back("next");
-    m_mutex.unlock();
-}
-
+//  "binary: N" に続くバイナリデータをすべて data の後ろへ受け取る
+//  BULK_TIMEOUT_MS の間まったく受信できなかった場合と終了要求の場合は、
+//  receiveBulkResponse() と同じく接続し直して false を返す
 //------------------------------------------------------------------------------
-void MPDClient::previous()
+bool MPDClient::receiveBulkPayload(std::vector<uint8_t>& data)
 {
-    m_mutex.lock();
-    m_txBuffer.push_back("previous");
-    m_mutex.unlock();
+    const int SLICE_MS = 100;
+    int waited = 0;
+    while( m_bulkClient->getBinaryRemaining() > 0 )
+    {
+        if( m_terminated || waited >= BULK_TIMEOUT_MS )
+        {
+            m_bulkClient->reconnect();
+            return false;
+        }
+        waited = m_bulkClient->receiveBinary(data, SLICE_MS) ? 0 : waited + SLICE_MS;
+    }
+    return true;
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::stop()
-{
-    m_mutex.lock();
-    m_txBuffer.push_back("stop");
-    m_mutex.unlock();
-}
-
+//  sendBulkCommand() で要求されたコマンドを転送用レーンで実行する
+//  OK/ACK を受け取れば result に入れて true を、タイムアウトと終了要求の場合は false を返す
 //------------------------------------------------------------------------------
-void MPDClient::setVolume(long value)
+bool MPDClient::runBulkCommand(Command& command, CommandResult& result)
 {
-    m_mutex.lock();
-    std::stringstream ss;
-    ss << "volume " << value;
-    m_txBuffer.push_back(ss.str());
-    m_mutex.unlock();
+    std::string cmd = command.text + "\n";
+    command.sent = std::chrono::steady_clock::now();
+    m_bulkClient->sendRawBytes(cmd.c_str(), cmd.length());
+
+    std::string_view line;
+    while( receiveBulkResponse(line) )
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( command.responded == std::chrono::steady_clock::time_point() )
+        {
+            command.responded = std::chrono::steady_clock::now();
+        }
+        if( line == "OK\n" || line.compare(0, 4, "ACK ") == 0 )
+        {
+            if( line != "OK\n" )
+            {
+                result.parseAck(line);
+            }
+            recordCompletion(command, result.ok);
+            return true;
+        }
+        if( command.onLine )
+        {
+            command.onLine(line);
+        }
+    }
+    return false;
 }
 
 //------------------------------------------------------------------------------
-void MPDClient::terminate()
+//  albumart/readpicture によるカバーアートの転送
+//  １回の応答で返るのは binarylimit までなので、offset をずらしながら
+//  size に達するまで繰り返し要求して data に連結する
+//------------------------------------------------------------------------------
+bool MPDClient::readCoverArt(const char *command, const std::string& uri, std::vector<uint8_t>& data)
 {
-    stop();
-    bool b;
+    size_t size = 0;
+    data.clear();
     do
     {
-        m_mutex.lock();
-        b = !m_txBuffer.empty();
-        m_mutex.unlock();
+        std::stringstream ss;
+        ss << command << " " << quoteArgument(uri) << " " << data.size() << "\n";
+        std::string cmd = ss.str();
+        m_bulkClient->sendRawBytes(cmd.c_str(), cmd.length());
+
+        size_t chunk = 0;
+        std::string_view str;
+        while( true )
+        {
+            if( !receiveBulkResponse(str) )
+            {
+                return false;
+            }
+            ResponseLine line(str);
+            if( str == "OK\n" )
+            {
+                break;
+            }
+            else if( str.compare(0, 3, "ACK") == 0 )
+            {
+                return false;
+            }
+            else if( line.isKey("size") )
+            {
+                size = (size_t)line.toInt();
+                data.reserve(size);
+            }
+            else if( line.isKey("binary") )
+            {
+                chunk = (size_t)line.toInt();
+                if( !receiveBulkPayload(data) )
+                {
+                    return false;
+                }
+            }
+        }
+        if( chunk == 0 )
+        {
+            // readpicture は画像が無い場合に OK だけを返す
+            break;
+        }
     }
-    while( b );
-    
-    m_terminated = true;
-    m_thread->join();
+    while( data.size() < size );
+
+    return !data.empty() && data.size() == size;
 }
 
 
@@ -523,6 +3531,9 @@ void MPDClient::terminate()
 //==============================================================================
 //  Song
 //==============================================================================
+const char *Song::FILE_EXTENSION = ".mp3";
+
+//------------------------------------------------------------------------------
 Song::Song(Album *album) : m_album(album), m_trackIndex(0), m_duration(0)
 {
 
@@ -543,13 +3554,32 @@ std::string Song::getPath()
     return m_album->getPath() + "/" + m_filename;
 }
 
+//------------------------------------------------------------------------------
+//  MPD のデータベース上の URI（add などに渡す）
+//------------------------------------------------------------------------------
+std::string Song::getURI()
+{
+    return getPath() + FILE_EXTENSION;
+}
+
 
 
 //==============================================================================
 //  Album
 //==============================================================================
+//  カバーアートのデータを展開する
+//  （内容が同じ画像を複数のアルバムで共有するのは CoverCache の役目）
+//------------------------------------------------------------------------------
+static std::shared_ptr<PNGImage> decodeCoverImage(std::vector<uint8_t>& data)
+{
+    std::shared_ptr<PNGImage> image = std::make_shared<PNGImage>();
+    image->read(&data[0], data.size());
+    return image;
+}
+
+//------------------------------------------------------------------------------
 Album::Album(Artist *artist) : m_artist(artist), m_id(0),
-    m_totalTime(0), m_year(0)
+    m_totalTime(0), m_year(0), m_image(std::make_shared<PNGImage>())
 {
 
 }
@@ -584,9 +3614,28 @@ void Album::loadFromJSON(picojson::object& obj)
 //------------------------------------------------------------------------------
 void Album::loadCoverImage()
 {
-    std::stringstream ss;
-    ss << "/mnt/music/" << getPath() << "/coverart.png";
-    m_image.read(ss.str().c_str());
+    std::string path = getCoverImagePath();
+    std::vector<uint8_t> data;
+    if( !PNGImage::load(path.c_str(), data) || data.empty() )
+    {
+        std::cerr << "Unable to open " << path << std::endl;
+        return;
+    }
+    std::atomic_store(&m_image, decodeCoverImage(data));
+}
+
+//------------------------------------------------------------------------------
+//  MPD サーバーからカバーアートを読み込む
+//  （転送と展開は転送用レーンで非同期に行われる）
+//------------------------------------------------------------------------------
+void Album::loadCoverImage(MPDClient *client)
+{
+    client->fetchCoverArt(getCoverArtURI(), [this](std::vector<uint8_t>& data){
+        if( !data.empty() )
+        {
+            std::atomic_store(&m_image, decodeCoverImage(data));
+        }
+    });
 }
 
 //------------------------------------------------------------------------------
@@ -595,6 +3644,26 @@ std::string Album::getPath()
     return m_artist->getPath() + "/" + m_directory;
 }
 
+//------------------------------------------------------------------------------
+std::string Album::getCoverImagePath()
+{
+    std::stringstream ss;
+    ss << "/mnt/music/" << getPath() << "/coverart.png";
+    return ss.str();
+}
+
+//------------------------------------------------------------------------------
+//  albumart/readpicture に渡す URI（アルバムの先頭の曲）
+//------------------------------------------------------------------------------
+std::string Album::getCoverArtURI()
+{
+    if( m_songs.empty() )
+    {
+        return getPath();
+    }
+    return m_songs[0]->getURI();
+}
+
 
 
 //==============================================================================
@@ -704,6 +3773,7 @@ Artist *ArtistList::getArtistByID(uint16_t id)
 }
 
 //------------------------------------------------------------------------------
+#ifndef MPD_CLIENT_NO_MAIN
 int main()
 {
     ArtistList artists;
@@ -716,3 +3786,4 @@ int main()
     }
     return 0;
 }
+#endif
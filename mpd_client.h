@@ -4,14 +4,23 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <string>
+#include <string_view>
 #include <cstdint>
 #include <vector>
 #include <deque>
+#include <map>
+#include <list>
+#include <memory>
 #include <algorithm>
+#include <chrono>
+#include <atomic>
 
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -20,46 +29,202 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "png_image.h"
 #include "picojson.h"
 
 //------------------------------------------------------------------------------
-class TCPClient 
+//  固定長のリングバッファ
+//  容量は 2 のべき乗に切り上げる。読み出し位置・書き込み位置は単調に増やし、
+//  添字はマスクして求める。スレッド間で共有する場合のロックは呼び出し側で行う
+//------------------------------------------------------------------------------
+class RingBuffer
+{
+    private:
+        std::vector<uint8_t> m_data;
+        size_t               m_mask;
+        size_t               m_head;    // 読み出し位置
+        size_t               m_tail;    // 書き込み位置
+
+    public:
+        static const size_t npos;
+
+        RingBuffer(size_t capacity);
+        size_t getCapacity(){ return m_data.size(); }
+        size_t getReadPosition(){ return m_head; }     // これまでに読み出した総バイト数
+        size_t getWritePosition(){ return m_tail; }    // これまでに書き込んだ総バイト数
+        size_t getSize(){ return m_tail - m_head; }
+        size_t getFreeSpace(){ return m_data.size() - (m_tail - m_head); }
+        bool isEmpty(){ return m_head == m_tail; }
+        void clear(){ m_head = m_tail = 0; }
+
+        size_t write(const void *data, size_t len);
+        uint8_t *getWritePointer(size_t& len);
+        void commit(size_t len);
+        const uint8_t *getReadPointer(size_t& len);
+        const uint8_t *peek(size_t len, std::string& scratch);
+        void consume(size_t len);
+        size_t find(uint8_t c, size_t from = 0);
+};
+
+//------------------------------------------------------------------------------
+//  ホスト名の解決（getaddrinfo）を別スレッドで行い、結果をキャッシュする
+//  mDNS（raspberrypi.local など）の解決は数秒かかることがあるので、
+//  呼び出し側は時間を区切って待ち、その間に終了要求などを確認できる
+//------------------------------------------------------------------------------
+class HostResolver
 {
+    public:
+        struct Address
+        {
+            struct sockaddr_storage addr;
+            socklen_t               length;
+            int                     family;
+        };
+
     private:
-        static const int  BUFFER_SIZE;
-        static const char DELIMITOR;
+        static const int CACHE_SECONDS;
+
+        struct Entry
+        {
+            std::vector<Address> addresses;     // 解決できなかった場合は空
+            std::chrono::steady_clock::time_point expire;
+            bool                 resolving;
+        };
+
+        static std::map<std::string, Entry> s_cache;
+        static std::mutex                   s_mutex;
+        static std::condition_variable      s_condition;
+
+        static std::string makeKey(const std::string& host, uint32_t port);
+
+    public:
+        static bool resolve(const std::string& host, uint32_t port, std::vector<Address>& addresses, int timeoutMs);
+        static void invalidate(const std::string& host, uint32_t port);
+};
+
+//------------------------------------------------------------------------------
+//  ストリーム型ソケットによる送受信
+//  host が / で始まる場合は Unix ドメインソケットのパス（@ で始まる場合は抽象名前空間）、
+//  それ以外は TCP のホスト名として接続する（Unix ドメインソケットでは port は使わない）
+//  接続・再接続と送受信は専用のスレッドで行う
+//  接続できない間もコンストラクタは戻り、送信したデータは捨てられる
+//------------------------------------------------------------------------------
+class StreamClient 
+{
+    private:
+        static const int    RESOLVE_WAIT_MS;
+        static const int    CONNECT_TIMEOUT_MS;
+        static const int    RECONNECT_MIN_MS;
+        static const int    RECONNECT_MAX_MS;
+        static const size_t MIN_READ_SIZE;
+        static const size_t MAX_READ_SIZE;
+        static const size_t RX_CAPACITY;
+        static const size_t TX_CAPACITY;
+        static const int    SEND_WAIT_MS;
+        static const char   DELIMITOR;
+        static const char  *BINARY_HEADER;
 
         std::string             m_host;
         uint32_t                m_port;
-        bool                    m_connected;
+        std::atomic<bool>       m_connected;        // 受信スレッドが書き換え、他のスレッドからも読む
         int                     m_sockfd;
-        std::vector<uint8_t>    m_txBuffer;
-        std::deque<std::string> m_rxBuffer;
+        RingBuffer              m_txBuffer;
+        RingBuffer              m_rxBuffer;
+        std::string             m_rxScratch;        // リングバッファの境界をまたぐ要素の連結用
+        size_t                  m_rxScanned;        // 区切りの \n を探し終えたバイト数
+        size_t                  m_rxHeld;           // 最後に渡した要素のバイト数（次の受信時に捨てる）
+        size_t                  m_binaryRemaining;  // バイナリデータの残りバイト数（末尾の \n を含む、0 なら行単位）
+        size_t                  m_readSize;         // １回の read() で要求するバイト数（受信量に合わせて増減する）
+        size_t                  m_rxDiscard;        // この位置より前の受信データは切断前の接続のもの
+        unsigned                m_generation;       // 接続できた回数
 
-        struct sockaddr_in m_servaddr;
-        struct hostent    *m_server;
+        int  m_epollfd;
+        int  m_eventfd;     // 送信データの追加・終了要求をスレッドへ知らせる
+        bool m_writing;     // EPOLLOUT を監視中であれば true
+        bool m_reading;     // ソケットを epoll に登録して EPOLLIN を監視中であれば true（受信バッファが一杯の間は外す）
 
         bool m_terminated;
+        std::atomic<bool> m_reconnect;  // reconnect() で切断を要求されていれば true
         std::thread *m_thread;
         std::mutex   m_mutex;
+        std::condition_variable m_rxCondition;
+        std::function<void()>   m_notifier;
+        std::function<void(bool connected)> m_connectionHandler;
 
-        void connect();
+        bool isLocal(){ return !m_host.empty() && (m_host[0] == '/' || m_host[0] == '@'); }
+        bool connect();
+        bool waitConnected();
+        void waitWakeup(int timeoutMs);
+        void serve();
+        void disconnect();
         void execute();
+        void wakeup();
+        void updateEvents();
         bool enableKeepalive();
-        void internalSend();
-        void internalReceive();
-        void addRxLines(std::string buffer);
+        void disableNagle();
+        bool flush();
+        bool internalSend();
+        bool internalReceive();
+        size_t scanRxElement();
+        bool takeRxElement(std::string_view& element);
+        void releaseRxElement();
+        size_t takeBinary(std::vector<uint8_t>& data);
     public:
-        TCPClient(const char *host, uint32_t port);
-        ~TCPClient();
+        StreamClient(const char *host, uint32_t port);
+        ~StreamClient();
 
         bool hadError();
+        bool isConnected(){ return m_connected; }
+        unsigned getGeneration();
+        void setNotifier(std::function<void()> notifier);
+        void setConnectionHandler(std::function<void(bool connected)> handler);
         void sendRawBytes(const void *data, uint32_t len);
-        std::string receive();
+        void reconnect();
+        bool receive(std::string_view& element);
+        bool receive(std::string_view& element, int timeoutMs);
+        bool receiveBinary(std::vector<uint8_t>& data, int timeoutMs);
+        size_t getBinaryRemaining();
 };
 
+//------------------------------------------------------------------------------
+//  MPD の応答の１行 "key: value\n" を key と value に分ける
+//  受信バッファの中を指すだけで、コピーもメモリの確保もしない。数値の変換はロケールに
+//  依存せず、MPD が返す形式（"-12" や固定小数点の "123.456"）だけを扱う
+//  曲の一覧のように複数の項目が並ぶ応答では、項目の最初の行で isRecordStart() が true になる
+//------------------------------------------------------------------------------
+class ResponseLine
+{
+    private:
+        std::string_view m_key;
+        std::string_view m_value;
+
+    public:
+        ResponseLine(){}
+        explicit ResponseLine(std::string_view line){ parse(line); }
+        bool parse(std::string_view line);
+        bool isKey(std::string_view key) const { return m_key == key; }
+        bool isRecordStart() const;
+        std::string_view getKey() const { return m_key; }
+        std::string_view getValue() const { return m_value; }
+        int64_t toInt() const { return parseInt(m_value); }
+        double toDouble() const { return parseDouble(m_value); }
+        bool toBool() const { return m_value == "1"; }
+        static int64_t parseInt(std::string_view str);
+        static double parseDouble(std::string_view str);
+};
+
+//------------------------------------------------------------------------------
+//  status の応答の内容
+//  応答を beginResponse() → parseStatusResponse()（１行ずつ）→ endResponse() の順に渡すと、
+//  endResponse() が前回から変化した項目を CHANGED_xxxx の組み合わせで返す
+//  （応答に含まれなかった項目は既定値に戻す）
+//  再生中の経過時間は受信時刻からの経過で補間するので、getElapsed() は status を
+//  取り直さなくても進む。補間した値との差が小さい間は受信した elapsed で合わせ直さない
 //------------------------------------------------------------------------------
 struct PlayerStatus
 {
@@ -68,71 +233,495 @@ struct PlayerStatus
         PLAYERSTATE_PAUSE = 1,
         PLAYERSTATE_PLAY  = 2
     };
-    long        volume;      // 0〜100
-    int         state;       // PLAYERSTATE_xxxx
-    int         song;        // 0〜
-    int         elapsed;     // 秒単位
+    enum {
+        SINGLE_OFF     = 0,
+        SINGLE_ON      = 1,
+        SINGLE_ONESHOT = 2
+    };
+    enum {
+        CHANGED_VOLUME   = 0x0001,
+        CHANGED_STATE    = 0x0002,
+        CHANGED_SONG     = 0x0004,     // song, songid
+        CHANGED_NEXTSONG = 0x0008,     // nextsong, nextsongid
+        CHANGED_ELAPSED  = 0x0010,
+        CHANGED_DURATION = 0x0020,
+        CHANGED_BITRATE  = 0x0040,
+        CHANGED_AUDIO    = 0x0080,
+        CHANGED_PLAYLIST = 0x0100,     // playlist, playlistlength
+        CHANGED_OPTIONS  = 0x0200,     // random, repeat, single, consume, xfade, mixrampdb
+        CHANGED_ERROR    = 0x0400,
+        CHANGED_UPDATING = 0x0800,
+        CHANGED_ALL      = 0x0fff
+    };
+    long        volume;          // 0〜100（ミキサーが無い場合は -1）
+    int         state;           // PLAYERSTATE_xxxx
+    int         song;            // 0〜（無い場合は -1）
+    int         songId;
+    int         nextSong;        // 0〜（無い場合は -1）
+    int         nextSongId;
+    double      elapsed;         // 秒単位（timestamp の時点の値）
+    std::chrono::steady_clock::time_point timestamp;     // elapsed を合わせた時刻
+    double      duration;        // 秒単位
+    int         bitrate;         // kbps
+    std::string audio;           // "44100:24:2" のようなサンプリング周波数:ビット数:チャンネル数
+    uint32_t    playlistVersion;
+    int         playlistLength;
+    bool        random;
+    bool        repeat;
+    int         single;          // SINGLE_xxxx
+    bool        consume;
+    int         crossfade;       // 秒単位
+    double      mixrampDb;
+    int         updatingDb;      // データベース更新中のジョブ ID（更新中でなければ 0）
+    std::string error;
+    int         pending;         // 応答を待たずに反映している操作の数（MPDClient::getStatus() が設定する）
 
-    PlayerStatus() : volume(50), state(PLAYERSTATE_STOP), song(0), elapsed(0){}
-    void parseStatusResponse(const std::string& res);
+    PlayerStatus();
+    void beginResponse(){ m_seen = 0; }
+    void parseStatusResponse(std::string_view res);
+    uint32_t endResponse();
     bool playing(){ return state != PLAYERSTATE_STOP; }
-    PlayerStatus clone(){
-        PlayerStatus s;
-        s.volume  = this->volume;
-        s.state   = this->state;
-        s.song    = this->song;
-        s.elapsed = this->elapsed;
-        return s;
-    }
+    double getElapsed(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const;
+    void overlay(const PlayerStatus& source, uint32_t fields);
+    bool matches(const PlayerStatus& source, uint32_t fields, std::chrono::steady_clock::time_point now) const;
+    PlayerStatus clone(){ return *this; }
+
+    private:
+        static const double ELAPSED_TOLERANCE;
+
+        uint32_t m_seen;         // 今回の応答に含まれていたキー（ビットごと）
+        uint32_t m_changed;
+        double   m_rxElapsed;    // 今回の応答の elapsed
+
+        void applyValue(int key, std::string_view value);
 };
 
 //------------------------------------------------------------------------------
-class MPDClient
+//  １曲のメタデータ（currentsong / playlistinfo / lsinfo などの応答の１曲分）
+//  文字列は SongCache の中で同じ内容のものを共有する（無い項目は NULL）
+//  作った後は変更しないので、ロックせずに別のスレッドから読んでよい
+//------------------------------------------------------------------------------
+struct SongInfo
+{
+    typedef std::shared_ptr<const std::string> Text;
+
+    Text     file;          // MPD のライブラリの中の URI
+    Text     title;
+    Text     artist;
+    Text     album;
+    Text     albumArtist;
+    float    duration;      // 秒単位
+    uint16_t track;         // トラック番号（無い場合は 0）
+    uint16_t year;          // Date の年（無い場合は 0）
+
+    SongInfo() : duration(0), track(0), year(0){}
+    bool operator==(const SongInfo& other) const;
+    static const std::string& getText(const Text& text);
+};
+
+//------------------------------------------------------------------------------
+//  曲のメタデータのキャッシュ（file の URI ごと）
+//  受け取った曲の情報はすべてここを通すので、同じ曲を別の画面（キュー・再生中・履歴など）で
+//  表示する場合にサーバーへ問い合わせ直さなくて済む。capacity 曲を超えた分は古いものから捨てる
+//  アーティスト名やアルバム名などは同じ文字列を intern() で共有して１つだけ持つ
+//  スレッド間で共有する場合のロックは呼び出し側で行う
+//------------------------------------------------------------------------------
+class SongCache
 {
+    public:
+        // 複数の曲を含む応答を１行ずつ読む（別の接続の応答と混ざらないよう、コマンドごとに持つ）
+        struct Reader
+        {
+            SongInfo song;      // 受信中の曲
+            std::vector<std::shared_ptr<const SongInfo>> songs;     // 受信した曲
+        };
+
     private:
-        static const char *SERVER_ADDR;
-        static const int   SERVER_PORT;
-        static const char *BEGIN_COMMAND_LIST;
-        static const char *END_COMMAND_LIST;
+        static const size_t DEFAULT_CAPACITY;
+
+        struct Entry
+        {
+            std::shared_ptr<const SongInfo>  song;
+            std::list<std::string_view>::iterator lru;
+        };
 
+        // どちらもキーは値が持つ文字列（file の URI・共有の文字列）を指す
+        std::map<std::string_view, Entry, std::less<>>          m_songs;
+        std::map<std::string_view, SongInfo::Text, std::less<>> m_strings;
+        std::list<std::string_view> m_lru;      // 先頭ほど最近使われた曲
+        size_t                      m_capacity;
+        size_t                      m_evicted;  // 前回 sweep() してから捨てた曲の数
+        uint64_t                    m_hits;
+        uint64_t                    m_misses;
+
+        void evict();
+        void sweep();
+
+    public:
+        SongCache(size_t capacity = DEFAULT_CAPACITY);
+        SongInfo::Text intern(std::string_view str);
+        bool parseField(const ResponseLine& line, SongInfo& song);
+        void parse(std::string_view line, Reader& reader);
+        void endResponse(Reader& reader);
+        std::shared_ptr<const SongInfo> insert(const SongInfo& song);
+        std::shared_ptr<const SongInfo> find(std::string_view file);
+        size_t getSize(){ return m_songs.size(); }
+        size_t getNumStrings(){ return m_strings.size(); }
+        uint64_t getHits(){ return m_hits; }
+        uint64_t getMisses(){ return m_misses; }
+};
+
+//------------------------------------------------------------------------------
+//  再生キューの１曲
+//------------------------------------------------------------------------------
+struct QueueEntry
+{
+    enum {
+        STATE_EMPTY     = 0,    // songid だけ分かっている
+        STATE_REQUESTED = 1,    // 曲の情報を要求中
+        STATE_LOADED    = 2     // 曲の情報を取得済み
+    };
+    int         id;             // songid（-1: 不明）
+    int         state;          // STATE_xxxx
+    std::shared_ptr<const SongInfo> song;   // STATE_LOADED の場合は必ずある
+
+    QueueEntry() : id(-1), state(STATE_EMPTY){}
+};
+
+//------------------------------------------------------------------------------
+//  MPD の再生キューの写し
+//  キューのバージョン（status の playlist）からの差分を plchangesposid で受け取って、
+//  位置ごとの songid を合わせる。曲の情報は表示する範囲の分だけ plchanges や
+//  playlistinfo で取得する。スレッド間で共有する場合のロックは呼び出し側で行う
+//------------------------------------------------------------------------------
+class PlayQueue
+{
+    private:
+        std::vector<QueueEntry> m_entries;
+        uint32_t                m_version;      // m_entries が表すキューのバージョン
+        int                     m_changePos;    // plchangesposid の応答で受信中の位置
+
+    public:
+        // plchanges / playlistinfo / currentsong の応答で受信中の曲（別の接続の応答と混ざらないよう、コマンドごとに持つ）
+        struct SongReader
+        {
+            SongInfo song;
+            int      pos;
+            int      lastId;    // 最後に受信した曲の songid
+            std::shared_ptr<const SongInfo> last;
+            SongReader() : pos(-1), lastId(-1){}
+        };
+
+        PlayQueue() : m_version(0), m_changePos(-1){}
+        void reset();
+        uint32_t getVersion(){ return m_version; }
+        size_t getLength(){ return m_entries.size(); }
+        const QueueEntry& getEntry(size_t pos){ return m_entries[pos]; }
+        void parseChange(std::string_view line);
+        void parseSong(std::string_view line, SongReader& reader, SongCache& cache);
+        void commit(uint32_t version, size_t length);
+        bool requestMissing(size_t start, size_t end, size_t& first, size_t& last);
+        void cancelRequests(size_t first, size_t last);
+};
+
+//------------------------------------------------------------------------------
+//  コマンド１つ分の実行結果
+//------------------------------------------------------------------------------
+struct CommandResult
+{
+    bool        ok;
+    int         error;      // ACK のエラーコード（ok の場合は 0）
+    std::string message;    // ACK のメッセージ
+
+    CommandResult() : ok(true), error(0){}
+    void parseAck(std::string_view line);
+};
+
+//------------------------------------------------------------------------------
+//  マイクロ秒単位の時間の分布（HDR ヒストグラム風）
+//  2 のべき乗ごとの区間をさらに 16 に分けて数えるので、誤差は 1/16 以内で、
+//  記録は配列の要素を１つ増やすだけで済む
+//------------------------------------------------------------------------------
+class LatencyHistogram
+{
+    private:
+        enum {
+            SUB_BUCKET_BITS = 4,
+            SUB_BUCKETS     = 1 << SUB_BUCKET_BITS,
+            MAX_BITS        = 40,   // 2^40 マイクロ秒（約 12 日）以上は最後の区間に数える
+            NUM_BUCKETS     = SUB_BUCKETS * (MAX_BITS - SUB_BUCKET_BITS + 1)
+        };
+
+        uint32_t m_counts[NUM_BUCKETS];
+        uint64_t m_count;
+        uint64_t m_sum;
+        uint64_t m_max;
+
+        static int getBucket(uint64_t value);
+        static uint64_t getBucketValue(int bucket);
+
+    public:
+        LatencyHistogram(){ clear(); }
+        void clear();
+        void record(uint64_t us);
+        uint64_t getCount() const { return m_count; }
+        uint64_t getMax() const { return m_max; }
+        double getMean() const { return (m_count > 0) ? (double)m_sum / m_count : 0; }
+        uint64_t getPercentile(double percent) const;
+};
+
+//------------------------------------------------------------------------------
+class Album;
+class Artist;
+class MPDClient
+{
+    public:
+        // カバーアートの取得完了時に呼ばれる（取得できなかった場合 data は空）
+        typedef std::function<void(std::vector<uint8_t>& data)> CoverArtHandler;
+        // コマンドの応答の１行ごとに呼ばれる（MPDClient をロックしたまま呼ぶので、
+        // この中から MPDClient のメソッドを呼んではいけない。line は呼び出しの間だけ有効）
+        typedef std::function<void(std::string_view line)> ResponseHandler;
+        // コマンドの完了時に呼ばれる（ロックは外して呼ぶ）
+        typedef std::function<void(const CommandResult& result)> CompletionHandler;
+        // 曲の情報の取得完了時に呼ばれる（取得できなかった場合 song は NULL）
+        typedef std::function<void(std::shared_ptr<const SongInfo> song)> SongInfoHandler;
+
+        // idle で変化を監視するサブシステム
+        enum {
+            SUBSYSTEM_PLAYER   = 0x01,
+            SUBSYSTEM_MIXER    = 0x02,
+            SUBSYSTEM_PLAYLIST = 0x04,
+            SUBSYSTEM_OPTIONS  = 0x08,
+            SUBSYSTEM_ALL      = 0x0f
+        };
+
+        // 後から送った同じ種類のコマンドで置き換えてよいコマンド（スライダーの操作など）
         enum {
-            STATE_WAIT_CONNECTION,
-            STATE_READY,
-            STATE_WAIT_RESPONSE
+            COALESCE_NONE   = 0x00,
+            COALESCE_VOLUME = 0x01,
+            COALESCE_SEEK   = 0x02
+        };
+
+        // 未送信のコマンドの優先度（高い順に送る。同じ優先度の中では送った順）
+        enum {
+            PRIORITY_INTERACTIVE = 0,   // 再生の操作など、すぐに反映したいもの
+            PRIORITY_NORMAL      = 1,
+            PRIORITY_BACKGROUND  = 2,   // キューへの大量の追加など、遅れてもよいもの
+            NUM_PRIORITIES       = 3
+        };
+
+    private:
+        static const char  *SERVER_ADDR;
+        static const int    SERVER_PORT;
+
+        static std::string getServerAddress();
+        static int getServerPort();
+        static const char  *BEGIN_COMMAND_LIST;
+        static const char  *END_COMMAND_LIST;
+        static const char  *IDLE_COMMAND;
+        static const int    MAX_COMMAND_LIST;
+        static const size_t MAX_COMMAND_LIST_BYTES;
+        static const int    MAX_BACKGROUND_INFLIGHT;
+        static const int    COVERART_BINARY_LIMIT;
+        static const int    BULK_TIMEOUT_MS;
+        static const int    KEEPALIVE_INTERVAL_MS;
+        static const int    PENDING_TIMEOUT_MS;
+        static const int    TERMINATE_TIMEOUT_MS;
+
+        struct CoverArtRequest
+        {
+            std::string     uri;
+            CoverArtHandler handler;
+            bool            prefetch;   // 先読みの要求であれば true（画面に表示中の要求を優先する）
+        };
+
+        struct Command
+        {
+            std::string       text;     // 末尾の \n は含まない
+            ResponseHandler   onLine;
+            CompletionHandler onDone;
+            int               coalesce; // COALESCE_xxxx
+            int               priority; // PRIORITY_xxxx
+            int               appended; // キューの編集で追加する曲数（0: 編集しない、-1: 置き換えるか曲数が分からない）
+            std::chrono::steady_clock::time_point queued;       // m_txBuffer に入れた時刻
+            std::chrono::steady_clock::time_point sent;         // 送った時刻
+            std::chrono::steady_clock::time_point responded;    // 最初の応答の行を受信した時刻
+
+            Command() : coalesce(COALESCE_NONE), priority(PRIORITY_NORMAL), appended(0){}
+        };
+
+        // コマンドの種類（先頭の語）ごとの計測値
+        struct CommandStatistics
+        {
+            LatencyHistogram queued;    // m_txBuffer に入れてから送るまで
+            LatencyHistogram server;    // 送ってから最初の応答の行まで（通信と MPD の処理）
+            LatencyHistogram total;     // m_txBuffer に入れてから完了まで
+            uint64_t         failed;    // ACK の数
+
+            CommandStatistics() : failed(0){}
+        };
+
+        // 操作用と通知用の接続のやりとりの量
+        struct ProtocolCounters
+        {
+            uint64_t bytesSent;
+            uint64_t bytesReceived;
+            uint64_t linesReceived;
+            uint64_t commandsSent;
+            uint64_t commandLists;      // command_list_ok_begin で送った回数
+            uint64_t writes;            // sendRawBytes() の回数
+            uint64_t idles;
+            uint64_t connects;
+
+            ProtocolCounters() : bytesSent(0), bytesReceived(0), linesReceived(0), commandsSent(0),
+                                 commandLists(0), writes(0), idles(0), connects(0){}
         };
 
-        TCPClient              *m_tcpClient;
-        std::deque<std::string> m_txBuffer;
-        std::deque<std::string> m_rxBuffer;
-        int                     m_state;
+        // まとめて送ったコマンド（２つ以上なら command_list_ok_begin で囲む）
+        struct Batch
+        {
+            std::vector<Command> commands;
+            size_t               current;   // 応答を受信中のコマンド
+        };
+
+        // MPD への接続の１つ（update() のスレッドで応答を処理する）
+        struct Channel
+        {
+            StreamClient     *client;
+            std::deque<Batch> inflight;     // 送信済みで応答待ちのコマンド（送信順）
+            bool              ready;        // 挨拶を受信済みなら true
+            std::chrono::steady_clock::time_point lastSent;
+
+            Channel() : client(NULL), ready(false){}
+        };
+
+        // 応答を待たずに getStatus() / getQueue() に反映した操作
+        // OK の後に送った status の応答で確定し、ACK や切断の場合は取り消す
+        struct PendingAction
+        {
+            uint32_t     seq;
+            PlayerStatus target;        // 操作の後の状態（fields の項目だけ使う）
+            uint32_t     fields;        // PlayerStatus::CHANGED_xxxx
+            bool         clearQueue;    // キューを空にしてから uris を追加する
+            size_t       queueBase;     // uris を追加する位置
+            std::vector<std::string> uris;
+            bool         done;          // OK を受信済み
+            uint64_t     barrier;       // OK を受信した時点で最後に送った status の通し番号
+            std::chrono::steady_clock::time_point doneTime;
+
+            PendingAction() : seq(0), fields(0), clearQueue(false), queueBase(0), done(false), barrier(0){}
+        };
+
+        typedef std::vector<std::pair<CompletionHandler, CommandResult>> Completions;
+
+        Channel                 m_command;      // 操作用（idle で塞がないので、すぐに送れる）
+        Channel                 m_notify;       // 通知用（idle で変化を待ち、状態とキューを取り直す）
+        std::deque<Command>     m_txBuffer[NUM_PRIORITIES];    // PRIORITY_xxxx ごとの未送信のコマンド
+        std::map<int, Command>  m_coalesced;    // 未送信の COALESCE_xxxx のコマンド（種類ごとに最新のものだけ）
         PlayerStatus            m_playerStatus;
+        PlayQueue               m_queue;
+        SongCache               m_songs;
+        std::shared_ptr<const SongInfo> m_currentSong;  // currentsong で取得した再生中の曲
+        int                     m_currentSongId;
+        int                     m_currentSongRequest;   // currentsong で要求中の曲の songid
+        size_t                  m_queueStart;   // 曲の情報を取得しておく範囲（キューの表示範囲）
+        size_t                  m_queueEnd;
         bool                    m_terminated;
         std::thread            *m_thread;
         std::mutex              m_mutex;
+        std::condition_variable m_condition;
+        bool                    m_rxReady;      // 未処理の受信データがあれば true
+        int                     m_changed;      // 状態を取り直す必要のあるサブシステム（SUBSYSTEM_xxxx）
+        uint32_t                m_statusChanged;    // getStatus() で未通知の変化（PlayerStatus::CHANGED_xxxx）
+        Completions             m_lost;         // 切断で失敗したコマンド（update() で通知する）
+        std::deque<PendingAction> m_pending;    // 確定していない操作（古い順）
+        uint32_t                m_pendingSeq;
+        uint64_t                m_statusSerial;     // 送った status の通し番号
+        uint64_t                m_statusConfirmed;  // 応答を受け取った最新の status の通し番号
+        std::map<std::string, CommandStatistics, std::less<>> m_statistics;
+        ProtocolCounters        m_counters;
+
+        // カバーアートやライブラリ全体の取得など、大きな転送用のレーン
+        // （操作用・通知用とは別の接続・スレッドで処理するので、転送中も操作が待たされない）
+        StreamClient               *m_bulkClient;
+        std::deque<CoverArtRequest> m_coverRequests;
+        std::deque<Command>         m_bulkCommands;
+        std::thread                *m_bulkThread;
+        std::mutex                  m_bulkMutex;
+        std::condition_variable     m_bulkCondition;
 
-        void doReceive();
-        void doSend();
+        void queueCommand(const std::string& text, CompletionHandler onDone = NULL, ResponseHandler onLine = NULL,
+                          int coalesce = COALESCE_NONE, int priority = PRIORITY_NORMAL);
+        void queueEdit(const std::string& text, CompletionHandler onDone, int appended);
+        bool dependsOnEdits(int pos);
+        void queueDirectory(const std::string& uri, const std::vector<std::string>& uris, CompletionHandler onDone);
+        void releaseCoalesced();
+        int countBackground();
+        bool hasSendable();
+        void doSend(std::string& out);
+        void sendBatch(Channel& channel, std::vector<Command>& commands, std::string& out);
+        void refreshStatus(std::string& out);
+        void flush(Channel& channel, std::string& out);
+        void processResponse(Channel& channel, std::string_view line, Completions& completions);
+        void recordCompletion(Command& command, bool ok);
+        void onConnectionChanged(Channel& channel, bool connected);
+        void openChannel(Channel& channel, const std::string& host, int port);
+        void requestQueueWindow();
+        void requestCurrentSong();
+        CompletionHandler addPending(PendingAction& action, CompletionHandler onDone);
+        void settlePending(uint32_t seq, bool ok);
+        void retirePending();
+        PlayerStatus predictStatus();
+        size_t predictQueueLength();
+        QueueEntry predictEntry(size_t pos);
+        void predictSong(PendingAction& action, int song);
         void update();
         void terminate();
+        void executeBulk();
+        bool prepareBulkLane(unsigned& generation);
+        bool receiveBulkResponse(std::string_view& line);
+        bool receiveBulkPayload(std::vector<uint8_t>& data);
+        bool readCoverArt(const char *command, const std::string& uri, std::vector<uint8_t>& data);
+        bool runBulkCommand(Command& command, CommandResult& result);
 
     public:
         MPDClient();
         ~MPDClient();
-        void addPlaylist(std::vector<std::string>& songs);
-        void play(int song = 0);
-        void togglePause();
-        void next();
-        void previous();
-        void stop();
-        void setVolume(long value);
-        PlayerStatus getStatus();
+        void sendCommand(const std::string& command, CompletionHandler onDone = NULL, ResponseHandler onLine = NULL,
+                         int coalesce = COALESCE_NONE, int priority = PRIORITY_NORMAL);
+        size_t cancelCommands(int priority = PRIORITY_BACKGROUND);
+        void sendBulkCommand(const std::string& command, CompletionHandler onDone = NULL, ResponseHandler onLine = NULL);
+        void addPlaylist(const std::vector<std::string>& uris, CompletionHandler onDone = NULL);
+        void enqueue(const std::vector<std::string>& uris, CompletionHandler onDone = NULL);
+        void addDirectory(const std::string& uri, CompletionHandler onDone = NULL);
+        void addAlbum(Album *album, CompletionHandler onDone = NULL);
+        void addArtist(Artist *artist, CompletionHandler onDone = NULL);
+        void play(int song = 0, CompletionHandler onDone = NULL);
+        void togglePause(CompletionHandler onDone = NULL);
+        void next(CompletionHandler onDone = NULL);
+        void previous(CompletionHandler onDone = NULL);
+        void stop(CompletionHandler onDone = NULL);
+        void setVolume(long value, CompletionHandler onDone = NULL);
+        void seek(double seconds, CompletionHandler onDone = NULL);
+        void fetchCoverArt(const std::string& uri, CoverArtHandler handler, bool prefetch = false);
+        bool cancelCoverArt(const std::string& uri);
+        PlayerStatus getStatus(uint32_t *changed = NULL);
+        void setQueueWindow(size_t start, size_t end);
+        size_t getQueueLength();
+        std::vector<QueueEntry> getQueue(size_t start, size_t end, uint32_t *version = NULL);
+        std::shared_ptr<const SongInfo> getCurrentSong();
+        void lookupSong(const std::string& file, SongInfoHandler handler);
+        bool isConnected(){ return m_command.client->isConnected(); }
+        void dumpStatistics(std::ostream& out);
+        void resetStatistics();
 };
 
 //------------------------------------------------------------------------------
-class Album;
 class Song
 {
     private:
+        static const char *FILE_EXTENSION;
+
         std::string m_title;        // 曲名
         uint16_t    m_trackIndex;   // トラックNo. (1がアルバムの先頭の曲)
         uint16_t    m_duration;     // 曲の演奏時間(秒単位)
@@ -143,6 +732,7 @@ class Song
         Album *getAlbum(){ return m_album; }
         void loadFromJSON(picojson::object& obj);
         std::string getPath();
+        std::string getURI();
         std::string getTitle(){ return m_title; }
         uint16_t getDuration(){ return m_duration; }
         uint16_t getTrackIndex(){ return m_trackIndex; }
@@ -160,7 +750,7 @@ class Album
         uint16_t            m_year;         // アルバムの発売年（西暦）
         std::string         m_directory;    // フォルダ名（"trespass" など。フルパスではなくそのアルバムの曲が格納されたディレクトリ名であることに注意）
         Artist             *m_artist;       // このアルバムを所有するアーティスト
-        PNGImage            m_image;        // カバーアート画像データ   
+        std::shared_ptr<PNGImage> m_image;  // カバーアート画像データ
 
     public:
         Album(Artist *artist);
@@ -168,6 +758,8 @@ class Album
         Artist *getArtist(){ return m_artist; }
         void loadFromJSON(picojson::object& obj);
         void loadCoverImage();
+        void loadCoverImage(MPDClient *client);
+        std::string getCoverImagePath();
         uint16_t getID(){ return m_id; }
         std::string getTitle(){ return m_title; }
         std::string getDirectory(){ return m_directory; }
@@ -175,8 +767,9 @@ class Album
         uint16_t getTotalTime(){ return m_totalTime; }
         uint16_t getYear(){ return m_year; }
         Song *getSong(int index){ return m_songs[index]; }
-        PNGImage *getCoverImage(){ return &m_image; }
+        std::shared_ptr<PNGImage> getCoverImage(){ return std::atomic_load(&m_image); }
         std::string getPath();
+        std::string getCoverArtURI();
 };
 
 //------------------------------------------------------------------------------
@@ -2,6 +2,8 @@
 #include <string>
 #include <iostream>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
 #include <stdio.h>
 #include <png.h>
 
@@ -10,6 +12,86 @@
 
 const int PNGImage::HEADER_SIZE = 8;
 
+//------------------------------------------------------------------------------
+//  メモリ上の PNG データを libpng へ供給するための読み込み位置
+//------------------------------------------------------------------------------
+struct PNGMemoryReader
+{
+    const uint8_t *data;
+    size_t         size;
+    size_t         offset;
+};
+
+//------------------------------------------------------------------------------
+static void readFromMemory(png_structp png, png_bytep dest, png_size_t length)
+{
+    PNGMemoryReader *reader = (PNGMemoryReader *)::png_get_io_ptr(png);
+    if( reader->offset + length > reader->size )
+    {
+        ::png_error(png, "Unexpected end of PNG data");
+    }
+    ::memcpy(dest, reader->data + reader->offset, length);
+    reader->offset += length;
+}
+
+//------------------------------------------------------------------------------
+//  PNG 以外の画像の形式名を返す（PNG または不明な形式であれば NULL）
+//  MPD の albumart/readpicture は画像ファイルの内容をそのまま返すので、JPEG などもありうる
+//------------------------------------------------------------------------------
+static const char *detectOtherFormat(const uint8_t *data, size_t size)
+{
+    static const struct
+    {
+        const char *name;
+        const char *magic;
+        size_t      length;
+    } FORMATS[] = {
+        { "JPEG", "\xFF\xD8\xFF", 3 },
+        { "GIF",  "GIF8",         4 },
+        { "BMP",  "BM",           2 },
+        { "WebP", "RIFF",         4 },
+    };
+    for( size_t n = 0 ; n < sizeof(FORMATS) / sizeof(FORMATS[0]) ; n++ )
+    {
+        if( size >= FORMATS[n].length && ::memcmp(data, FORMATS[n].magic, FORMATS[n].length) == 0 )
+        {
+            return FORMATS[n].name;
+        }
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+//  png_read_png 済みの画像を RGB565 に変換する
+//------------------------------------------------------------------------------
+static void convertToRGB565(png_structp png, png_infop info, const std::string& name,
+    int& width, int& height, std::vector<uint16_t>& data)
+{
+    png_byte type = ::png_get_color_type(png, info);
+    if( type != PNG_COLOR_TYPE_RGB )
+    {
+        throw std::runtime_error("Type mismatch of " + name);
+    }
+
+    width = ::png_get_image_width(png, info);
+    height = ::png_get_image_height(png, info);
+
+    png_bytepp datap = ::png_get_rows(png, info);
+
+    data.resize(width * height);
+
+    for( int y = 0; y < height ; y++ )
+    {
+        for( int x = 0 ; x < width ; x++ )
+        {
+            uint16_t red   = (uint16_t)*(datap[y]+3*x);
+            uint16_t green = (uint16_t)*(datap[y]+3*x+1);
+            uint16_t blue  = (uint16_t)*(datap[y]+3*x+2);
+            data[y*width+x] = ((red << 8) & 0xF800) + ((green << 3) & 0x07E0) + (blue >> 3);
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 PNGImage::PNGImage() : m_width(0), m_height(0)
 {
@@ -32,6 +114,7 @@ void PNGImage::read(const char* path)
     uint32_t readSize = ::fread(header, 1, HEADER_SIZE, fp);
     if( ::png_sig_cmp(header, 0, HEADER_SIZE) )
     {
+        ::fclose(fp);
         std::string msg = "Failed in png_sig_cmp for ";
         msg += path;
         throw std::runtime_error(msg.c_str());
@@ -40,6 +123,7 @@ void PNGImage::read(const char* path)
     png_structp png = ::png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if( png == NULL )
     {
+        ::fclose(fp);
         std::string msg = "Failed in png_create_read_struct for ";
         msg += path;
         throw std::runtime_error(msg.c_str());
@@ -48,6 +132,8 @@ void PNGImage::read(const char* path)
     png_infop info = ::png_create_info_struct(png);
     if( info == NULL )
     {
+        ::png_destroy_read_struct(&png, NULL, NULL);
+        ::fclose(fp);
         std::string msg = "Failed in png_create_info_struct for ";
         msg += path;
         throw std::runtime_error(msg.c_str());
@@ -57,37 +143,527 @@ void PNGImage::read(const char* path)
     ::png_set_sig_bytes(png, readSize);
     ::png_read_png(png, info, PNG_TRANSFORM_PACKING|PNG_TRANSFORM_STRIP_16, NULL);
 
-    m_width = ::png_get_image_width(png, info);
-    m_height = ::png_get_image_height(png, info);
+    try
+    {
+        convertToRGB565(png, info, path, m_width, m_height, m_data);
+    }
+    catch( std::exception& )
+    {
+        ::png_destroy_read_struct(&png, &info, NULL);
+        ::fclose(fp);
+        throw;
+    }
+    ::png_destroy_read_struct(&png, &info, NULL);
+    ::fclose(fp);
+}
 
-    png_bytepp datap = ::png_get_rows(png, info);
+//------------------------------------------------------------------------------
+//  メモリ上の PNG データ（MPD の albumart/readpicture で取得したものなど）を読み込む
+//  ネットワーク経由のデータは壊れている可能性があるので、libpng のエラーは
+//  setjmp で捕捉して例外に変換する
+//  パレット・グレースケール・アルファ付きの画像は RGB に変換してから読み込む
+//------------------------------------------------------------------------------
+void PNGImage::read(const uint8_t *data, size_t size)
+{
+    if( size < (size_t)HEADER_SIZE || ::png_sig_cmp((png_const_bytep)data, 0, HEADER_SIZE) )
+    {
+        const char *format = detectOtherFormat(data, size);
+        if( format != NULL )
+        {
+            throw std::runtime_error(std::string("Unsupported image format (") + format + ") in cover art");
+        }
+        throw std::runtime_error("Failed in png_sig_cmp for cover art data");
+    }
 
-    png_byte type = ::png_get_color_type(png, info);
-    if( type != PNG_COLOR_TYPE_RGB )
+    png_structp png = ::png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if( png == NULL )
     {
-        std::string msg = "Type mismatch of ";
-        msg += path;
-        throw std::runtime_error(msg.c_str());
+        throw std::runtime_error("Failed in png_create_read_struct for cover art data");
+    }
+
+    png_infop info = ::png_create_info_struct(png);
+    if( info == NULL )
+    {
+        ::png_destroy_read_struct(&png, NULL, NULL);
+        throw std::runtime_error("Failed in png_create_info_struct for cover art data");
+    }
+
+    if( setjmp(png_jmpbuf(png)) )
+    {
+        ::png_destroy_read_struct(&png, &info, NULL);
+        throw std::runtime_error("Broken PNG data in cover art");
+    }
+
+    PNGMemoryReader reader = { data, size, 0 };
+    ::png_set_read_fn(png, &reader, readFromMemory);
+    ::png_read_png(png, info, PNG_TRANSFORM_PACKING|PNG_TRANSFORM_STRIP_16|PNG_TRANSFORM_EXPAND|
+                              PNG_TRANSFORM_STRIP_ALPHA|PNG_TRANSFORM_GRAY_TO_RGB, NULL);
+
+    try
+    {
+        convertToRGB565(png, info, "cover art data", m_width, m_height, m_data);
+    }
+    catch( std::exception& )
+    {
+        ::png_destroy_read_struct(&png, &info, NULL);
+        throw;
+    }
+    ::png_destroy_read_struct(&png, &info, NULL);
+}
+
+//------------------------------------------------------------------------------
+//  ファイルの内容をそのまま読み込む（展開はしない）
+//------------------------------------------------------------------------------
+bool PNGImage::load(const char *path, std::vector<uint8_t>& data)
+{
+    FILE *fp = ::fopen(path, "rb");
+    if( fp == NULL )
+    {
+        return false;
+    }
+    data.clear();
+    uint8_t buf[4096];
+    size_t n;
+    while( (n = ::fread(buf, 1, sizeof(buf), fp)) > 0 )
+    {
+        data.insert(data.end(), buf, buf + n);
+    }
+    ::fclose(fp);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+//  画像ファイルの内容のハッシュ値（FNV-1a 64bit）
+//  同じ内容の画像を展開済みのものと共有するために使う
+//------------------------------------------------------------------------------
+uint64_t PNGImage::hash(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for( size_t n = 0 ; n < size ; n++ )
+    {
+        h ^= data[n];
+        h *= 0x100000001B3ULL;
     }
+    return h;
+}
+
+//------------------------------------------------------------------------------
+//  width x height に縮小した画像を dest に作る（面積平均法）
+//  縮小先の各画素には、対応する元画像の矩形領域の平均色を割り当てる
+//------------------------------------------------------------------------------
+void PNGImage::shrink(int width, int height, PNGImage& dest)
+{
+    dest.m_width = width;
+    dest.m_height = height;
+    dest.m_data.resize(width * height);
+    if( m_width == 0 || m_height == 0 )
+    {
+        std::fill(dest.m_data.begin(), dest.m_data.end(), 0x0000);
+        return;
+    }
+
+    for( int y = 0 ; y < height ; y++ )
+    {
+        int sy0 = y * m_height / height;
+        int sy1 = std::max((y + 1) * m_height / height, sy0 + 1);
+        for( int x = 0 ; x < width ; x++ )
+        {
+            int sx0 = x * m_width / width;
+            int sx1 = std::max((x + 1) * m_width / width, sx0 + 1);
+            uint32_t red = 0, green = 0, blue = 0;
+            for( int sy = sy0 ; sy < sy1 ; sy++ )
+            {
+                const uint16_t *p = &m_data[sy * m_width + sx0];
+                for( int sx = sx0 ; sx < sx1 ; sx++, p++ )
+                {
+                    red   += (*p >> 11) & 0x1F;
+                    green += (*p >> 5) & 0x3F;
+                    blue  += *p & 0x1F;
+                }
+            }
+            uint32_t n = (sy1 - sy0) * (sx1 - sx0);
+            red   = (red + n / 2) / n;
+            green = (green + n / 2) / n;
+            blue  = (blue + n / 2) / n;
+            dest.m_data[y * width + x] = (uint16_t)((red << 11) | (green << 5) | blue);
+        }
+    }
+}
 
-    m_data.resize(m_width * m_height);
+//------------------------------------------------------------------------------
+//  １次元のボックスブラー（端は端の画素を繰り返したものとして扱う）
+//  src, dest は stride 間隔で len 個の要素を持つ
+//------------------------------------------------------------------------------
+static void boxBlur(const int *src, int *dest, int len, int stride, int radius)
+{
+    int window = radius * 2 + 1;
+    int sum = src[0] * (radius + 1);
+    for( int n = 1 ; n <= radius ; n++ )
+    {
+        sum += src[std::min(n, len - 1) * stride];
+    }
+    for( int n = 0 ; n < len ; n++ )
+    {
+        dest[n * stride] = (sum + window / 2) / window;
+        sum += src[std::min(n + radius + 1, len - 1) * stride];
+        sum -= src[std::max(n - radius, 0) * stride];
+    }
+}
 
-    for( int y = 0; y < m_height ; y++ )
+//------------------------------------------------------------------------------
+//  半径 radius の横・縦のボックスブラーを passes 回かけた画像を dest に作る
+//  （３回程度でガウスぼかしに近くなる。計算量は radius によらない）
+//------------------------------------------------------------------------------
+void PNGImage::blur(int radius, int passes, PNGImage& dest)
+{
+    dest.m_width = m_width;
+    dest.m_height = m_height;
+    dest.m_data.resize(m_data.size());
+    if( m_data.empty() )
+    {
+        return;
+    }
+
+    // RGB565 のままでは加算できないので、チャンネルごとに分けて処理する
+    int size = m_width * m_height;
+    std::vector<int> channel[3], work(size);
+    for( int c = 0 ; c < 3 ; c++ )
     {
+        channel[c].resize(size);
+    }
+    for( int n = 0 ; n < size ; n++ )
+    {
+        channel[0][n] = (m_data[n] >> 11) & 0x1F;
+        channel[1][n] = (m_data[n] >> 5) & 0x3F;
+        channel[2][n] = m_data[n] & 0x1F;
+    }
+
+    for( int c = 0 ; c < 3 ; c++ )
+    {
+        int *p = &channel[c][0];
+        for( int pass = 0 ; pass < passes ; pass++ )
+        {
+            for( int y = 0 ; y < m_height ; y++ )
+            {
+                boxBlur(p + y * m_width, &work[y * m_width], m_width, 1, radius);
+            }
+            for( int x = 0 ; x < m_width ; x++ )
+            {
+                boxBlur(&work[x], p + x, m_height, m_width, radius);
+            }
+        }
+    }
+
+    for( int n = 0 ; n < size ; n++ )
+    {
+        dest.m_data[n] = (uint16_t)((channel[0][n] << 11) | (channel[1][n] << 5) | channel[2][n]);
+    }
+}
+
+//------------------------------------------------------------------------------
+//  画像の代表色を count 色求めて、占める割合の大きい順に colors へ格納する
+//  色を各チャンネル 4bit のヒストグラムにまとめてから、ビン単位で k-means を行う
+//------------------------------------------------------------------------------
+void PNGImage::getDominantColors(int count, std::vector<uint16_t>& colors)
+{
+    struct Bin
+    {
+        int      r, g, b;   // ビンの中心の色（各 8bit）
+        uint32_t n;
+        int      cluster;
+    };
+    struct Cluster
+    {
+        double   r, g, b;
+        uint32_t n;
+    };
+
+    colors.clear();
+    std::vector<uint32_t> histogram(4096, 0);
+    for( auto i = m_data.begin() ; i != m_data.end() ; i++ )
+    {
+        int r = (*i >> 12) & 0x0F;
+        int g = (*i >> 7) & 0x0F;
+        int b = (*i >> 1) & 0x0F;
+        histogram[(r << 8) | (g << 4) | b]++;
+    }
+
+    std::vector<Bin> bins;
+    for( int n = 0 ; n < 4096 ; n++ )
+    {
+        if( histogram[n] > 0 )
+        {
+            Bin bin = { ((n >> 8) << 4) | 8, (((n >> 4) & 0x0F) << 4) | 8, ((n & 0x0F) << 4) | 8, histogram[n], 0 };
+            bins.push_back(bin);
+        }
+    }
+    if( bins.empty() )
+    {
+        return;
+    }
+    std::sort(bins.begin(), bins.end(), [](const Bin& a, const Bin& b){ return a.n > b.n; });
+
+    // 初期値は頻度の高いビンから、既に選んだものと離れたものを選ぶ
+    const int MIN_DISTANCE = 48 * 48;
+    std::vector<Cluster> clusters;
+    for( auto i = bins.begin() ; i != bins.end() && (int)clusters.size() < count ; i++ )
+    {
+        bool separated = true;
+        for( auto c = clusters.begin() ; c != clusters.end() ; c++ )
+        {
+            double dr = i->r - c->r, dg = i->g - c->g, db = i->b - c->b;
+            if( dr * dr + dg * dg + db * db < MIN_DISTANCE )
+            {
+                separated = false;
+                break;
+            }
+        }
+        if( separated )
+        {
+            Cluster c = { (double)i->r, (double)i->g, (double)i->b, 0 };
+            clusters.push_back(c);
+        }
+    }
+
+    for( int iteration = 0 ; iteration < 8 ; iteration++ )
+    {
+        for( auto i = bins.begin() ; i != bins.end() ; i++ )
+        {
+            double best = 1e9;
+            for( int c = 0 ; c < (int)clusters.size() ; c++ )
+            {
+                double dr = i->r - clusters[c].r, dg = i->g - clusters[c].g, db = i->b - clusters[c].b;
+                double d = dr * dr + dg * dg + db * db;
+                if( d < best )
+                {
+                    best = d;
+                    i->cluster = c;
+                }
+            }
+        }
+        std::vector<Cluster> sums(clusters.size(), Cluster{ 0.0, 0.0, 0.0, 0 });
+        for( auto i = bins.begin() ; i != bins.end() ; i++ )
+        {
+            Cluster& s = sums[i->cluster];
+            s.r += (double)i->r * i->n;
+            s.g += (double)i->g * i->n;
+            s.b += (double)i->b * i->n;
+            s.n += i->n;
+        }
+        for( size_t c = 0 ; c < clusters.size() ; c++ )
+        {
+            if( sums[c].n > 0 )
+            {
+                clusters[c].r = sums[c].r / sums[c].n;
+                clusters[c].g = sums[c].g / sums[c].n;
+                clusters[c].b = sums[c].b / sums[c].n;
+            }
+            clusters[c].n = sums[c].n;
+        }
+    }
+
+    std::sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b){ return a.n > b.n; });
+    for( auto c = clusters.begin() ; c != clusters.end() ; c++ )
+    {
+        if( c->n == 0 )
+        {
+            continue;
+        }
+        uint16_t r = (uint16_t)(c->r + 0.5), g = (uint16_t)(c->g + 0.5), b = (uint16_t)(c->b + 0.5);
+        colors.push_back(((r << 8) & 0xF800) + ((g << 3) & 0x07E0) + (b >> 3));
+    }
+}
+
+//==============================================================================
+//  PackedImage
+//  符号（先頭バイトで種類を区別する。prev は直前の画素、index は最近の色の表）
+//      00iiiiii            : index[i] の色
+//      01rrggbb            : prev からの差分（各 -2〜1）
+//      10nnnnnn (〜0xBE)   : prev を n+1 個繰り返す
+//      0xBF, lo, hi        : 色をそのまま（RGB565）
+//      11gggggg, rrrrbbbb  : G の差分(-32〜31) と、それに対する R, B の差分(各 -8〜7)
+//==============================================================================
+static const uint8_t PACK_INDEX = 0x00;
+static const uint8_t PACK_DIFF  = 0x40;
+static const uint8_t PACK_RUN   = 0x80;
+static const uint8_t PACK_RAW   = 0xBF;
+static const uint8_t PACK_LUMA  = 0xC0;
+static const int     PACK_MAX_RUN = 63;
+
+static inline int packHash(uint16_t c)
+{
+    return ((c >> 11) * 3 + ((c >> 5) & 0x3F) * 5 + (c & 0x1F) * 7) & 0x3F;
+}
+
+//------------------------------------------------------------------------------
+PackedImage::PackedImage() : m_width(0), m_height(0), m_raw(false)
+{
+
+}
+
+//------------------------------------------------------------------------------
+void PackedImage::pack(PNGImage& image)
+{
+    m_width = image.getWidth();
+    m_height = image.getHeight();
+    m_data.clear();
+    m_rowOffsets.resize(m_height);
+
+    const uint16_t *src = image.getData().empty() ? NULL : &image.getData()[0];
+    for( int y = 0 ; y < m_height ; y++ )
+    {
+        m_rowOffsets[y] = (uint32_t)m_data.size();
+        uint16_t index[64] = { 0 };
+        uint16_t prev = 0;
+        int run = 0;
         for( int x = 0 ; x < m_width ; x++ )
         {
-            uint16_t red   = (uint16_t)*(datap[y]+3*x);
-            uint16_t green = (uint16_t)*(datap[y]+3*x+1);
-            uint16_t blue  = (uint16_t)*(datap[y]+3*x+2);
-            if( x == 2 && y == 30 )
+            uint16_t c = *src++;
+            if( c == prev )
+            {
+                run++;
+                if( run == PACK_MAX_RUN || x == m_width - 1 )
+                {
+                    m_data.push_back(PACK_RUN | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if( run > 0 )
+            {
+                m_data.push_back(PACK_RUN | (run - 1));
+                run = 0;
+            }
+
+            int h = packHash(c);
+            if( index[h] == c )
+            {
+                m_data.push_back(PACK_INDEX | h);
+            }
+            else
             {
-                std::cout << red << ", " << green << ", " << blue << std::endl; 
+                index[h] = c;
+                int dr = (c >> 11) - (prev >> 11);
+                int dg = ((c >> 5) & 0x3F) - ((prev >> 5) & 0x3F);
+                int db = (c & 0x1F) - (prev & 0x1F);
+                if( dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1 )
+                {
+                    m_data.push_back(PACK_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                }
+                else if( dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7 )
+                {
+                    m_data.push_back(PACK_LUMA | (dg + 32));
+                    m_data.push_back(((dr - dg + 8) << 4) | (db - dg + 8));
+                }
+                else
+                {
+                    m_data.push_back(PACK_RAW);
+                    m_data.push_back(c & 0xFF);
+                    m_data.push_back(c >> 8);
+                }
             }
-            m_data[y*m_width+x] = ((red << 8) & 0xF800) + ((green << 3) & 0x07E0) + (blue >> 3);
+            prev = c;
         }
     }
-    ::png_destroy_read_struct(&png, &info, NULL);
-    ::fclose(fp);
+
+    // ノイズの多い画像などで小さくならなければ、そのまま保持する
+    size_t rawSize = image.getData().size() * sizeof(uint16_t);
+    m_raw = (m_data.size() >= rawSize);
+    if( m_raw )
+    {
+        m_data.resize(rawSize);
+        if( rawSize > 0 )
+        {
+            ::memcpy(&m_data[0], &image.getData()[0], rawSize);
+        }
+        m_rowOffsets.clear();
+    }
+    m_data.shrink_to_fit();
+    m_rowOffsets.shrink_to_fit();
+}
+
+//------------------------------------------------------------------------------
+//  y 行目の x 番目から len 画素を dest へ展開する
+//------------------------------------------------------------------------------
+void PackedImage::unpackRow(int y, int x, int len, uint16_t *dest)
+{
+    if( m_raw )
+    {
+        len = std::min(len, m_width - x);
+        ::memcpy(dest, &m_data[(y * m_width + x) * sizeof(uint16_t)], len * sizeof(uint16_t));
+        return;
+    }
+
+    const uint8_t *p = &m_data[m_rowOffsets[y]];
+    uint16_t index[64] = { 0 };
+    uint16_t c = 0;
+    int end = std::min(x + len, m_width);
+    int n = 0;
+    while( n < end )
+    {
+        uint8_t b = *p++;
+        int count = 1;
+        if( b < PACK_DIFF )
+        {
+            c = index[b];
+        }
+        else if( b < PACK_RUN )
+        {
+            int r = (c >> 11) + ((b >> 4) & 0x03) - 2;
+            int g = ((c >> 5) & 0x3F) + ((b >> 2) & 0x03) - 2;
+            int bl = (c & 0x1F) + (b & 0x03) - 2;
+            c = (uint16_t)((r << 11) | (g << 5) | bl);
+            index[packHash(c)] = c;
+        }
+        else if( b < PACK_RAW )
+        {
+            count = (b & 0x3F) + 1;
+        }
+        else if( b == PACK_RAW )
+        {
+            c = (uint16_t)(p[0] | (p[1] << 8));
+            p += 2;
+            index[packHash(c)] = c;
+        }
+        else
+        {
+            int dg = (b & 0x3F) - 32;
+            int r = (c >> 11) + dg + (*p >> 4) - 8;
+            int g = ((c >> 5) & 0x3F) + dg;
+            int bl = (c & 0x1F) + dg + (*p & 0x0F) - 8;
+            p++;
+            c = (uint16_t)((r << 11) | (g << 5) | bl);
+            index[packHash(c)] = c;
+        }
+
+        for( ; count > 0 && n < end ; count--, n++ )
+        {
+            if( n >= x )
+            {
+                dest[n - x] = c;
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//  幅 width・高さ height（１行は stride 画素）の領域 dest の (left, top) に画像を展開する
+//  領域の外にはみ出す部分は展開しない
+//------------------------------------------------------------------------------
+void PackedImage::unpack(int left, int top, uint16_t *dest, int width, int height, int stride)
+{
+    int x0 = std::max(left, 0);
+    int y0 = std::max(top, 0);
+    int x1 = std::min(left + m_width, width);
+    int y1 = std::min(top + m_height, height);
+    if( x1 <= x0 )
+    {
+        return;
+    }
+    for( int y = y0 ; y < y1 ; y++ )
+    {
+        unpackRow(y - top, x0 - left, x1 - x0, dest + (size_t)y * stride + x0);
+    }
 }
 
 //------------------------------------------------------------------------------
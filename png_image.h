@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 
 class PNGImage
 {
@@ -14,12 +15,42 @@ class PNGImage
     public:
         PNGImage();
         void read(const char *path);
+        void read(const uint8_t *data, size_t size);
+        void shrink(int width, int height, PNGImage& dest);
+        void blur(int radius, int passes, PNGImage& dest);
+        void getDominantColors(int count, std::vector<uint16_t>& colors);
+        static bool load(const char *path, std::vector<uint8_t>& data);
+        static uint64_t hash(const uint8_t *data, size_t size);
         int getWidth(){ return m_width; }
         int getHeight(){ return m_height; }
+        std::vector<uint16_t>& getData(){ return m_data; }
         uint16_t getPixel(int x, int y){
             if( m_width == 0 || m_height == 0 ){ return 0x0000; }
             return m_data[m_width*y+x];
         }
 };
 
+//------------------------------------------------------------------------------
+//  RGB565 画像を可逆圧縮して保持する（QOI 風の１バイト単位の符号）
+//  行ごとに独立して符号化しているので、描画時は必要な行だけを
+//  フレームバッファの行へ直接展開できる
+//------------------------------------------------------------------------------
+class PackedImage
+{
+    private:
+        int m_width;
+        int m_height;
+        std::vector<uint8_t>  m_data;
+        std::vector<uint32_t> m_rowOffsets;     // 各行の符号の先頭位置
+        bool m_raw;                             // 圧縮せずに RGB565 のまま保持している場合は true
+    public:
+        PackedImage();
+        void pack(PNGImage& image);
+        void unpackRow(int y, int x, int len, uint16_t *dest);
+        void unpack(int left, int top, uint16_t *dest, int width, int height, int stride);
+        int getWidth(){ return m_width; }
+        int getHeight(){ return m_height; }
+        size_t getDataSize(){ return m_data.size() + m_rowOffsets.size() * sizeof(uint32_t); }
+};
+
 #endif
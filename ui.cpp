@@ -575,6 +575,13 @@ void UIWidget::drawImage(Rect& rc, std::vector<uint16_t>& image)
      m_gfx.drawImage(r, image);
 }
 
+//------------------------------------------------------------------------------
+void UIWidget::drawImage(Rect& rc, PackedImage& image)
+{
+     Rect r = offsetToScreen(rc);
+     m_gfx.drawImage(r, image);
+}
+
 //------------------------------------------------------------------------------
 void UIWidget::getImage(Rect& rc, std::vector<uint16_t>& image)
 {
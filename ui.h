@@ -146,6 +146,7 @@ class UIWidget
           void drawText(Rect& r, const char *str, uint8_t align, uint16_t fgcol);
           void drawText(Rect& r, const char *str, uint8_t align, uint16_t fgcol, uint16_t bkcol);
           void drawImage(Rect& r, std::vector<uint16_t>& image);
+          void drawImage(Rect& r, PackedImage& image);
           void getImage(Rect& r, std::vector<uint16_t>& image);
 
           static uint16_t RGBToColor(uint8_t r, uint8_t g, uint8_t b){